@@ -103,12 +103,18 @@ static bool dln2_adc_enable(struct dln2_slot *slot, bool enable) {
     _adc_driver->port_enable(*port);
   }
   if (!enable) {
+    DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX) = {0};
+
     _adc_driver->cancel_repeating_timer(dln2_adc_event_timer);
     _adc_driver->port_disable(*port);
     for (uint16_t chan = 0; chan < _adc_driver->ports[*port].channel_count;
          chan++) {
-      dln2_pin_free(_adc_driver->ports[*port].channels[chan], DLN2_MODULE_ADC);
+      dln2_pin_mask_add(pins, _adc_driver->ports[*port].channels[chan]);
     }
+    // Pins that are owned by someone else were never ours to free
+    for (uint32_t w = 0; w < DLN2_PIN_WORDS; w++)
+      pins[w] &= dln2_pin_module_word(DLN2_MODULE_ADC, w);
+    dln2_pin_group_free(pins, DLN2_MODULE_ADC, NULL);
   }
 
   put_unaligned_le16(conflict, dln2_slot_response_data(slot));
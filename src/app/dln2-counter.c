@@ -0,0 +1,458 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * Pulse counter and quadrature decoder
+ *
+ * Edges are counted by the hardware counters, the firmware only extends them
+ * to 64 bits from the wrap callback. With a limit set the count runs from 0 to
+ * limit - 1 and the number of times it wrapped is kept alongside, e.g. encoder
+ * counts within a revolution and the number of revolutions.
+ *
+ * dln2_counter_task() compares the counts with the event configuration and
+ * sends DLN2_COUNTER_CONDITION_MET_EV when a threshold is crossed or the count
+ * wraps at the limit.
+ */
+
+#include "counter_driver.h"
+#include "dln2.h"
+#include "dln2_log.h"
+
+#define DLN2_COUNTER_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_COUNTER)
+
+#define DLN2_COUNTER_GET_PORT_COUNT DLN2_COUNTER_CMD(0x00)
+#define DLN2_COUNTER_ENABLE DLN2_COUNTER_CMD(0x01)
+#define DLN2_COUNTER_DISABLE DLN2_COUNTER_CMD(0x02)
+#define DLN2_COUNTER_IS_ENABLED DLN2_COUNTER_CMD(0x03)
+#define DLN2_COUNTER_SET_MODE DLN2_COUNTER_CMD(0x04)
+#define DLN2_COUNTER_GET_MODE DLN2_COUNTER_CMD(0x05)
+#define DLN2_COUNTER_GET_VALUE DLN2_COUNTER_CMD(0x06)
+#define DLN2_COUNTER_RESET DLN2_COUNTER_CMD(0x07)
+#define DLN2_COUNTER_SUSPEND DLN2_COUNTER_CMD(0x08)
+#define DLN2_COUNTER_RESUME DLN2_COUNTER_CMD(0x09)
+#define DLN2_COUNTER_IS_SUSPENDED DLN2_COUNTER_CMD(0x0A)
+#define DLN2_COUNTER_SET_EVENT_CFG DLN2_COUNTER_CMD(0x0C)
+#define DLN2_COUNTER_GET_EVENT_CFG DLN2_COUNTER_CMD(0x0D)
+#define DLN2_COUNTER_CONDITION_MET_EV DLN2_COUNTER_CMD(0x10)
+
+#define DLN2_COUNTER_EVENT_THRESHOLD 0x01
+#define DLN2_COUNTER_EVENT_LIMIT 0x02
+
+#define DLN2_COUNTER_MAX_PORTS 8
+
+struct dln2_counter_port {
+  bool enabled;
+  bool suspended;
+  uint8_t mode;
+  uint8_t event_mask;
+  uint32_t limit; // 0 for a plain 32-bit count
+  int32_t threshold;
+
+  // Counts folded away by the hardware, updated from the wrap callback
+  volatile int64_t base;
+  volatile uint32_t seq;
+  int64_t offset; // total at the last reset
+
+  // State at the last event check
+  bool above;
+  int32_t wraps;
+};
+
+static struct counter_driver *_counter_driver;
+static struct dln2_counter_port dln2_counter_ports[DLN2_COUNTER_MAX_PORTS];
+
+static void dln2_counter_wrap(uint8_t port, int32_t delta) {
+  if (port >= DLN2_COUNTER_MAX_PORTS)
+    return;
+
+  dln2_counter_ports[port].base += delta;
+  dln2_counter_ports[port].seq++;
+}
+
+static int64_t dln2_counter_total(uint8_t port) {
+  struct dln2_counter_port *p = &dln2_counter_ports[port];
+  uint32_t seq;
+  int64_t base;
+  int32_t hw;
+
+  // base is 64-bit, retry if the wrap callback ran while reading it
+  do {
+    seq = p->seq;
+    base = p->base;
+    hw = _counter_driver->get(port);
+  } while (seq != p->seq);
+
+  return base + hw - p->offset;
+}
+
+static void dln2_counter_split(uint8_t port, int64_t total, int32_t *value,
+                               int32_t *wraps) {
+  uint32_t limit = dln2_counter_ports[port].limit;
+
+  if (!limit) {
+    *value = (int32_t)total;
+    *wraps = 0;
+    return;
+  }
+
+  int64_t w = total / limit;
+  int64_t r = total % limit;
+  if (r < 0) {
+    r += limit;
+    w--;
+  }
+  *value = r;
+  *wraps = w;
+}
+
+// Forget the pending event state so only changes from now on are reported
+static void dln2_counter_rearm(uint8_t port) {
+  struct dln2_counter_port *p = &dln2_counter_ports[port];
+  int32_t value;
+
+  dln2_counter_split(port, dln2_counter_total(port), &value, &p->wraps);
+  p->above = value >= p->threshold;
+}
+
+static bool dln2_counter_port_valid(uint8_t port) {
+  return _counter_driver && port < _counter_driver->port_count &&
+         port < DLN2_COUNTER_MAX_PORTS;
+}
+
+static void dln2_counter_port_pins(uint8_t port, uint32_t *pins) {
+  struct counter_port *cp = &_counter_driver->ports[port];
+  uint8_t mode = dln2_counter_ports[port].mode;
+
+  dln2_pin_mask_add(pins, cp->pin_a);
+  if (mode == COUNTER_MODE_DIRECTION || mode == COUNTER_MODE_QUADRATURE)
+    dln2_pin_mask_add(pins, cp->pin_b);
+}
+
+static bool dln2_counter_enable(struct dln2_slot *slot, bool enable) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX) = {0};
+  struct dln2_pin_conflict conflict;
+  uint16_t res;
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+  LOG_INFO("%s: port=%u\n",
+           enable ? "DLN2_COUNTER_ENABLE" : "DLN2_COUNTER_DISABLE", *port);
+
+  if (!dln2_counter_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_counter_port *p = &dln2_counter_ports[*port];
+  if (p->enabled == enable)
+    return dln2_response(slot, 0);
+
+  dln2_counter_port_pins(*port, pins);
+
+  if (enable) {
+    res = dln2_pin_group_request(pins, DLN2_MODULE_COUNTER, &conflict);
+    if (res) {
+      LOG_INFO("    pin %u in use by module 0x%02x\n", conflict.pin,
+               conflict.module);
+      return dln2_response_error(slot, res);
+    }
+
+    p->base = 0;
+    p->offset = 0;
+    if (!_counter_driver->enable(*port, p->mode)) {
+      dln2_pin_group_free(pins, DLN2_MODULE_COUNTER, NULL);
+      return dln2_response_error(slot, DLN2_RES_INVALID_MODE);
+    }
+    p->enabled = true;
+    p->suspended = false;
+    dln2_counter_rearm(*port);
+  } else {
+    p->enabled = false;
+    _counter_driver->disable(*port);
+    dln2_pin_group_free(pins, DLN2_MODULE_COUNTER, NULL);
+  }
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_counter_set_mode(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t mode;
+    uint32_t limit;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_COUNTER_SET_MODE: port=%u mode=%u limit=%lu\n", cmd->port,
+           cmd->mode, (unsigned long)cmd->limit);
+
+  if (!dln2_counter_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if (cmd->mode > COUNTER_MODE_QUADRATURE)
+    return dln2_response_error(slot, DLN2_RES_INVALID_MODE);
+  if (cmd->limit > INT32_MAX)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+  struct dln2_counter_port *p = &dln2_counter_ports[cmd->port];
+
+  // The pins and the hardware are set up for the mode at enable
+  if (p->enabled && cmd->mode != p->mode)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  p->mode = cmd->mode;
+  p->limit = cmd->limit;
+  if (p->enabled)
+    dln2_counter_rearm(cmd->port);
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_counter_get_mode(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  struct {
+    uint8_t mode;
+    uint32_t limit;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+
+  if (!dln2_counter_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  rsp->mode = dln2_counter_ports[*port].mode;
+  rsp->limit = dln2_counter_ports[*port].limit;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+static bool dln2_counter_get_value(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  struct {
+    int32_t value;
+    int32_t wraps;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+  int32_t value, wraps;
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+
+  if (!dln2_counter_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if (!dln2_counter_ports[*port].enabled)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  dln2_counter_split(*port, dln2_counter_total(*port), &value, &wraps);
+  rsp->value = value;
+  rsp->wraps = wraps;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+static bool dln2_counter_reset(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+  LOG_INFO("DLN2_COUNTER_RESET: port=%u\n", *port);
+
+  if (!dln2_counter_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_counter_port *p = &dln2_counter_ports[*port];
+  if (p->enabled) {
+    _counter_driver->clear(*port);
+    p->offset = 0;
+    p->offset = dln2_counter_total(*port);
+    dln2_counter_rearm(*port);
+  }
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_counter_suspend(struct dln2_slot *slot, bool suspend) {
+  uint8_t *port = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+  LOG_INFO("%s: port=%u\n",
+           suspend ? "DLN2_COUNTER_SUSPEND" : "DLN2_COUNTER_RESUME", *port);
+
+  if (!dln2_counter_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_counter_port *p = &dln2_counter_ports[*port];
+  if (!p->enabled)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  if (p->suspended != suspend) {
+    _counter_driver->suspend(*port, suspend);
+    p->suspended = suspend;
+  }
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_counter_set_event_cfg(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t event_mask;
+    int32_t threshold;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_COUNTER_SET_EVENT_CFG: port=%u events=0x%02x threshold=%ld\n",
+           cmd->port, cmd->event_mask, (long)cmd->threshold);
+
+  if (!dln2_counter_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if (cmd->event_mask &
+      ~(DLN2_COUNTER_EVENT_THRESHOLD | DLN2_COUNTER_EVENT_LIMIT))
+    return dln2_response_error(slot, DLN2_RES_INVALID_EVENT_TYPE);
+
+  struct dln2_counter_port *p = &dln2_counter_ports[cmd->port];
+  p->event_mask = cmd->event_mask;
+  p->threshold = cmd->threshold;
+  if (p->enabled)
+    dln2_counter_rearm(cmd->port);
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_counter_get_event_cfg(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  struct {
+    uint8_t event_mask;
+    int32_t threshold;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+
+  if (!dln2_counter_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  rsp->event_mask = dln2_counter_ports[*port].event_mask;
+  rsp->threshold = dln2_counter_ports[*port].threshold;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+bool dln2_handle_counter(struct dln2_slot *slot) {
+  struct dln2_header *hdr = dln2_slot_header(slot);
+  uint8_t *port = dln2_slot_header_data(slot);
+
+  switch (hdr->id) {
+  case DLN2_COUNTER_GET_PORT_COUNT:
+    DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+    if (!_counter_driver)
+      return dln2_response_u8(slot, 0);
+    return dln2_response_u8(slot, _counter_driver->port_count <
+                                          DLN2_COUNTER_MAX_PORTS
+                                      ? _counter_driver->port_count
+                                      : DLN2_COUNTER_MAX_PORTS);
+  case DLN2_COUNTER_ENABLE:
+    return dln2_counter_enable(slot, true);
+  case DLN2_COUNTER_DISABLE:
+    return dln2_counter_enable(slot, false);
+  case DLN2_COUNTER_IS_ENABLED:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_counter_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u8(slot, dln2_counter_ports[*port].enabled);
+  case DLN2_COUNTER_SET_MODE:
+    return dln2_counter_set_mode(slot);
+  case DLN2_COUNTER_GET_MODE:
+    return dln2_counter_get_mode(slot);
+  case DLN2_COUNTER_GET_VALUE:
+    return dln2_counter_get_value(slot);
+  case DLN2_COUNTER_RESET:
+    return dln2_counter_reset(slot);
+  case DLN2_COUNTER_SUSPEND:
+    return dln2_counter_suspend(slot, true);
+  case DLN2_COUNTER_RESUME:
+    return dln2_counter_suspend(slot, false);
+  case DLN2_COUNTER_IS_SUSPENDED:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_counter_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u8(slot, dln2_counter_ports[*port].suspended);
+  case DLN2_COUNTER_SET_EVENT_CFG:
+    return dln2_counter_set_event_cfg(slot);
+  case DLN2_COUNTER_GET_EVENT_CFG:
+    return dln2_counter_get_event_cfg(slot);
+  default:
+    LOG_INFO("Counter command not supported: 0x%04x\n", hdr->id);
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+}
+
+static bool dln2_counter_event(uint8_t port, uint8_t type, int32_t value,
+                               int32_t wraps) {
+  struct {
+    uint8_t port;
+    uint8_t type;
+    int32_t value;
+    int32_t wraps;
+  } TU_ATTR_PACKED *event;
+
+  struct dln2_slot *slot = dln2_get_slot();
+  if (!slot)
+    return false;
+
+  struct dln2_header *hdr = dln2_slot_header(slot);
+  hdr->size = sizeof(*hdr) + sizeof(*event);
+  hdr->id = DLN2_COUNTER_CONDITION_MET_EV;
+  hdr->echo = 0;
+  hdr->handle = DLN2_HANDLE_EVENT;
+
+  event = dln2_slot_header_data(slot);
+  event->port = port;
+  event->type = type;
+  event->value = value;
+  event->wraps = wraps;
+
+  LOG_INFO("%s: port=%u type=%u value=%ld wraps=%ld\n", __func__, port, type,
+           (long)value, (long)wraps);
+
+  dln2_queue_slot_in(slot);
+  return true;
+}
+
+// The state is only updated once the event is queued, so it is retried
+void dln2_counter_task(void) {
+  if (!_counter_driver)
+    return;
+
+  for (uint8_t port = 0; port < DLN2_COUNTER_MAX_PORTS; port++) {
+    struct dln2_counter_port *p = &dln2_counter_ports[port];
+    int32_t value, wraps;
+
+    if (!p->enabled || !p->event_mask)
+      continue;
+
+    dln2_counter_split(port, dln2_counter_total(port), &value, &wraps);
+
+    if (p->event_mask & DLN2_COUNTER_EVENT_LIMIT && p->limit &&
+        wraps != p->wraps) {
+      if (!dln2_counter_event(port, DLN2_COUNTER_EVENT_LIMIT, value, wraps))
+        return;
+      p->wraps = wraps;
+    }
+
+    bool above = value >= p->threshold;
+    if (p->event_mask & DLN2_COUNTER_EVENT_THRESHOLD && above != p->above) {
+      if (!dln2_counter_event(port, DLN2_COUNTER_EVENT_THRESHOLD, value,
+                              wraps))
+        return;
+      p->above = above;
+    }
+  }
+}
+
+void dln2_counter_init(struct dln2_peripherials *peripherals) {
+  _counter_driver = peripherals->counter;
+  if (_counter_driver)
+    _counter_driver->set_wrap_callback(dln2_counter_wrap);
+}
@@ -0,0 +1,345 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * DAC module, not part of the DLN protocol
+ *
+ * Besides single value writes one channel at a time can play a waveform that
+ * the host streams in. The host queues samples with DLN2_DAC_STREAM_WRITE, the
+ * response tells how much room is left. The driver plays a double buffer at a
+ * fixed rate and each half is refilled from the queue in its callback as soon
+ * as it has been played. When the queue runs dry the last sample is held and
+ * the missing samples are counted as underruns.
+ */
+
+#include "dac_driver.h"
+#include "dln2.h"
+#include "dln2_log.h"
+
+#define DLN2_DAC_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_DAC)
+
+#define DLN2_DAC_GET_PORT_COUNT DLN2_DAC_CMD(0x00)
+#define DLN2_DAC_GET_CHANNEL_COUNT DLN2_DAC_CMD(0x01)
+#define DLN2_DAC_CHANNEL_ENABLE DLN2_DAC_CMD(0x05)
+#define DLN2_DAC_CHANNEL_DISABLE DLN2_DAC_CMD(0x06)
+#define DLN2_DAC_GET_RESOLUTION DLN2_DAC_CMD(0x09)
+#define DLN2_DAC_CHANNEL_SET_VAL DLN2_DAC_CMD(0x0A)
+#define DLN2_DAC_STREAM_START DLN2_DAC_CMD(0x60)
+#define DLN2_DAC_STREAM_WRITE DLN2_DAC_CMD(0x61)
+#define DLN2_DAC_STREAM_STOP DLN2_DAC_CMD(0x62)
+#define DLN2_DAC_STREAM_GET_STATUS DLN2_DAC_CMD(0x63)
+
+#define DLN2_DAC_MAX_PORTS 2
+#define DLN2_DAC_MAX_CHANNELS 4
+
+// Samples queued from the host, must be a power of two
+#define DLN2_DAC_FIFO_SIZE 2048
+// Samples in the double buffer the driver plays from
+#define DLN2_DAC_BUF_SIZE 256
+
+struct dln2_dac_port_chan {
+  uint8_t port;
+  uint8_t channel;
+} TU_ATTR_PACKED;
+
+static struct dac_driver *_dac_driver;
+static uint8_t dln2_dac_enabled[DLN2_DAC_MAX_PORTS]; // channel bitmask
+
+static uint16_t dln2_dac_fifo[DLN2_DAC_FIFO_SIZE];
+static uint16_t dln2_dac_buf[DLN2_DAC_BUF_SIZE];
+
+static struct {
+  // Free running, head is written by the handlers, tail by the callback
+  volatile uint32_t head;
+  volatile uint32_t tail;
+
+  volatile bool running;
+  uint8_t port;
+  uint8_t channel;
+  uint32_t rate;
+  uint16_t last;
+  volatile uint32_t played;
+  volatile uint32_t underruns;
+} dln2_dac_stream;
+
+static uint32_t dln2_dac_fifo_free(void) {
+  return DLN2_DAC_FIFO_SIZE - (dln2_dac_stream.head - dln2_dac_stream.tail);
+}
+
+static void dln2_dac_fill(uint16_t *samples, uint32_t count) {
+  uint32_t tail = dln2_dac_stream.tail;
+  uint32_t avail = dln2_dac_stream.head - tail;
+  uint32_t n = avail < count ? avail : count;
+
+  for (uint32_t i = 0; i < n; i++)
+    samples[i] = dln2_dac_fifo[(tail + i) & (DLN2_DAC_FIFO_SIZE - 1)];
+  dln2_dac_stream.tail = tail + n;
+
+  if (n)
+    dln2_dac_stream.last = samples[n - 1];
+  for (uint32_t i = n; i < count; i++)
+    samples[i] = dln2_dac_stream.last;
+
+  dln2_dac_stream.played += count;
+  dln2_dac_stream.underruns += count - n;
+}
+
+// Driver callback, one that races with STREAM_STOP leaves the FIFO alone
+static void dln2_dac_stream_callback(uint16_t *samples, uint32_t count) {
+  if (!dln2_dac_stream.running) {
+    for (uint32_t i = 0; i < count; i++)
+      samples[i] = dln2_dac_stream.last;
+    return;
+  }
+  dln2_dac_fill(samples, count);
+}
+
+static bool dln2_dac_port_valid(uint8_t port) {
+  return _dac_driver && port < _dac_driver->port_count &&
+         port < DLN2_DAC_MAX_PORTS;
+}
+
+static uint8_t dln2_dac_channel_count(uint8_t port) {
+  uint8_t count = _dac_driver->ports[port].channel_count;
+
+  return count < DLN2_DAC_MAX_CHANNELS ? count : DLN2_DAC_MAX_CHANNELS;
+}
+
+static uint16_t dln2_dac_check(const struct dln2_dac_port_chan *pc,
+                               bool enabled) {
+  if (!dln2_dac_port_valid(pc->port))
+    return DLN2_RES_INVALID_PORT_NUMBER;
+  if (pc->channel >= dln2_dac_channel_count(pc->port))
+    return DLN2_RES_INVALID_CHANNEL_NUMBER;
+  if (enabled && !(dln2_dac_enabled[pc->port] & (1U << pc->channel)))
+    return DLN2_RES_FAIL;
+  return DLN2_RES_SUCCESS;
+}
+
+static void dln2_dac_stream_stop(void) {
+  if (!dln2_dac_stream.running)
+    return;
+
+  // Stop the callback from advancing tail before dropping the queue
+  dln2_dac_stream.running = false;
+  _dac_driver->stream_stop(dln2_dac_stream.port, dln2_dac_stream.channel);
+  dln2_dac_stream.head = dln2_dac_stream.tail;
+}
+
+static bool dln2_dac_channel_enable(struct dln2_slot *slot, bool enable) {
+  struct dln2_dac_port_chan *pc = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*pc));
+  LOG_INFO("%s: port=%u chan=%u\n",
+           enable ? "DLN2_DAC_CHANNEL_ENABLE" : "DLN2_DAC_CHANNEL_DISABLE",
+           pc->port, pc->channel);
+
+  uint16_t res = dln2_dac_check(pc, false);
+  if (res)
+    return dln2_response_error(slot, res);
+
+  uint8_t bit = 1U << pc->channel;
+  uint16_t pin = _dac_driver->ports[pc->port].pins[pc->channel];
+
+  if (enable && !(dln2_dac_enabled[pc->port] & bit)) {
+    res = dln2_pin_request(pin, DLN2_MODULE_DAC);
+    if (res)
+      return dln2_response_error(slot, res);
+
+    if (!_dac_driver->channel_enable(pc->port, pc->channel)) {
+      dln2_pin_free(pin, DLN2_MODULE_DAC);
+      return dln2_response_error(slot, DLN2_RES_FAIL);
+    }
+    dln2_dac_enabled[pc->port] |= bit;
+  } else if (!enable && (dln2_dac_enabled[pc->port] & bit)) {
+    if (dln2_dac_stream.running && dln2_dac_stream.port == pc->port &&
+        dln2_dac_stream.channel == pc->channel)
+      dln2_dac_stream_stop();
+
+    _dac_driver->channel_disable(pc->port, pc->channel);
+    dln2_pin_free(pin, DLN2_MODULE_DAC);
+    dln2_dac_enabled[pc->port] &= ~bit;
+  }
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_dac_channel_set_val(struct dln2_slot *slot) {
+  struct {
+    struct dln2_dac_port_chan pc;
+    uint16_t value;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_DAC_CHANNEL_SET_VAL: port=%u chan=%u value=%u\n",
+           cmd->pc.port, cmd->pc.channel, cmd->value);
+
+  uint16_t res = dln2_dac_check(&cmd->pc, true);
+  if (res)
+    return dln2_response_error(slot, res);
+  if (cmd->value >> _dac_driver->ports[cmd->pc.port].bits)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+  // The stream owns the channel while it plays
+  if (dln2_dac_stream.running && dln2_dac_stream.port == cmd->pc.port &&
+      dln2_dac_stream.channel == cmd->pc.channel)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  _dac_driver->write(cmd->pc.port, cmd->pc.channel, cmd->value);
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_dac_stream_start(struct dln2_slot *slot) {
+  struct {
+    struct dln2_dac_port_chan pc;
+    uint32_t rate;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_DAC_STREAM_START: port=%u chan=%u rate=%lu queued=%lu\n",
+           cmd->pc.port, cmd->pc.channel, (unsigned long)cmd->rate,
+           (unsigned long)(dln2_dac_stream.head - dln2_dac_stream.tail));
+
+  uint16_t res = dln2_dac_check(&cmd->pc, true);
+  if (res)
+    return dln2_response_error(slot, res);
+  if (!_dac_driver->stream_start)
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  if (dln2_dac_stream.running)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  if (!cmd->rate)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+  dln2_dac_stream.port = cmd->pc.port;
+  dln2_dac_stream.channel = cmd->pc.channel;
+  dln2_dac_stream.played = 0;
+  dln2_dac_stream.underruns = 0;
+
+  // Whatever the host queued before starting goes out first, the samples
+  // go back in the queue if the hardware doesn't start
+  uint32_t tail = dln2_dac_stream.tail;
+  uint16_t last = dln2_dac_stream.last;
+  dln2_dac_fill(dln2_dac_buf, DLN2_DAC_BUF_SIZE);
+
+  // The first callback can come before stream_start() returns
+  dln2_dac_stream.running = true;
+  dln2_dac_stream.rate = _dac_driver->stream_start(
+      cmd->pc.port, cmd->pc.channel, cmd->rate, dln2_dac_buf,
+      DLN2_DAC_BUF_SIZE, dln2_dac_stream_callback);
+  if (!dln2_dac_stream.rate) {
+    dln2_dac_stream.running = false;
+    dln2_dac_stream.tail = tail;
+    dln2_dac_stream.last = last;
+    dln2_dac_stream.played = 0;
+    dln2_dac_stream.underruns = 0;
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  }
+
+  return dln2_response_u32(slot, dln2_dac_stream.rate);
+}
+
+static bool dln2_dac_stream_write(struct dln2_slot *slot) {
+  uint16_t *samples = dln2_slot_header_data(slot);
+  size_t len = dln2_slot_header_data_size(slot);
+  struct {
+    uint16_t written;
+    uint16_t free;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  if (len % sizeof(*samples))
+    return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+
+  uint32_t count = len / sizeof(*samples);
+  uint32_t room = dln2_dac_fifo_free();
+  if (count > room)
+    count = room;
+
+  // The response overlaps the samples, they are copied out before it's written
+  uint32_t head = dln2_dac_stream.head;
+  for (uint32_t i = 0; i < count; i++)
+    dln2_dac_fifo[(head + i) & (DLN2_DAC_FIFO_SIZE - 1)] = samples[i];
+  dln2_dac_stream.head = head + count;
+
+  rsp->written = count;
+  rsp->free = dln2_dac_fifo_free();
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+static bool dln2_dac_stream_get_status(struct dln2_slot *slot) {
+  struct {
+    uint8_t running;
+    uint16_t free;
+    uint32_t rate;
+    uint32_t played;
+    uint32_t underruns;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+
+  rsp->running = dln2_dac_stream.running;
+  rsp->free = dln2_dac_fifo_free();
+  rsp->rate = dln2_dac_stream.rate;
+  rsp->played = dln2_dac_stream.played;
+  rsp->underruns = dln2_dac_stream.underruns;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+bool dln2_handle_dac(struct dln2_slot *slot) {
+  struct dln2_header *hdr = dln2_slot_header(slot);
+  uint8_t *port = dln2_slot_header_data(slot);
+
+  switch (hdr->id) {
+  case DLN2_DAC_GET_PORT_COUNT:
+    DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+    if (!_dac_driver)
+      return dln2_response_u8(slot, 0);
+    return dln2_response_u8(slot, _dac_driver->port_count < DLN2_DAC_MAX_PORTS
+                                      ? _dac_driver->port_count
+                                      : DLN2_DAC_MAX_PORTS);
+  case DLN2_DAC_GET_CHANNEL_COUNT:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_dac_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u8(slot, dln2_dac_channel_count(*port));
+  case DLN2_DAC_CHANNEL_ENABLE:
+    return dln2_dac_channel_enable(slot, true);
+  case DLN2_DAC_CHANNEL_DISABLE:
+    return dln2_dac_channel_enable(slot, false);
+  case DLN2_DAC_GET_RESOLUTION:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_dac_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u8(slot, _dac_driver->ports[*port].bits);
+  case DLN2_DAC_CHANNEL_SET_VAL:
+    return dln2_dac_channel_set_val(slot);
+  case DLN2_DAC_STREAM_START:
+    return dln2_dac_stream_start(slot);
+  case DLN2_DAC_STREAM_WRITE:
+    return dln2_dac_stream_write(slot);
+  case DLN2_DAC_STREAM_STOP:
+    LOG_INFO("DLN2_DAC_STREAM_STOP\n");
+    DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+    dln2_dac_stream_stop();
+    return dln2_response(slot, 0);
+  case DLN2_DAC_STREAM_GET_STATUS:
+    return dln2_dac_stream_get_status(slot);
+  default:
+    LOG_INFO("DAC command not supported: 0x%04x\n", hdr->id);
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+}
+
+void dln2_dac_init(struct dln2_peripherials *peripherals) {
+  _dac_driver = peripherals->dac;
+}
@@ -0,0 +1,413 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * Frequency and duty cycle measurement
+ *
+ * The driver's capture callback adds up periods and high times until the
+ * averaging window is full and then latches the sums. dln2_freq_task() turns
+ * them into period, high time and duty cycle, and sends
+ * DLN2_FREQ_CONDITION_MET_EV when they moved more than the configured
+ * thresholds since the last event.
+ */
+
+#include "dln2.h"
+#include "dln2_log.h"
+#include "freq_driver.h"
+
+#define DLN2_FREQ_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_FREQ)
+
+#define DLN2_FREQ_GET_PORT_COUNT DLN2_FREQ_CMD(0x00)
+#define DLN2_FREQ_ENABLE DLN2_FREQ_CMD(0x01)
+#define DLN2_FREQ_DISABLE DLN2_FREQ_CMD(0x02)
+#define DLN2_FREQ_IS_ENABLED DLN2_FREQ_CMD(0x03)
+#define DLN2_FREQ_SET_WINDOW DLN2_FREQ_CMD(0x04)
+#define DLN2_FREQ_GET_WINDOW DLN2_FREQ_CMD(0x05)
+#define DLN2_FREQ_GET_VALUE DLN2_FREQ_CMD(0x06)
+#define DLN2_FREQ_SET_EVENT_CFG DLN2_FREQ_CMD(0x0C)
+#define DLN2_FREQ_GET_EVENT_CFG DLN2_FREQ_CMD(0x0D)
+#define DLN2_FREQ_CONDITION_MET_EV DLN2_FREQ_CMD(0x10)
+
+#define DLN2_FREQ_MAX_PORTS 4
+#define DLN2_FREQ_DEFAULT_WINDOW_US 100000
+#define DLN2_FREQ_MAX_WINDOW_US 10000000
+
+// Duty cycle and the relative period threshold are in 0.01% units
+#define DLN2_FREQ_DUTY_SCALE 10000
+
+struct dln2_freq_result {
+  uint32_t periods; // averaged over, 0 if the signal stopped
+  uint32_t period_ns;
+  uint32_t high_ns;
+  uint16_t duty;
+} TU_ATTR_PACKED;
+
+struct dln2_freq_port {
+  bool enabled;
+  uint32_t window_us;
+  volatile uint32_t window_ticks;
+
+  // Running sums, only touched by the capture callback. elapsed also counts
+  // the idle reports and only decides when the window is full.
+  uint64_t acc_elapsed_ticks;
+  uint32_t acc_periods;
+  uint64_t acc_period_ticks;
+  uint64_t acc_high_ticks;
+
+  // Sums of the last full window
+  volatile uint32_t seq;
+  uint32_t latch_periods;
+  uint64_t latch_period_ticks;
+  uint64_t latch_high_ticks;
+  uint32_t done_seq;
+
+  struct dln2_freq_result result;
+  bool valid;
+
+  bool events;
+  uint16_t period_threshold;
+  uint16_t duty_threshold;
+  struct dln2_freq_result reported;
+  bool report; // event pending
+};
+
+static struct freq_driver *_freq_driver;
+static struct dln2_freq_port dln2_freq_ports[DLN2_FREQ_MAX_PORTS];
+
+static void dln2_freq_capture(uint8_t port, uint32_t periods,
+                              uint32_t period_ticks, uint32_t high_ticks) {
+  if (port >= DLN2_FREQ_MAX_PORTS)
+    return;
+
+  struct dln2_freq_port *p = &dln2_freq_ports[port];
+  if (!p->enabled)
+    return;
+
+  p->acc_elapsed_ticks += period_ticks;
+  if (periods) {
+    p->acc_periods += periods;
+    p->acc_period_ticks += period_ticks;
+    p->acc_high_ticks += high_ticks;
+  }
+  if (p->acc_elapsed_ticks < p->window_ticks)
+    return;
+
+  p->latch_periods = p->acc_periods;
+  p->latch_period_ticks = p->acc_period_ticks;
+  p->latch_high_ticks = p->acc_high_ticks;
+  p->seq++;
+
+  p->acc_elapsed_ticks = 0;
+  p->acc_periods = 0;
+  p->acc_period_ticks = 0;
+  p->acc_high_ticks = 0;
+}
+
+static uint32_t dln2_freq_ticks_to_ns(uint64_t ticks, uint32_t periods) {
+  return ticks * 1000000000ULL / _freq_driver->clock_hz / periods;
+}
+
+// Pick up a latched window, returns true if there was a new one
+static bool dln2_freq_update(uint8_t port) {
+  struct dln2_freq_port *p = &dln2_freq_ports[port];
+  uint32_t seq, periods;
+  uint64_t period_ticks, high_ticks;
+
+  do {
+    seq = p->seq;
+    periods = p->latch_periods;
+    period_ticks = p->latch_period_ticks;
+    high_ticks = p->latch_high_ticks;
+  } while (seq != p->seq);
+
+  if (seq == p->done_seq)
+    return false;
+  p->done_seq = seq;
+
+  struct dln2_freq_result *r = &p->result;
+  r->periods = periods;
+  if (periods && period_ticks) {
+    r->period_ns = dln2_freq_ticks_to_ns(period_ticks, periods);
+    r->high_ns = dln2_freq_ticks_to_ns(high_ticks, periods);
+    r->duty = high_ticks * DLN2_FREQ_DUTY_SCALE / period_ticks;
+  } else {
+    r->period_ns = 0;
+    r->high_ns = 0;
+    r->duty = 0;
+  }
+  p->valid = true;
+
+  return true;
+}
+
+static bool dln2_freq_changed(struct dln2_freq_port *p) {
+  const struct dln2_freq_result *r = &p->result;
+  const struct dln2_freq_result *last = &p->reported;
+
+  if (!r->periods != !last->periods)
+    return true;
+
+  uint32_t dperiod = r->period_ns > last->period_ns
+                         ? r->period_ns - last->period_ns
+                         : last->period_ns - r->period_ns;
+  uint32_t dduty =
+      r->duty > last->duty ? r->duty - last->duty : last->duty - r->duty;
+
+  return (uint64_t)dperiod * DLN2_FREQ_DUTY_SCALE >
+             (uint64_t)p->period_threshold * last->period_ns ||
+         dduty > p->duty_threshold;
+}
+
+static bool dln2_freq_port_valid(uint8_t port) {
+  return _freq_driver && port < _freq_driver->port_count &&
+         port < DLN2_FREQ_MAX_PORTS;
+}
+
+static void dln2_freq_set_window(uint8_t port, uint32_t window_us) {
+  struct dln2_freq_port *p = &dln2_freq_ports[port];
+
+  p->window_us = window_us;
+  p->window_ticks = (uint64_t)window_us * _freq_driver->clock_hz / 1000000;
+}
+
+static bool dln2_freq_enable(struct dln2_slot *slot, bool enable) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  uint16_t res;
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+  LOG_INFO("%s: port=%u\n", enable ? "DLN2_FREQ_ENABLE" : "DLN2_FREQ_DISABLE",
+           *port);
+
+  if (!dln2_freq_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_freq_port *p = &dln2_freq_ports[*port];
+  uint16_t pin = _freq_driver->ports[*port].pin;
+
+  if (p->enabled == enable)
+    return dln2_response(slot, 0);
+
+  if (enable) {
+    res = dln2_pin_request(pin, DLN2_MODULE_FREQ);
+    if (res)
+      return dln2_response_error(slot, res);
+
+    if (!p->window_us)
+      dln2_freq_set_window(*port, DLN2_FREQ_DEFAULT_WINDOW_US);
+    p->acc_elapsed_ticks = 0;
+    p->acc_periods = 0;
+    p->acc_period_ticks = 0;
+    p->acc_high_ticks = 0;
+    p->done_seq = p->seq;
+    p->valid = false;
+    p->report = false;
+    p->enabled = true;
+
+    if (!_freq_driver->enable(*port)) {
+      p->enabled = false;
+      dln2_pin_free(pin, DLN2_MODULE_FREQ);
+      return dln2_response_error(slot, DLN2_RES_FAIL);
+    }
+  } else {
+    p->enabled = false;
+    _freq_driver->disable(*port);
+    dln2_pin_free(pin, DLN2_MODULE_FREQ);
+  }
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_freq_set_window_cmd(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint32_t window_us;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_FREQ_SET_WINDOW: port=%u window=%luus\n", cmd->port,
+           (unsigned long)cmd->window_us);
+
+  if (!dln2_freq_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if (!cmd->window_us || cmd->window_us > DLN2_FREQ_MAX_WINDOW_US)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+  dln2_freq_set_window(cmd->port, cmd->window_us);
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_freq_get_value(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  struct dln2_freq_result *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+
+  if (!dln2_freq_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_freq_port *p = &dln2_freq_ports[*port];
+  if (!p->enabled)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  dln2_freq_update(*port);
+
+  // No full window yet
+  if (!p->valid)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  *rsp = p->result;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+static bool dln2_freq_set_event_cfg(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t enable;
+    uint16_t period_threshold;
+    uint16_t duty_threshold;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_FREQ_SET_EVENT_CFG: port=%u enable=%u period_th=%u "
+           "duty_th=%u\n",
+           cmd->port, cmd->enable, cmd->period_threshold, cmd->duty_threshold);
+
+  if (!dln2_freq_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_freq_port *p = &dln2_freq_ports[cmd->port];
+  p->events = cmd->enable;
+  p->period_threshold = cmd->period_threshold;
+  p->duty_threshold = cmd->duty_threshold;
+  // Report the next window whatever it is
+  memset(&p->reported, 0, sizeof(p->reported));
+  p->report = false;
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_freq_get_event_cfg(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  struct {
+    uint8_t enable;
+    uint16_t period_threshold;
+    uint16_t duty_threshold;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+
+  if (!dln2_freq_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  rsp->enable = dln2_freq_ports[*port].events;
+  rsp->period_threshold = dln2_freq_ports[*port].period_threshold;
+  rsp->duty_threshold = dln2_freq_ports[*port].duty_threshold;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+bool dln2_handle_freq(struct dln2_slot *slot) {
+  struct dln2_header *hdr = dln2_slot_header(slot);
+  uint8_t *port = dln2_slot_header_data(slot);
+
+  switch (hdr->id) {
+  case DLN2_FREQ_GET_PORT_COUNT:
+    DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+    if (!_freq_driver)
+      return dln2_response_u8(slot, 0);
+    return dln2_response_u8(slot, _freq_driver->port_count < DLN2_FREQ_MAX_PORTS
+                                      ? _freq_driver->port_count
+                                      : DLN2_FREQ_MAX_PORTS);
+  case DLN2_FREQ_ENABLE:
+    return dln2_freq_enable(slot, true);
+  case DLN2_FREQ_DISABLE:
+    return dln2_freq_enable(slot, false);
+  case DLN2_FREQ_IS_ENABLED:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_freq_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u8(slot, dln2_freq_ports[*port].enabled);
+  case DLN2_FREQ_SET_WINDOW:
+    return dln2_freq_set_window_cmd(slot);
+  case DLN2_FREQ_GET_WINDOW:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_freq_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u32(slot, dln2_freq_ports[*port].window_us
+                                       ? dln2_freq_ports[*port].window_us
+                                       : DLN2_FREQ_DEFAULT_WINDOW_US);
+  case DLN2_FREQ_GET_VALUE:
+    return dln2_freq_get_value(slot);
+  case DLN2_FREQ_SET_EVENT_CFG:
+    return dln2_freq_set_event_cfg(slot);
+  case DLN2_FREQ_GET_EVENT_CFG:
+    return dln2_freq_get_event_cfg(slot);
+  default:
+    LOG_INFO("FREQ command not supported: 0x%04x\n", hdr->id);
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+}
+
+static bool dln2_freq_event(uint8_t port, const struct dln2_freq_result *r) {
+  struct {
+    uint8_t port;
+    struct dln2_freq_result result;
+  } TU_ATTR_PACKED *event;
+
+  struct dln2_slot *slot = dln2_get_slot();
+  if (!slot)
+    return false;
+
+  struct dln2_header *hdr = dln2_slot_header(slot);
+  hdr->size = sizeof(*hdr) + sizeof(*event);
+  hdr->id = DLN2_FREQ_CONDITION_MET_EV;
+  hdr->echo = 0;
+  hdr->handle = DLN2_HANDLE_EVENT;
+
+  event = dln2_slot_header_data(slot);
+  event->port = port;
+  event->result = *r;
+
+  LOG_INFO("%s: port=%u period=%luns duty=%u\n", __func__, port,
+           (unsigned long)r->period_ns, r->duty);
+
+  dln2_queue_slot_in(slot);
+  return true;
+}
+
+void dln2_freq_task(void) {
+  if (!_freq_driver)
+    return;
+
+  for (uint8_t port = 0; port < DLN2_FREQ_MAX_PORTS; port++) {
+    struct dln2_freq_port *p = &dln2_freq_ports[port];
+
+    if (!p->enabled || !p->events)
+      continue;
+
+    if (dln2_freq_update(port) && dln2_freq_changed(p))
+      p->report = true;
+
+    // Out of slots, retried on the next call with the latest window
+    if (p->report && dln2_freq_event(port, &p->result)) {
+      p->reported = p->result;
+      p->report = false;
+    }
+  }
+}
+
+void dln2_freq_init(struct dln2_peripherials *peripherals) {
+  _freq_driver = peripherals->freq;
+  if (_freq_driver)
+    _freq_driver->set_capture_callback(dln2_freq_capture);
+}
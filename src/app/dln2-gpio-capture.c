@@ -0,0 +1,390 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * GPIO logic analyzer capture
+ *
+ * One port is sampled at a fixed rate into a double buffer, either by the
+ * driver's sampler (timer triggered DMA) or in software from the one-shot
+ * timer. dln2_gpio_task() run-length encodes the masked samples and streams
+ * them to the host as DLN2_GPIO_CAPTURE_DATA_EV events. Each record holds a
+ * value and the number of consecutive samples it was seen for, so only
+ * changes cost bandwidth.
+ *
+ * Recording starts with the first sample where (value & trig_mask) equals
+ * trig_values, a zero trig_mask starts right away.
+ *
+ * When encoding falls behind, new samples are dropped rather than written
+ * over a half that is still waiting. The gap shows up in the stream as a
+ * record with run 0 whose value is the number of samples lost.
+ */
+
+#include "dln2.h"
+#include "dln2-gpio.h"
+#include "dln2_log.h"
+
+// Samples in the double buffer, half of it is encoded while the other fills
+#define DLN2_GPIO_CAPTURE_BUF_SIZE 512
+
+struct dln2_gpio_capture_record {
+  uint32_t value;
+  uint32_t run;
+} TU_ATTR_PACKED;
+
+struct dln2_gpio_capture_event {
+  uint16_t seq;
+  uint8_t count;
+  struct dln2_gpio_capture_record records[];
+} TU_ATTR_PACKED;
+
+#define DLN2_GPIO_CAPTURE_MAX_RECORDS                                          \
+  ((DLN2_BUF_SIZE - sizeof(struct dln2_header) -                               \
+    sizeof(struct dln2_gpio_capture_event)) /                                  \
+   sizeof(struct dln2_gpio_capture_record))
+
+static uint32_t dln2_gpio_capture_buf[DLN2_GPIO_CAPTURE_BUF_SIZE];
+
+static struct {
+  uint8_t port;
+  uint32_t mask;
+  uint32_t trig_mask;
+  uint32_t trig_values;
+  uint32_t rate;
+  bool software;
+  uint32_t period_us;
+  uint32_t sw_pos;
+  volatile bool running;
+
+  // Filled halves waiting to be encoded, written from interrupt context
+  volatile uint32_t ready[2];
+  uint8_t next_half;
+  // Samples dropped before each ready half, and since the last ready half
+  volatile uint32_t gap[2];
+  volatile uint32_t pending_gap;
+
+  volatile uint32_t samples;
+  volatile uint32_t overflow_samples;
+  uint32_t dropped_records;
+
+  bool triggered;
+  uint32_t value;
+  uint32_t run;
+  uint16_t seq;
+  struct dln2_slot *slot;
+} dln2_gpio_capture;
+
+static void dln2_gpio_capture_half_full(const uint32_t *samples,
+                                        uint32_t count) {
+  unsigned int half = samples != dln2_gpio_capture_buf;
+
+  dln2_gpio_capture.samples += count;
+  if (dln2_gpio_capture.ready[half]) {
+    dln2_gpio_capture.overflow_samples += count;
+    dln2_gpio_capture.pending_gap += count;
+    return;
+  }
+
+  dln2_gpio_capture.gap[half] = dln2_gpio_capture.pending_gap;
+  dln2_gpio_capture.pending_gap = 0;
+  dln2_gpio_capture.ready[half] = count;
+}
+
+static void dln2_gpio_capture_timer_callback(void) {
+  if (!dln2_gpio_capture.running)
+    return;
+
+  dln2_gpio_drv_timer_start_us(dln2_gpio_capture.period_us,
+                               dln2_gpio_capture_timer_callback);
+
+  uint32_t pos = dln2_gpio_capture.sw_pos;
+
+  // Don't start on a half the task hasn't encoded yet
+  if (dln2_gpio_capture.ready[pos / (DLN2_GPIO_CAPTURE_BUF_SIZE / 2)]) {
+    dln2_gpio_capture.samples++;
+    dln2_gpio_capture.overflow_samples++;
+    dln2_gpio_capture.pending_gap++;
+    return;
+  }
+
+  dln2_gpio_capture_buf[pos++] =
+      dln2_gpio_drv_port_get(dln2_gpio_capture.port, dln2_gpio_capture.mask);
+
+  if (pos == DLN2_GPIO_CAPTURE_BUF_SIZE / 2)
+    dln2_gpio_capture_half_full(dln2_gpio_capture_buf, pos);
+  else if (pos == DLN2_GPIO_CAPTURE_BUF_SIZE) {
+    dln2_gpio_capture_half_full(
+        dln2_gpio_capture_buf + DLN2_GPIO_CAPTURE_BUF_SIZE / 2, pos / 2);
+    pos = 0;
+  }
+
+  dln2_gpio_capture.sw_pos = pos;
+}
+
+static void dln2_gpio_capture_flush(void) {
+  struct dln2_slot *slot = dln2_gpio_capture.slot;
+  if (!slot)
+    return;
+
+  struct dln2_gpio_capture_event *ev = dln2_slot_header_data(slot);
+  dln2_slot_header(slot)->size = sizeof(struct dln2_header) + sizeof(*ev) +
+                                 ev->count * sizeof(ev->records[0]);
+  dln2_gpio_capture.slot = NULL;
+  dln2_queue_slot_in(slot);
+}
+
+static void dln2_gpio_capture_emit(uint32_t value, uint32_t run) {
+  struct dln2_slot *slot = dln2_gpio_capture.slot;
+
+  if (!slot) {
+    slot = dln2_get_slot();
+    if (!slot) {
+      dln2_gpio_capture.dropped_records++;
+      return;
+    }
+
+    struct dln2_header *hdr = dln2_slot_header(slot);
+    hdr->id = DLN2_GPIO_CAPTURE_DATA_EV;
+    hdr->echo = 0;
+    hdr->handle = DLN2_HANDLE_EVENT;
+
+    struct dln2_gpio_capture_event *ev = dln2_slot_header_data(slot);
+    ev->seq = dln2_gpio_capture.seq++;
+    ev->count = 0;
+    dln2_gpio_capture.slot = slot;
+  }
+
+  struct dln2_gpio_capture_event *ev = dln2_slot_header_data(slot);
+  ev->records[ev->count].value = value;
+  ev->records[ev->count].run = run;
+  if (++ev->count == DLN2_GPIO_CAPTURE_MAX_RECORDS)
+    dln2_gpio_capture_flush();
+}
+
+// Close the current run and mark samples lost to an overrun
+static void dln2_gpio_capture_gap(uint32_t dropped) {
+  if (!dln2_gpio_capture.triggered)
+    return;
+
+  if (dln2_gpio_capture.run)
+    dln2_gpio_capture_emit(dln2_gpio_capture.value, dln2_gpio_capture.run);
+  dln2_gpio_capture_emit(dropped, 0);
+  dln2_gpio_capture.run = 0;
+}
+
+static void dln2_gpio_capture_encode(const uint32_t *samples, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t value = samples[i] & dln2_gpio_capture.mask;
+
+    if (!dln2_gpio_capture.triggered) {
+      if ((value & dln2_gpio_capture.trig_mask) !=
+          dln2_gpio_capture.trig_values)
+        continue;
+      dln2_gpio_capture.triggered = true;
+      dln2_gpio_capture.value = value;
+      dln2_gpio_capture.run = 1;
+      continue;
+    }
+
+    if (!dln2_gpio_capture.run) {
+      dln2_gpio_capture.value = value;
+      dln2_gpio_capture.run = 1;
+      continue;
+    }
+
+    if (value == dln2_gpio_capture.value &&
+        dln2_gpio_capture.run != UINT32_MAX) {
+      dln2_gpio_capture.run++;
+      continue;
+    }
+
+    dln2_gpio_capture_emit(dln2_gpio_capture.value, dln2_gpio_capture.run);
+    dln2_gpio_capture.value = value;
+    dln2_gpio_capture.run = 1;
+  }
+}
+
+static void dln2_gpio_capture_stop_sampling(void) {
+  if (!dln2_gpio_capture.running)
+    return;
+
+  dln2_gpio_capture.running = false;
+  if (dln2_gpio_capture.software) {
+    dln2_gpio_drv_timer_stop();
+    dln2_gpio_timer_release();
+
+    // Hand over the partly filled half as well
+    uint32_t pos = dln2_gpio_capture.sw_pos;
+    uint32_t count = pos % (DLN2_GPIO_CAPTURE_BUF_SIZE / 2);
+    if (count)
+      dln2_gpio_capture_half_full(dln2_gpio_capture_buf + pos - count, count);
+  } else {
+    dln2_gpio_drv_sample_stop();
+  }
+}
+
+static bool dln2_gpio_capture_start(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint32_t mask;
+    uint32_t rate;
+    uint32_t trig_mask;
+    uint32_t trig_values;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+
+  LOG_INFO("\nGPIO_CAPTURE_START: port=%u mask=0x%08lx rate=%lu "
+           "trig_mask=0x%08lx trig_values=0x%08lx\n",
+           cmd->port, (unsigned long)cmd->mask, (unsigned long)cmd->rate,
+           (unsigned long)cmd->trig_mask, (unsigned long)cmd->trig_values);
+
+  if (dln2_gpio_capture.running)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  if (cmd->port >= dln2_gpio_port_count() || !cmd->mask ||
+      (cmd->mask & ~dln2_pin_module_word(DLN2_MODULE_GPIO, cmd->port)))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
+  if (!cmd->rate || (cmd->trig_mask & ~cmd->mask) ||
+      (cmd->trig_values & ~cmd->trig_mask))
+    return dln2_response_error(slot, DLN2_RES_BAD_PARAMETER);
+
+  dln2_gpio_capture.port = cmd->port;
+  dln2_gpio_capture.mask = cmd->mask;
+  dln2_gpio_capture.trig_mask = cmd->trig_mask;
+  dln2_gpio_capture.trig_values = cmd->trig_values;
+  dln2_gpio_capture.ready[0] = 0;
+  dln2_gpio_capture.ready[1] = 0;
+  dln2_gpio_capture.gap[0] = 0;
+  dln2_gpio_capture.gap[1] = 0;
+  dln2_gpio_capture.pending_gap = 0;
+  dln2_gpio_capture.next_half = 0;
+  dln2_gpio_capture.samples = 0;
+  dln2_gpio_capture.overflow_samples = 0;
+  dln2_gpio_capture.dropped_records = 0;
+  dln2_gpio_capture.triggered = false;
+  dln2_gpio_capture.seq = 0;
+
+  if (dln2_gpio_drv_has_sampler() && dln2_gpio_drv_port_direct(cmd->port)) {
+    dln2_gpio_capture.software = false;
+    dln2_gpio_capture.rate = dln2_gpio_drv_sample_start(
+        cmd->port, cmd->rate, dln2_gpio_capture_buf,
+        DLN2_GPIO_CAPTURE_BUF_SIZE, dln2_gpio_capture_half_full);
+    if (!dln2_gpio_capture.rate)
+      return dln2_response_error(slot, DLN2_RES_FAIL);
+    dln2_gpio_capture.running = true;
+  } else if (dln2_gpio_drv_has_timer()) {
+    if (!dln2_gpio_timer_claim())
+      return dln2_response_error(slot, DLN2_RES_FAIL);
+
+    dln2_gpio_capture.software = true;
+    dln2_gpio_capture.period_us = 1000000 / cmd->rate;
+    if (!dln2_gpio_capture.period_us)
+      dln2_gpio_capture.period_us = 1;
+    dln2_gpio_capture.rate = 1000000 / dln2_gpio_capture.period_us;
+    dln2_gpio_capture.sw_pos = 0;
+    dln2_gpio_capture.running = true;
+
+    if (!dln2_gpio_drv_timer_start_us(dln2_gpio_capture.period_us,
+                                      dln2_gpio_capture_timer_callback)) {
+      dln2_gpio_capture.running = false;
+      dln2_gpio_timer_release();
+      return dln2_response_error(slot, DLN2_RES_FAIL);
+    }
+  } else {
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+
+  LOG_INFO("GPIO capture: actual rate %luHz %s\n",
+           (unsigned long)dln2_gpio_capture.rate,
+           dln2_gpio_capture.software ? "(software)" : "");
+
+  return dln2_response_u32(slot, dln2_gpio_capture.rate);
+}
+
+static bool dln2_gpio_capture_stop(struct dln2_slot *slot) {
+  DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+
+  LOG_INFO("\nGPIO_CAPTURE_STOP\n");
+
+  bool was_running = dln2_gpio_capture.running;
+  dln2_gpio_capture_stop_sampling();
+
+  // Encode what is left and close the last run
+  if (was_running) {
+    dln2_gpio_capture_task();
+    if (dln2_gpio_capture.pending_gap) {
+      dln2_gpio_capture_gap(dln2_gpio_capture.pending_gap);
+      dln2_gpio_capture.pending_gap = 0;
+    }
+    if (dln2_gpio_capture.triggered && dln2_gpio_capture.run) {
+      dln2_gpio_capture_emit(dln2_gpio_capture.value, dln2_gpio_capture.run);
+      dln2_gpio_capture.run = 0;
+    }
+    dln2_gpio_capture_flush();
+  }
+
+  return dln2_response(slot, 0);
+}
+
+// The host derives the sustained rate from samples over its elapsed time
+static bool dln2_gpio_capture_get_status(struct dln2_slot *slot) {
+  struct {
+    uint8_t running;
+    uint8_t triggered;
+    uint32_t rate;
+    uint32_t samples;
+    uint32_t overflow_samples;
+    uint32_t dropped_records;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+
+  rsp->running = dln2_gpio_capture.running;
+  rsp->triggered = dln2_gpio_capture.triggered;
+  rsp->rate = dln2_gpio_capture.rate;
+  rsp->samples = dln2_gpio_capture.samples;
+  rsp->overflow_samples = dln2_gpio_capture.overflow_samples;
+  rsp->dropped_records = dln2_gpio_capture.dropped_records;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+bool dln2_gpio_capture_handle(struct dln2_slot *slot) {
+  struct dln2_header *hdr = dln2_slot_header(slot);
+
+  switch (hdr->id) {
+  case DLN2_GPIO_CAPTURE_START:
+    return dln2_gpio_capture_start(slot);
+  case DLN2_GPIO_CAPTURE_STOP:
+    return dln2_gpio_capture_stop(slot);
+  case DLN2_GPIO_CAPTURE_GET_STATUS:
+    return dln2_gpio_capture_get_status(slot);
+  default:
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+}
+
+// Encode the filled halves in the order they were sampled
+void dln2_gpio_capture_task(void) {
+  while (dln2_gpio_capture.ready[dln2_gpio_capture.next_half]) {
+    unsigned int half = dln2_gpio_capture.next_half;
+
+    if (dln2_gpio_capture.gap[half]) {
+      dln2_gpio_capture_gap(dln2_gpio_capture.gap[half]);
+      dln2_gpio_capture.gap[half] = 0;
+    }
+    dln2_gpio_capture_encode(dln2_gpio_capture_buf +
+                                 half * (DLN2_GPIO_CAPTURE_BUF_SIZE / 2),
+                             dln2_gpio_capture.ready[half]);
+    dln2_gpio_capture.ready[half] = 0;
+    dln2_gpio_capture.next_half = !half;
+    dln2_gpio_capture_flush();
+  }
+}
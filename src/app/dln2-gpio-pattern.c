@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * GPIO pattern player
+ *
+ * The host uploads a list of steps, each one drives a set of pins in one port
+ * and then waits a number of microseconds before the next step. Playback is
+ * paced by the driver's one-shot timer so the edges don't depend on USB
+ * timing. A DLN2_GPIO_PATTERN_DONE_EV event is sent when playback ends.
+ */
+
+#include "dln2.h"
+#include "dln2-gpio.h"
+#include "dln2_log.h"
+
+#define DLN2_GPIO_PATTERN_MAX_STEPS 128
+
+#define DLN2_GPIO_PATTERN_RESULT_OK 0
+#define DLN2_GPIO_PATTERN_RESULT_TIMER_FAILED 1
+
+struct dln2_gpio_pattern_step_msg {
+  uint8_t port;
+  uint32_t mask;
+  uint32_t values;
+  uint32_t delay_us;
+} TU_ATTR_PACKED;
+
+struct dln2_gpio_pattern_step {
+  uint32_t set_mask;
+  uint32_t clr_mask;
+  uint32_t delay_us;
+  uint8_t port;
+};
+
+static struct dln2_gpio_pattern_step
+    dln2_gpio_pattern_steps[DLN2_GPIO_PATTERN_MAX_STEPS];
+
+static struct {
+  uint16_t count;   // steps to play
+  uint16_t loops;   // 0 loops forever
+  volatile uint16_t pos;
+  volatile uint16_t loops_done;
+  volatile bool running;
+  volatile bool done; // completion event pending
+  volatile uint8_t result;
+} dln2_gpio_pattern;
+
+static void dln2_gpio_pattern_timer_callback(void);
+
+/*
+ * Apply steps until one has a delay. The timer is armed before the pins are
+ * driven so the time it takes to drive them does not add up over the steps.
+ * The position is advanced first and interrupts are held off until the pins
+ * are driven, so an early expiry can't replay or overtake the step.
+ */
+static void dln2_gpio_pattern_run(void) {
+  while (dln2_gpio_pattern.running) {
+    const struct dln2_gpio_pattern_step *step =
+        &dln2_gpio_pattern_steps[dln2_gpio_pattern.pos];
+    bool last = dln2_gpio_pattern.pos + 1 == dln2_gpio_pattern.count &&
+                dln2_gpio_pattern.loops &&
+                dln2_gpio_pattern.loops_done + 1 == dln2_gpio_pattern.loops;
+    uint32_t irq = dln2_gpio_drv_critical_enter();
+
+    if (++dln2_gpio_pattern.pos == dln2_gpio_pattern.count) {
+      dln2_gpio_pattern.pos = 0;
+      dln2_gpio_pattern.loops_done++;
+    }
+
+    if (!last && step->delay_us &&
+        !dln2_gpio_drv_timer_start_us(step->delay_us,
+                                      dln2_gpio_pattern_timer_callback)) {
+      dln2_gpio_drv_critical_exit(irq);
+      dln2_gpio_pattern.result = DLN2_GPIO_PATTERN_RESULT_TIMER_FAILED;
+      dln2_gpio_pattern.running = false;
+      dln2_gpio_pattern.done = true;
+      dln2_gpio_timer_release();
+      return;
+    }
+
+    dln2_gpio_drv_port_set_clr(step->port, step->set_mask, step->clr_mask);
+    dln2_gpio_drv_critical_exit(irq);
+
+    if (last) {
+      dln2_gpio_pattern.running = false;
+      dln2_gpio_pattern.done = true;
+      dln2_gpio_timer_release();
+      return;
+    }
+
+    if (step->delay_us)
+      return;
+  }
+}
+
+static void dln2_gpio_pattern_timer_callback(void) { dln2_gpio_pattern_run(); }
+
+static bool dln2_gpio_pattern_load(struct dln2_slot *slot) {
+  struct {
+    uint16_t offset;
+    uint8_t count;
+    struct dln2_gpio_pattern_step_msg steps[];
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  size_t len = dln2_slot_header_data_size(slot);
+
+  if (len < sizeof(*cmd) ||
+      len != sizeof(*cmd) + cmd->count * sizeof(cmd->steps[0]))
+    return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+
+  LOG_INFO("\nGPIO_PATTERN_LOAD: offset=%u count=%u\n", cmd->offset,
+           cmd->count);
+
+  if (dln2_gpio_pattern.running)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  if (cmd->offset + cmd->count > DLN2_GPIO_PATTERN_MAX_STEPS)
+    return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+
+  for (unsigned int i = 0; i < cmd->count; i++) {
+    const struct dln2_gpio_pattern_step_msg *msg = &cmd->steps[i];
+    struct dln2_gpio_pattern_step *step =
+        &dln2_gpio_pattern_steps[cmd->offset + i];
+
+    step->port = msg->port;
+    step->set_mask = msg->mask & msg->values;
+    step->clr_mask = msg->mask & ~msg->values;
+    step->delay_us = msg->delay_us;
+  }
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_gpio_pattern_start(struct dln2_slot *slot) {
+  struct {
+    uint16_t count;
+    uint16_t loops;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+
+  LOG_INFO("\nGPIO_PATTERN_START: count=%u loops=%u\n", cmd->count,
+           cmd->loops);
+
+  if (!dln2_gpio_drv_has_timer())
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  if (dln2_gpio_pattern.running)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  if (!cmd->count || cmd->count > DLN2_GPIO_PATTERN_MAX_STEPS)
+    return dln2_response_error(slot, DLN2_RES_BAD_PARAMETER);
+
+  // The pins could have been released since the steps were loaded
+  bool has_delay = false;
+  for (unsigned int i = 0; i < cmd->count; i++) {
+    const struct dln2_gpio_pattern_step *step = &dln2_gpio_pattern_steps[i];
+    uint32_t mask = step->set_mask | step->clr_mask;
+
+    if (step->port >= dln2_gpio_port_count() ||
+        (mask & ~dln2_pin_module_word(DLN2_MODULE_GPIO, step->port)))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
+    if (step->delay_us)
+      has_delay = true;
+  }
+
+  // Looping forever without a delay would never return to the main loop
+  if (!cmd->loops && !has_delay)
+    return dln2_response_error(slot, DLN2_RES_BAD_PARAMETER);
+
+  if (!dln2_gpio_timer_claim())
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  dln2_gpio_pattern.count = cmd->count;
+  dln2_gpio_pattern.loops = cmd->loops;
+  dln2_gpio_pattern.pos = 0;
+  dln2_gpio_pattern.loops_done = 0;
+  dln2_gpio_pattern.result = DLN2_GPIO_PATTERN_RESULT_OK;
+  dln2_gpio_pattern.done = false;
+  dln2_gpio_pattern.running = true;
+
+  if (!dln2_response(slot, 0))
+    return false;
+
+  dln2_gpio_pattern_run();
+
+  return true;
+}
+
+static bool dln2_gpio_pattern_stop(struct dln2_slot *slot) {
+  DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+
+  LOG_INFO("\nGPIO_PATTERN_STOP\n");
+
+  if (dln2_gpio_pattern.running) {
+    dln2_gpio_pattern.running = false;
+    dln2_gpio_drv_timer_stop();
+    dln2_gpio_timer_release();
+  }
+  dln2_gpio_pattern.done = false;
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_gpio_pattern_get_status(struct dln2_slot *slot) {
+  struct {
+    uint8_t running;
+    uint16_t pos;
+    uint16_t loops_done;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+
+  rsp->running = dln2_gpio_pattern.running;
+  rsp->pos = dln2_gpio_pattern.pos;
+  rsp->loops_done = dln2_gpio_pattern.loops_done;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+bool dln2_gpio_pattern_handle(struct dln2_slot *slot) {
+  struct dln2_header *hdr = dln2_slot_header(slot);
+
+  switch (hdr->id) {
+  case DLN2_GPIO_PATTERN_LOAD:
+    return dln2_gpio_pattern_load(slot);
+  case DLN2_GPIO_PATTERN_START:
+    return dln2_gpio_pattern_start(slot);
+  case DLN2_GPIO_PATTERN_STOP:
+    return dln2_gpio_pattern_stop(slot);
+  case DLN2_GPIO_PATTERN_GET_STATUS:
+    return dln2_gpio_pattern_get_status(slot);
+  default:
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+}
+
+// Send the completion event, retried on the next call if out of slots
+void dln2_gpio_pattern_task(void) {
+  struct {
+    uint16_t loops_done;
+    uint8_t result;
+  } TU_ATTR_PACKED *ev;
+
+  if (!dln2_gpio_pattern.done)
+    return;
+
+  struct dln2_slot *slot = dln2_get_slot();
+  if (!slot)
+    return;
+
+  dln2_gpio_pattern.done = false;
+
+  struct dln2_header *hdr = dln2_slot_header(slot);
+  hdr->size = sizeof(*hdr) + sizeof(*ev);
+  hdr->id = DLN2_GPIO_PATTERN_DONE_EV;
+  hdr->echo = 0;
+  hdr->handle = DLN2_HANDLE_EVENT;
+
+  ev = dln2_slot_header_data(slot);
+  ev->loops_done = dln2_gpio_pattern.loops_done;
+  ev->result = dln2_gpio_pattern.result;
+
+  LOG_INFO("%s: loops=%u result=%u\n", __func__, ev->loops_done, ev->result);
+
+  dln2_queue_slot_in(slot);
+}
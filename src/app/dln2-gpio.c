@@ -12,11 +12,12 @@
  */
 
 #include "dln2.h"
+#include "dln2-gpio.h"
+#include "dln2_bitmap.h"
 #include "dln2_log.h"
 #include "gpio_driver.h"
 #include <stdio.h>
-
-#define DLN2_GPIO_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_GPIO)
+#include <string.h>
 
 #define DLN2_GPIO_GET_PIN_COUNT DLN2_GPIO_CMD(0x01)
 #define DLN2_GPIO_SET_DEBOUNCE DLN2_GPIO_CMD(0x04)
@@ -35,33 +36,15 @@
 #define DLN2_GPIO_EVENT_LVL_HIGH 2
 #define DLN2_GPIO_EVENT_LVL_LOW 3
 
-
 #ifdef PICO_DEFAULT_LED_PIN
 #define LED_PIN PICO_DEFAULT_LED_PIN
 #else
 #define LED_PIN 0xff // out of bounds value that will never match
 #endif
 
-#define get_bit(n, var) ((var >> (n)) & 1U)
-
-enum gpio_irq_level {
-  GPIO_IRQ_LEVEL_LOW = 0x1u,  ///< IRQ when the GPIO pin is a logical 0
-  GPIO_IRQ_LEVEL_HIGH = 0x2u, ///< IRQ when the GPIO pin is a logical 1
-  GPIO_IRQ_EDGE_FALL = 0x4u,  ///< IRQ when the GPIO has transitioned from a
-                              ///< logical 1 to a logical 0
-  GPIO_IRQ_EDGE_RISE = 0x8u,  ///< IRQ when the GPIO has transitioned from a
-                              ///< logical 0 to a logical 1
-};
-
-#define assign_bit(n, var, val)                                                \
-  do {                                                                         \
-    if (val)                                                                   \
-      (var) |= 1U << (n);                                                      \
-    else                                                                       \
-      (var) &= ~(1U << (n));                                                   \
-  } while (0)
-
-static uint32_t prev_values;
+// Last reported value and event enable state of each pin
+static DLN2_DECLARE_BITMAP(dln2_gpio_values, DLN2_PIN_MAX);
+static DLN2_DECLARE_BITMAP(dln2_gpio_event_enabled, DLN2_PIN_MAX);
 
 struct dln2_gpio_event {
   uint8_t gpio;
@@ -77,10 +60,18 @@ uint16_t dln2_gpio_event_count;
 
 static const char *dln2_gpio_id_to_name(uint16_t id) {
   switch (id) {
+  case DLN2_GPIO_PORT32_GET_COUNT:
+    return "GPIO_PORT32_GET_COUNT";
   case DLN2_GPIO_GET_PIN_COUNT:
     return "GPIO_GET_PIN_COUNT";
   case DLN2_GPIO_SET_DEBOUNCE:
     return "GPIO_SET_DEBOUNCE";
+  case DLN2_GPIO_PORT32_GET_VAL:
+    return "GPIO_PORT32_GET_VAL";
+  case DLN2_GPIO_PORT32_SET_OUT_VAL:
+    return "GPIO_PORT32_SET_OUT_VAL";
+  case DLN2_GPIO_PORT32_GET_OUT_VAL:
+    return "GPIO_PORT32_GET_OUT_VAL";
   case DLN2_GPIO_PIN_GET_VAL:
     return "GPIO_PIN_GET_VAL";
   case DLN2_GPIO_PIN_SET_OUT_VAL:
@@ -110,7 +101,7 @@ static int dln2_gpio_slot_pin_val(struct dln2_slot *slot, uint8_t *val) {
 
   void *data = dln2_slot_header_data(slot);
   uint16_t *pin = data;
-  if (*pin > (_gpio_driver->gpio_count - 1))
+  if (*pin > (dln2_gpio_drv_count() - 1))
     return -1;
 
   if (val)
@@ -156,7 +147,7 @@ static bool dln2_gpio_pin_enable(struct dln2_slot *slot, bool enable) {
       return dln2_response_error(slot, res);
 
     if (pin != LED_PIN) {
-      _gpio_driver->init(_gpio_driver->pins[pin]);
+      dln2_gpio_drv_init(pin);
       //      _gpio_driver->pull_down(
       //          pin); // Some other function could have changed this (adc)
     }
@@ -164,8 +155,15 @@ static bool dln2_gpio_pin_enable(struct dln2_slot *slot, bool enable) {
     int res = dln2_pin_free(pin, DLN2_MODULE_GPIO);
     if (res)
       return dln2_response_error(slot, res);
+    if (dln2_bitmap_test(dln2_gpio_event_enabled, pin)) {
+      dln2_gpio_drv_set_irq_enabled(pin,
+                                    GPIO_IRQ_LEVEL_LOW | GPIO_IRQ_LEVEL_HIGH |
+                                        GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE,
+                                    false);
+      dln2_bitmap_clear(dln2_gpio_event_enabled, pin);
+    }
     if (pin != LED_PIN)
-      _gpio_driver->deinit(_gpio_driver->pins[pin]);
+      dln2_gpio_drv_deinit(pin);
   }
   return dln2_response(slot, 0);
 }
@@ -191,12 +189,16 @@ static bool dln2_gpio_pin_set_event_cfg(struct dln2_slot *slot) {
   if (cmd->pin == LED_PIN)
     return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
 
-  assign_bit(cmd->pin, prev_values,
-             _gpio_driver->get(_gpio_driver->pins[cmd->pin]));
+  if (cmd->type > DLN2_GPIO_EVENT_LVL_LOW)
+    return dln2_response_error(slot, DLN2_RES_INVALID_EVENT_TYPE);
+
+  dln2_bitmap_assign(dln2_gpio_values, cmd->pin, dln2_gpio_drv_get(cmd->pin));
+  dln2_bitmap_assign(dln2_gpio_event_enabled, cmd->pin,
+                     cmd->type != DLN2_GPIO_EVENT_NONE);
 
   switch (cmd->type) {
   case DLN2_GPIO_EVENT_NONE:
-    _gpio_driver->set_irq_enabled(_gpio_driver->pins[cmd->pin],
+    dln2_gpio_drv_set_irq_enabled(cmd->pin,
                                   GPIO_IRQ_LEVEL_LOW | GPIO_IRQ_LEVEL_HIGH |
                                       GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE,
                                   false);
@@ -204,7 +206,7 @@ static bool dln2_gpio_pin_set_event_cfg(struct dln2_slot *slot) {
   // The Linux driver always uses this so we don't know which edge(s) it
   // actually cares about.
   case DLN2_GPIO_EVENT_CHANGE:
-    _gpio_driver->set_irq_enabled(
+    dln2_gpio_drv_set_irq_enabled(
         cmd->pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
     break;
   // The Linux driver doesn't use these, maybe because they were mistaken to be
@@ -212,12 +214,10 @@ static bool dln2_gpio_pin_set_event_cfg(struct dln2_slot *slot) {
   // according to the docs:
   // http://dlnware.com/dll/DLN_GPIO_EVENT_LEVEL_HIGH-Events
   case DLN2_GPIO_EVENT_LVL_HIGH:
-    _gpio_driver->set_irq_enabled(_gpio_driver->pins[cmd->pin],
-                                  GPIO_IRQ_EDGE_RISE, true);
+    dln2_gpio_drv_set_irq_enabled(cmd->pin, GPIO_IRQ_EDGE_RISE, true);
     break;
   case DLN2_GPIO_EVENT_LVL_LOW:
-    _gpio_driver->set_irq_enabled(_gpio_driver->pins[cmd->pin],
-                                  GPIO_IRQ_EDGE_FALL, true);
+    dln2_gpio_drv_set_irq_enabled(cmd->pin, GPIO_IRQ_EDGE_FALL, true);
     break;
   default:
     return dln2_response_error(slot, DLN2_RES_INVALID_EVENT_TYPE);
@@ -226,34 +226,228 @@ static bool dln2_gpio_pin_set_event_cfg(struct dln2_slot *slot) {
   return dln2_response(slot, 0);
 }
 
+#ifndef DLN2_GPIO_DRIVER_STATIC
+uint32_t dln2_gpio_port_direct;
+
+// Physical port of the lowest pin in mask, and the physical mask of all the
+// pins in mask that live on that same physical port
+static uint32_t dln2_gpio_port_split(uint32_t port, uint32_t mask,
+                                     uint32_t *pmask) {
+  const uint32_t *pins = _gpio_driver->pins;
+  uint32_t pport = pins[port * DLN2_GPIO_PORT_WIDTH + __builtin_ctz(mask)] /
+                   DLN2_GPIO_PORT_WIDTH;
+
+  *pmask = 0;
+  for (uint32_t m = mask; m; m &= m - 1) {
+    uint32_t gpio = pins[port * DLN2_GPIO_PORT_WIDTH + __builtin_ctz(m)];
+    if (gpio / DLN2_GPIO_PORT_WIDTH == pport)
+      *pmask |= 1U << (gpio % DLN2_GPIO_PORT_WIDTH);
+  }
+  return pport;
+}
+
+uint32_t dln2_gpio_drv_port_read_mapped(uint32_t port, uint32_t mask,
+                                        bool out) {
+  uint32_t (*read)(uint32_t port, uint32_t mask) =
+      out ? _gpio_driver->port_get_out_level : _gpio_driver->port_get;
+  uint32_t values = 0;
+
+  if (!read) {
+    for (uint32_t m = mask; m; m &= m - 1) {
+      uint32_t bit = __builtin_ctz(m);
+      uint32_t pin = port * DLN2_GPIO_PORT_WIDTH + bit;
+      if (out ? dln2_gpio_drv_get_out_level(pin) : dln2_gpio_drv_get(pin))
+        values |= 1U << bit;
+    }
+    return values;
+  }
+
+  // One read per physical port the logical pins are spread over
+  while (mask) {
+    uint32_t pmask;
+    uint32_t pport = dln2_gpio_port_split(port, mask, &pmask);
+    uint32_t in = read(pport, pmask);
+
+    for (uint32_t m = mask; m; m &= m - 1) {
+      uint32_t bit = __builtin_ctz(m);
+      uint32_t gpio = _gpio_driver->pins[port * DLN2_GPIO_PORT_WIDTH + bit];
+      if (gpio / DLN2_GPIO_PORT_WIDTH != pport)
+        continue;
+      if (in & (1U << (gpio % DLN2_GPIO_PORT_WIDTH)))
+        values |= 1U << bit;
+      mask &= ~(1U << bit);
+    }
+  }
+  return values;
+}
+
+void dln2_gpio_drv_port_set_clr_mapped(uint32_t port, uint32_t set_mask,
+                                       uint32_t clr_mask) {
+  uint32_t mask = set_mask | clr_mask;
+
+  if (!_gpio_driver->port_set_clr) {
+    for (uint32_t m = mask; m; m &= m - 1) {
+      uint32_t bit = __builtin_ctz(m);
+      dln2_gpio_drv_put(port * DLN2_GPIO_PORT_WIDTH + bit,
+                        set_mask & (1U << bit));
+    }
+    return;
+  }
+
+  // One write per physical port, pins sharing a register still switch
+  // together
+  while (mask) {
+    uint32_t pmask, pset = 0;
+    uint32_t pport = dln2_gpio_port_split(port, mask, &pmask);
+
+    for (uint32_t m = mask; m; m &= m - 1) {
+      uint32_t bit = __builtin_ctz(m);
+      uint32_t gpio = _gpio_driver->pins[port * DLN2_GPIO_PORT_WIDTH + bit];
+      if (gpio / DLN2_GPIO_PORT_WIDTH != pport)
+        continue;
+      if (set_mask & (1U << bit))
+        pset |= 1U << (gpio % DLN2_GPIO_PORT_WIDTH);
+      mask &= ~(1U << bit);
+    }
+    _gpio_driver->port_set_clr(pport, pset, pmask & ~pset);
+  }
+}
+
+uint8_t dln2_gpio_irq_map[DLN2_GPIO_IRQ_MAP_SIZE];
+
+// Work out the pins[] lookups the hot paths would otherwise repeat
+static void dln2_gpio_map_init(void) {
+  memset(dln2_gpio_irq_map, DLN2_GPIO_IRQ_PIN_NONE, sizeof(dln2_gpio_irq_map));
+  dln2_gpio_port_direct = ~0U;
+
+  for (uint32_t pin = 0; pin < _gpio_driver->gpio_count && pin < DLN2_PIN_MAX;
+       pin++) {
+    uint32_t gpio = _gpio_driver->pins[pin];
+
+    if (gpio != pin)
+      dln2_gpio_port_direct &= ~(1U << (pin / DLN2_GPIO_PORT_WIDTH));
+    if (gpio < DLN2_GPIO_IRQ_MAP_SIZE)
+      dln2_gpio_irq_map[gpio] = pin;
+  }
+}
+#endif
+
+uint8_t dln2_gpio_port_count(void) {
+  return (dln2_gpio_drv_count() + DLN2_GPIO_PORT_WIDTH - 1) /
+         DLN2_GPIO_PORT_WIDTH;
+}
+
+// The one-shot timer is shared by the pattern player and the capture fallback
+static volatile bool dln2_gpio_timer_busy;
+
+bool dln2_gpio_timer_claim(void) {
+  if (dln2_gpio_timer_busy)
+    return false;
+  dln2_gpio_timer_busy = true;
+  return true;
+}
+
+void dln2_gpio_timer_release(void) { dln2_gpio_timer_busy = false; }
+
+// All pins in the mask must be enabled for the GPIO module
+static bool dln2_gpio_port_mask_valid(uint8_t port, uint32_t mask) {
+  if (port >= dln2_gpio_port_count())
+    return false;
+
+  return !(mask & ~dln2_pin_module_word(DLN2_MODULE_GPIO, port));
+}
+
+static bool dln2_gpio_port_get_val(struct dln2_slot *slot, bool out) {
+  struct {
+    uint8_t port;
+    uint32_t mask;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  struct {
+    uint8_t port;
+    uint32_t values;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+
+  uint8_t port = cmd->port;
+  uint32_t mask = cmd->mask;
+
+  LOG_INFO("\n%s: port=%u mask=0x%08lx\n",
+           out ? "GPIO_PORT32_GET_OUT_VAL" : "GPIO_PORT32_GET_VAL", port,
+           (unsigned long)mask);
+
+  if (!dln2_gpio_port_mask_valid(port, mask))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
+
+  rsp->port = port;
+  rsp->values = (out ? dln2_gpio_drv_port_get_out_level(port, mask)
+                     : dln2_gpio_drv_port_get(port, mask)) &
+                mask;
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+// Pins in mask with their bit set in values are driven high, the others low
+static bool dln2_gpio_port_set_out_val(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint32_t mask;
+    uint32_t values;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+
+  LOG_INFO("\nGPIO_PORT32_SET_OUT_VAL: port=%u mask=0x%08lx values=0x%08lx\n",
+           cmd->port, (unsigned long)cmd->mask, (unsigned long)cmd->values);
+
+  if (!dln2_gpio_port_mask_valid(cmd->port, cmd->mask))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
+
+  dln2_gpio_drv_port_set_clr(cmd->port, cmd->mask & cmd->values,
+                             cmd->mask & ~cmd->values);
+
+  return dln2_response(slot, 0);
+}
+
 bool dln2_handle_gpio(struct dln2_slot *slot) {
   struct dln2_header *hdr = dln2_slot_header(slot);
   uint8_t val;
   int pin;
 
   switch (hdr->id) {
+  case DLN2_GPIO_PORT32_GET_COUNT:
+    LOG_INFO("DLN2_GPIO_PORT32_GET_COUNT\n");
+    if (dln2_slot_header_data_size(slot))
+      return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+    return dln2_response_u8(slot, dln2_gpio_port_count());
   case DLN2_GPIO_GET_PIN_COUNT:
     LOG_INFO("DLN2_GPIO_GET_PIN_COUNT\n");
     if (dln2_slot_header_data_size(slot))
       return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
-    return dln2_response_u16(slot, _gpio_driver->gpio_count);
+    return dln2_response_u16(slot, dln2_gpio_drv_count());
   case DLN2_GPIO_SET_DEBOUNCE:
     // The Linux driver can set the default debounce value, but it does not
     // enable it for the pin?! The DLN-2 adapter does not support debounce, but
     // 4M and 4S do.
     LOG_INFO("DLN2_GPIO_SET_DEBOUNCE\n");
     return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  case DLN2_GPIO_PORT32_GET_VAL:
+    return dln2_gpio_port_get_val(slot, false);
+  case DLN2_GPIO_PORT32_SET_OUT_VAL:
+    return dln2_gpio_port_set_out_val(slot);
+  case DLN2_GPIO_PORT32_GET_OUT_VAL:
+    return dln2_gpio_port_get_val(slot, true);
   case DLN2_GPIO_PIN_GET_VAL:
     DLN2_GPIO_GET_PIN_VERIFY(slot, pin, NULL);
-    val = _gpio_driver->get(_gpio_driver->pins[pin]);
+    val = dln2_gpio_drv_get(pin);
     return dln2_gpio_response_pin_val(slot, pin, &val);
   case DLN2_GPIO_PIN_SET_OUT_VAL:
     DLN2_GPIO_GET_PIN_VERIFY(slot, pin, &val);
-    _gpio_driver->put(_gpio_driver->pins[pin], val);
+    dln2_gpio_drv_put(pin, val);
     return dln2_gpio_response_pin_val(slot, pin, NULL);
   case DLN2_GPIO_PIN_GET_OUT_VAL:
     DLN2_GPIO_GET_PIN_VERIFY(slot, pin, NULL);
-    val = _gpio_driver->get_out_level(_gpio_driver->pins[pin]);
+    val = dln2_gpio_drv_get_out_level(pin);
     return dln2_gpio_response_pin_val(slot, pin, &val);
   case DLN2_GPIO_PIN_ENABLE:
     return dln2_gpio_pin_enable(slot, true);
@@ -263,14 +457,23 @@ bool dln2_handle_gpio(struct dln2_slot *slot) {
     DLN2_GPIO_GET_PIN_VERIFY(slot, pin, &val);
     if (pin == LED_PIN && !val)
       return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
-    _gpio_driver->set_dir(_gpio_driver->pins[pin], val);
+    dln2_gpio_drv_set_dir(pin, val);
     return dln2_gpio_response_pin_val(slot, pin, NULL);
   case DLN2_GPIO_PIN_GET_DIRECTION:
     DLN2_GPIO_GET_PIN_VERIFY(slot, pin, NULL);
-    val = _gpio_driver->get_dir(_gpio_driver->pins[pin]);
+    val = dln2_gpio_drv_get_dir(pin);
     return dln2_gpio_response_pin_val(slot, pin, &val);
   case DLN2_GPIO_PIN_SET_EVENT_CFG:
     return dln2_gpio_pin_set_event_cfg(slot);
+  case DLN2_GPIO_PATTERN_LOAD:
+  case DLN2_GPIO_PATTERN_START:
+  case DLN2_GPIO_PATTERN_STOP:
+  case DLN2_GPIO_PATTERN_GET_STATUS:
+    return dln2_gpio_pattern_handle(slot);
+  case DLN2_GPIO_CAPTURE_START:
+  case DLN2_GPIO_CAPTURE_STOP:
+  case DLN2_GPIO_CAPTURE_GET_STATUS:
+    return dln2_gpio_capture_handle(slot);
   default:
     LOG_INFO("GPIO command not supported: 0x%04x\n", hdr->id);
     return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
@@ -316,6 +519,9 @@ static bool dln2_gpio_queue_event(struct dln2_gpio_event *event) {
 void dln2_gpio_task(void) {
   bool queued;
 
+  dln2_gpio_pattern_task();
+  dln2_gpio_capture_task();
+
   do {
     queued = false;
     // uint32_t ints = save_and_disable_interrupts();
@@ -334,14 +540,17 @@ void dln2_gpio_task(void) {
 }
 
 static void dln2_gpio_irq_callback(unsigned int gpio, uint32_t events) {
-  if (gpio >= _gpio_driver->gpio_count)
+  int pin = dln2_gpio_drv_irq_pin(gpio);
+
+  if (pin < 0 || (uint32_t)pin >= dln2_gpio_drv_count() ||
+      pin >= DLN2_PIN_MAX || !dln2_bitmap_test(dln2_gpio_event_enabled, pin))
     return;
 
-  bool prev_value = get_bit(gpio, prev_values);
+  bool prev_value = dln2_bitmap_test(dln2_gpio_values, pin);
   bool value;
 
   if (events == (GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE))
-    value = _gpio_driver->get(gpio);
+    value = dln2_gpio_drv_get(pin);
   else if (events == GPIO_IRQ_EDGE_FALL)
     value = 0;
   else if (events == GPIO_IRQ_EDGE_RISE)
@@ -360,15 +569,15 @@ static void dln2_gpio_irq_callback(unsigned int gpio, uint32_t events) {
     return;
   }
 
-  LOG_INFO("%s: gpio=%u events=0x%ld value=%u prev_value=%u %s\n", __func__,
-           gpio, events, value, prev_value, prev_value == value ? "SKIP" : "");
+  LOG_INFO("%s: pin=%d events=0x%ld value=%u prev_value=%u %s\n", __func__,
+           pin, events, value, prev_value, prev_value == value ? "SKIP" : "");
 
   if (prev_value == value) {
     LOG_DEBUG(" X\n");
     return;
   }
 
-  assign_bit(gpio, prev_values, value);
+  dln2_bitmap_assign(dln2_gpio_values, pin, value);
   dln2_gpio_event_count++;
 
   unsigned int i;
@@ -382,7 +591,7 @@ static void dln2_gpio_irq_callback(unsigned int gpio, uint32_t events) {
     return;
   }
 
-  dln2_gpio_events[i].gpio = gpio;
+  dln2_gpio_events[i].gpio = pin;
   dln2_gpio_events[i].events = events;
   dln2_gpio_events[i].value = value;
   LOG_DEBUG("%u\n", value);
@@ -390,6 +599,9 @@ static void dln2_gpio_irq_callback(unsigned int gpio, uint32_t events) {
 
 void dln2_gpio_init(struct dln2_peripherials *peripherals) {
   _gpio_driver = (peripherals->gpio);
-  _gpio_driver->set_irq_callback(&dln2_gpio_irq_callback);
+#ifndef DLN2_GPIO_DRIVER_STATIC
+  dln2_gpio_map_init();
+#endif
+  dln2_gpio_drv_set_irq_callback(&dln2_gpio_irq_callback);
   // irq_set_enabled(IO_IRQ_BANK0, true);
 }
@@ -1,3 +1,24 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+#ifndef _DLN2_GPIO_H_
+#define _DLN2_GPIO_H_
+
+#pragma once
+
+#include "dln2.h"
+#include "gpio_driver.h"
+#include <stdbool.h>
+#include <stdint.h>
+
 enum gpio_irq_level {
   GPIO_IRQ_LEVEL_LOW = 0x1u,  ///< IRQ when the GPIO pin is a logical 0
   GPIO_IRQ_LEVEL_HIGH = 0x2u, ///< IRQ when the GPIO pin is a logical 1
@@ -6,3 +27,241 @@ enum gpio_irq_level {
   GPIO_IRQ_EDGE_RISE = 0x8u,  ///< IRQ when the GPIO has transitioned from a
                               ///< logical 0 to a logical 1
 };
+
+#define DLN2_GPIO_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_GPIO)
+
+// Pattern player, not part of the DLN protocol
+#define DLN2_GPIO_PATTERN_LOAD DLN2_GPIO_CMD(0x60)
+#define DLN2_GPIO_PATTERN_START DLN2_GPIO_CMD(0x61)
+#define DLN2_GPIO_PATTERN_STOP DLN2_GPIO_CMD(0x62)
+#define DLN2_GPIO_PATTERN_GET_STATUS DLN2_GPIO_CMD(0x63)
+#define DLN2_GPIO_PATTERN_DONE_EV DLN2_GPIO_CMD(0x64)
+
+// Logic analyzer capture, not part of the DLN protocol
+#define DLN2_GPIO_CAPTURE_START DLN2_GPIO_CMD(0x68)
+#define DLN2_GPIO_CAPTURE_STOP DLN2_GPIO_CMD(0x69)
+#define DLN2_GPIO_CAPTURE_GET_STATUS DLN2_GPIO_CMD(0x6A)
+#define DLN2_GPIO_CAPTURE_DATA_EV DLN2_GPIO_CMD(0x6B)
+
+// 32-bit port access, not part of the DLN protocol
+#define DLN2_GPIO_PORT32_GET_COUNT DLN2_GPIO_CMD(0x6C)
+#define DLN2_GPIO_PORT32_GET_VAL DLN2_GPIO_CMD(0x6D)
+#define DLN2_GPIO_PORT32_SET_OUT_VAL DLN2_GPIO_CMD(0x6E)
+#define DLN2_GPIO_PORT32_GET_OUT_VAL DLN2_GPIO_CMD(0x6F)
+
+// DLN ports are 8 pins wide, ours match the 32-bit GPIO registers instead
+#define DLN2_GPIO_PORT_WIDTH 32
+
+/*
+ * GPIO driver binding
+ *
+ * The dln2_gpio_drv_*() helpers take DLN pin numbers and hide how the
+ * platform driver is reached.
+ *
+ * By default they go through the struct gpio_driver passed to
+ * dln2_gpio_init() and translate the pin with its pins[] table. The port
+ * helpers take a logical port and mask and hand them to the driver port ops
+ * unchanged only when pins[] is the identity for that port, otherwise the
+ * mask is translated and split per physical port.
+ *
+ * When DLN2_GPIO_DRIVER_STATIC is defined (see DLN2_DRIVER_BINDING in
+ * CMakeLists.txt) it names a platform header that provides static inline
+ * gpio_driver_<op>() functions with the same signatures as the struct
+ * gpio_driver members, but taking DLN pin and port numbers. The compiler can
+ * then inline the register accesses into the command handlers and the IRQ
+ * path.
+ * In this mode the port_*(), timer_*(), sample_*(), delay_us() and
+ * critical_*() operations are mandatory, a platform without a suitable timer
+ * returns false from gpio_driver_timer_start_us() and 0 from
+ * gpio_driver_sample_start().
+ */
+#ifdef DLN2_GPIO_DRIVER_STATIC
+
+#include DLN2_GPIO_DRIVER_STATIC
+
+#define dln2_gpio_drv_count() gpio_driver_gpio_count()
+#define dln2_gpio_drv_init(pin) gpio_driver_init(pin)
+#define dln2_gpio_drv_deinit(pin) gpio_driver_deinit(pin)
+#define dln2_gpio_drv_pull_down(pin) gpio_driver_pull_down(pin)
+#define dln2_gpio_drv_get(pin) gpio_driver_get(pin)
+#define dln2_gpio_drv_put(pin, val) gpio_driver_put(pin, val)
+#define dln2_gpio_drv_get_out_level(pin) gpio_driver_get_out_level(pin)
+#define dln2_gpio_drv_set_dir(pin, out) gpio_driver_set_dir(pin, out)
+#define dln2_gpio_drv_get_dir(pin) gpio_driver_get_dir(pin)
+#define dln2_gpio_drv_set_irq_enabled(pin, mask, en)                           \
+  gpio_driver_set_irq_enabled(pin, mask, en)
+#define dln2_gpio_drv_set_irq_callback(cb) gpio_driver_set_irq_callback(cb)
+#define dln2_gpio_drv_irq_pin(gpio) ((int)(gpio))
+#define dln2_gpio_drv_port_get(port, mask) gpio_driver_port_get(port, mask)
+#define dln2_gpio_drv_port_get_out_level(port, mask)                           \
+  gpio_driver_port_get_out_level(port, mask)
+#define dln2_gpio_drv_port_set_clr(port, set, clr)                             \
+  gpio_driver_port_set_clr(port, set, clr)
+#define dln2_gpio_drv_port_direct(port) true
+#define dln2_gpio_drv_has_timer() true
+#define dln2_gpio_drv_timer_start_us(us, cb) gpio_driver_timer_start_us(us, cb)
+#define dln2_gpio_drv_timer_stop() gpio_driver_timer_stop()
+#define dln2_gpio_drv_has_sampler() true
+#define dln2_gpio_drv_sample_start(port, rate, buf, len, cb)                   \
+  gpio_driver_sample_start(port, rate, buf, len, cb)
+#define dln2_gpio_drv_sample_stop() gpio_driver_sample_stop()
+#define dln2_gpio_drv_has_delay() true
+#define dln2_gpio_drv_delay_us(us) gpio_driver_delay_us(us)
+#define dln2_gpio_drv_critical_enter() gpio_driver_critical_enter()
+#define dln2_gpio_drv_critical_exit(state) gpio_driver_critical_exit(state)
+
+#else
+
+extern struct gpio_driver *_gpio_driver;
+
+static inline uint32_t dln2_gpio_drv_count(void) {
+  return _gpio_driver->gpio_count;
+}
+
+static inline void dln2_gpio_drv_init(uint32_t pin) {
+  _gpio_driver->init(_gpio_driver->pins[pin]);
+}
+
+static inline void dln2_gpio_drv_deinit(uint32_t pin) {
+  _gpio_driver->deinit(_gpio_driver->pins[pin]);
+}
+
+static inline void dln2_gpio_drv_pull_down(uint32_t pin) {
+  _gpio_driver->pull_down(_gpio_driver->pins[pin]);
+}
+
+static inline bool dln2_gpio_drv_get(uint32_t pin) {
+  return _gpio_driver->get(_gpio_driver->pins[pin]);
+}
+
+static inline void dln2_gpio_drv_put(uint32_t pin, bool value) {
+  _gpio_driver->put(_gpio_driver->pins[pin], value);
+}
+
+static inline bool dln2_gpio_drv_get_out_level(uint32_t pin) {
+  return _gpio_driver->get_out_level(_gpio_driver->pins[pin]);
+}
+
+static inline void dln2_gpio_drv_set_dir(uint32_t pin, bool out) {
+  _gpio_driver->set_dir(_gpio_driver->pins[pin], out);
+}
+
+static inline uint32_t dln2_gpio_drv_get_dir(uint32_t pin) {
+  return _gpio_driver->get_dir(_gpio_driver->pins[pin]);
+}
+
+static inline void dln2_gpio_drv_set_irq_enabled(uint32_t pin,
+                                                 uint32_t event_mask,
+                                                 bool enabled) {
+  _gpio_driver->set_irq_enabled(_gpio_driver->pins[pin], event_mask, enabled);
+}
+
+static inline void
+dln2_gpio_drv_set_irq_callback(gpio_irq_callback_t callback) {
+  _gpio_driver->set_irq_callback(callback);
+}
+
+// Driver GPIO numbers that can raise pin events
+#define DLN2_GPIO_IRQ_MAP_SIZE 256
+#define DLN2_GPIO_IRQ_PIN_NONE 0xff
+
+// DLN pin of each driver GPIO, built from pins[] by dln2_gpio_init()
+extern uint8_t dln2_gpio_irq_map[DLN2_GPIO_IRQ_MAP_SIZE];
+
+// The IRQ callback gets the driver GPIO number, map it back to the DLN pin
+static inline int dln2_gpio_drv_irq_pin(uint32_t gpio) {
+  if (gpio >= DLN2_GPIO_IRQ_MAP_SIZE ||
+      dln2_gpio_irq_map[gpio] == DLN2_GPIO_IRQ_PIN_NONE)
+    return -1;
+  return dln2_gpio_irq_map[gpio];
+}
+
+// Logical ports whose pins[] entries are the identity, see dln2_gpio_init()
+extern uint32_t dln2_gpio_port_direct;
+
+static inline bool dln2_gpio_drv_port_direct(uint32_t port) {
+  return dln2_gpio_port_direct & (1U << port);
+}
+
+uint32_t dln2_gpio_drv_port_read_mapped(uint32_t port, uint32_t mask,
+                                        bool out);
+void dln2_gpio_drv_port_set_clr_mapped(uint32_t port, uint32_t set_mask,
+                                       uint32_t clr_mask);
+
+static inline uint32_t dln2_gpio_drv_port_get(uint32_t port, uint32_t mask) {
+  if (_gpio_driver->port_get && dln2_gpio_drv_port_direct(port))
+    return _gpio_driver->port_get(port, mask);
+  return dln2_gpio_drv_port_read_mapped(port, mask, false);
+}
+
+static inline uint32_t dln2_gpio_drv_port_get_out_level(uint32_t port,
+                                                        uint32_t mask) {
+  if (_gpio_driver->port_get_out_level && dln2_gpio_drv_port_direct(port))
+    return _gpio_driver->port_get_out_level(port, mask);
+  return dln2_gpio_drv_port_read_mapped(port, mask, true);
+}
+
+static inline void dln2_gpio_drv_port_set_clr(uint32_t port, uint32_t set_mask,
+                                              uint32_t clr_mask) {
+  if (_gpio_driver->port_set_clr && dln2_gpio_drv_port_direct(port))
+    _gpio_driver->port_set_clr(port, set_mask, clr_mask);
+  else
+    dln2_gpio_drv_port_set_clr_mapped(port, set_mask, clr_mask);
+}
+
+static inline bool dln2_gpio_drv_has_timer(void) {
+  return _gpio_driver->timer_start_us && _gpio_driver->timer_stop;
+}
+
+static inline bool dln2_gpio_drv_timer_start_us(uint32_t delay_us,
+                                                gpio_timer_callback_t callback) {
+  return _gpio_driver->timer_start_us(delay_us, callback);
+}
+
+static inline void dln2_gpio_drv_timer_stop(void) {
+  _gpio_driver->timer_stop();
+}
+
+static inline bool dln2_gpio_drv_has_sampler(void) {
+  return _gpio_driver->sample_start && _gpio_driver->sample_stop;
+}
+
+static inline uint32_t
+dln2_gpio_drv_sample_start(uint32_t port, uint32_t rate_hz, uint32_t *buf,
+                           uint32_t len, gpio_sample_callback_t callback) {
+  return _gpio_driver->sample_start(port, rate_hz, buf, len, callback);
+}
+
+static inline void dln2_gpio_drv_sample_stop(void) {
+  _gpio_driver->sample_stop();
+}
+
+static inline bool dln2_gpio_drv_has_delay(void) {
+  return _gpio_driver->delay_us;
+}
+
+static inline void dln2_gpio_drv_delay_us(uint32_t us) {
+  _gpio_driver->delay_us(us);
+}
+
+static inline uint32_t dln2_gpio_drv_critical_enter(void) {
+  return _gpio_driver->critical_enter ? _gpio_driver->critical_enter() : 0;
+}
+
+static inline void dln2_gpio_drv_critical_exit(uint32_t state) {
+  if (_gpio_driver->critical_exit)
+    _gpio_driver->critical_exit(state);
+}
+
+#endif
+
+uint8_t dln2_gpio_port_count(void);
+bool dln2_gpio_timer_claim(void);
+void dln2_gpio_timer_release(void);
+
+bool dln2_gpio_pattern_handle(struct dln2_slot *slot);
+void dln2_gpio_pattern_task(void);
+bool dln2_gpio_capture_handle(struct dln2_slot *slot);
+void dln2_gpio_capture_task(void);
+
+#endif
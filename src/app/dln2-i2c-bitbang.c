@@ -0,0 +1,549 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * Bit-banged I2C master ports
+ *
+ * dln2_i2c_bitbang_attach() wraps the hardware i2c_master_driver in one that
+ * has the bit-banged buses listed in struct dln2_peripherials appended as
+ * extra ports, so the I2C module sees a single driver with master_count
+ * covering both.
+ *
+ * The lines are emulated open drain on any GPIO pair with external pull-ups:
+ * the output latch stays low and a line is pulled down by switching the pin
+ * to output. Timing uses the GPIO driver's delay_us(), so the bus runs at
+ * most at 500kHz and SCL clock stretching is honoured up to the transfer
+ * timeout.
+ */
+
+#include "dln2-gpio.h"
+#include "dln2.h"
+#include "dln2_log.h"
+#include "i2c_master_driver.h"
+
+// Hardware and bit-banged ports together
+#define DLN2_I2C_MAX_PORTS 8
+
+#define DLN2_I2C_BITBANG_DEFAULT_FREQ 100000
+
+// Error codes, negative like the hardware drivers
+#define DLN2_I2C_BITBANG_NACK (-1)
+#define DLN2_I2C_BITBANG_TIMEOUT I2C_MASTER_ERR_TIMEOUT
+#define DLN2_I2C_BITBANG_BUS_BUSY I2C_MASTER_ERR_BUS_BUSY
+
+struct dln2_i2c_bitbang_port {
+  bool enabled;
+  uint16_t sda;
+  uint16_t scl;
+  uint32_t half_us;
+  uint32_t timeout_us;
+};
+
+static struct i2c_master_driver *dln2_i2c_bitbang_hw;
+static uint8_t dln2_i2c_bitbang_hw_count;
+static struct i2c_master_config dln2_i2c_bitbang_config[DLN2_I2C_MAX_PORTS];
+static struct dln2_i2c_bitbang_port dln2_i2c_bitbang_ports[DLN2_I2C_MAX_PORTS];
+static struct i2c_master_driver dln2_i2c_bitbang_driver;
+
+static inline void dln2_i2c_bitbang_low(uint16_t pin) {
+  dln2_gpio_drv_set_dir(pin, true);
+}
+
+static inline void dln2_i2c_bitbang_release(uint16_t pin) {
+  dln2_gpio_drv_set_dir(pin, false);
+}
+
+static inline void dln2_i2c_bitbang_delay(struct dln2_i2c_bitbang_port *p) {
+  dln2_gpio_drv_delay_us(p->half_us);
+}
+
+// Release SCL and wait for slaves that stretch the clock
+static bool dln2_i2c_bitbang_scl_high(struct dln2_i2c_bitbang_port *p) {
+  dln2_i2c_bitbang_release(p->scl);
+
+  for (uint32_t us = 0; !dln2_gpio_drv_get(p->scl); us++) {
+    if (us >= p->timeout_us)
+      return false;
+    dln2_gpio_drv_delay_us(1);
+  }
+
+  return true;
+}
+
+static int dln2_i2c_bitbang_start(struct dln2_i2c_bitbang_port *p,
+                                  bool repeated) {
+  if (repeated) {
+    dln2_i2c_bitbang_release(p->sda);
+    dln2_i2c_bitbang_delay(p);
+    if (!dln2_i2c_bitbang_scl_high(p))
+      return DLN2_I2C_BITBANG_TIMEOUT;
+    dln2_i2c_bitbang_delay(p);
+  } else if (!dln2_gpio_drv_get(p->sda) || !dln2_gpio_drv_get(p->scl)) {
+    return DLN2_I2C_BITBANG_BUS_BUSY;
+  }
+
+  dln2_i2c_bitbang_low(p->sda);
+  dln2_i2c_bitbang_delay(p);
+  dln2_i2c_bitbang_low(p->scl);
+
+  return 0;
+}
+
+static void dln2_i2c_bitbang_stop(struct dln2_i2c_bitbang_port *p) {
+  dln2_i2c_bitbang_low(p->sda);
+  dln2_i2c_bitbang_delay(p);
+  dln2_i2c_bitbang_scl_high(p);
+  dln2_i2c_bitbang_delay(p);
+  dln2_i2c_bitbang_release(p->sda);
+  dln2_i2c_bitbang_delay(p);
+}
+
+// Returns 0 on ACK
+static int dln2_i2c_bitbang_write_byte(struct dln2_i2c_bitbang_port *p,
+                                       uint8_t val) {
+  for (int bit = 7; bit >= 0; bit--) {
+    if (val & (1U << bit))
+      dln2_i2c_bitbang_release(p->sda);
+    else
+      dln2_i2c_bitbang_low(p->sda);
+    dln2_i2c_bitbang_delay(p);
+    if (!dln2_i2c_bitbang_scl_high(p))
+      return DLN2_I2C_BITBANG_TIMEOUT;
+    dln2_i2c_bitbang_delay(p);
+    dln2_i2c_bitbang_low(p->scl);
+  }
+
+  dln2_i2c_bitbang_release(p->sda);
+  dln2_i2c_bitbang_delay(p);
+  if (!dln2_i2c_bitbang_scl_high(p))
+    return DLN2_I2C_BITBANG_TIMEOUT;
+  bool nack = dln2_gpio_drv_get(p->sda);
+  dln2_i2c_bitbang_delay(p);
+  dln2_i2c_bitbang_low(p->scl);
+
+  return nack ? DLN2_I2C_BITBANG_NACK : 0;
+}
+
+static int dln2_i2c_bitbang_read_byte(struct dln2_i2c_bitbang_port *p,
+                                      bool ack) {
+  uint8_t val = 0;
+
+  dln2_i2c_bitbang_release(p->sda);
+  for (int bit = 7; bit >= 0; bit--) {
+    dln2_i2c_bitbang_delay(p);
+    if (!dln2_i2c_bitbang_scl_high(p))
+      return DLN2_I2C_BITBANG_TIMEOUT;
+    if (dln2_gpio_drv_get(p->sda))
+      val |= 1U << bit;
+    dln2_i2c_bitbang_delay(p);
+    dln2_i2c_bitbang_low(p->scl);
+  }
+
+  if (ack)
+    dln2_i2c_bitbang_low(p->sda);
+  dln2_i2c_bitbang_delay(p);
+  if (!dln2_i2c_bitbang_scl_high(p))
+    return DLN2_I2C_BITBANG_TIMEOUT;
+  dln2_i2c_bitbang_delay(p);
+  dln2_i2c_bitbang_low(p->scl);
+  dln2_i2c_bitbang_release(p->sda);
+
+  return val;
+}
+
+// START, address and register address, MSB first
+static int dln2_i2c_bitbang_address(struct dln2_i2c_bitbang_port *p,
+                                    uint8_t slave_addr, bool read,
+                                    uint8_t mem_addr_len, uint32_t mem_addr) {
+  int ret;
+
+  if (mem_addr_len) {
+    ret = dln2_i2c_bitbang_start(p, false);
+    if (!ret)
+      ret = dln2_i2c_bitbang_write_byte(p, slave_addr << 1);
+    while (!ret && mem_addr_len--)
+      ret = dln2_i2c_bitbang_write_byte(p, mem_addr >> (8 * mem_addr_len));
+    if (ret || !read)
+      return ret;
+    ret = dln2_i2c_bitbang_start(p, true);
+  } else {
+    ret = dln2_i2c_bitbang_start(p, false);
+  }
+
+  if (!ret)
+    ret = dln2_i2c_bitbang_write_byte(p, slave_addr << 1 | read);
+
+  return ret;
+}
+
+static struct dln2_i2c_bitbang_port *
+dln2_i2c_bitbang_port_get(uint8_t port_num, uint32_t timeout_ms) {
+  struct dln2_i2c_bitbang_port *p = &dln2_i2c_bitbang_ports[port_num];
+
+  if (!p->enabled)
+    return NULL;
+  p->timeout_us = timeout_ms * 1000;
+
+  return p;
+}
+
+static uint32_t dln2_i2c_bitbang_half_us(uint32_t freq) {
+  if (!freq)
+    freq = DLN2_I2C_BITBANG_DEFAULT_FREQ;
+
+  return (500000 + freq - 1) / freq;
+}
+
+static struct i2c_master_config *
+dln2_i2c_bitbang_port_config(uint8_t port_num) {
+  return &dln2_i2c_bitbang_config[dln2_i2c_bitbang_hw_count + port_num];
+}
+
+static int32_t dln2_i2c_bitbang_init(uint8_t port_num, uint16_t sda,
+                                     uint16_t scl) {
+  struct dln2_i2c_bitbang_port *p = &dln2_i2c_bitbang_ports[port_num];
+
+  if (!dln2_gpio_drv_has_delay() || sda >= dln2_gpio_drv_count() ||
+      scl >= dln2_gpio_drv_count())
+    return -1;
+
+  p->sda = sda;
+  p->scl = scl;
+  p->half_us =
+      dln2_i2c_bitbang_half_us(dln2_i2c_bitbang_port_config(port_num)->freq);
+
+  dln2_gpio_drv_init(sda);
+  dln2_gpio_drv_put(sda, false);
+  dln2_i2c_bitbang_release(sda);
+  dln2_gpio_drv_init(scl);
+  dln2_gpio_drv_put(scl, false);
+  dln2_i2c_bitbang_release(scl);
+
+  p->enabled = true;
+  LOG_INFO("I2C bit-bang port %u: sda=%u scl=%u %luHz\n", port_num, sda, scl,
+           (unsigned long)(500000 / p->half_us));
+
+  return 0;
+}
+
+static int32_t dln2_i2c_bitbang_deinit(uint8_t port_num) {
+  struct dln2_i2c_bitbang_port *p = &dln2_i2c_bitbang_ports[port_num];
+
+  if (!p->enabled)
+    return 0;
+
+  dln2_gpio_drv_deinit(p->sda);
+  dln2_gpio_drv_deinit(p->scl);
+  p->enabled = false;
+
+  return 0;
+}
+
+static int32_t dln2_i2c_bitbang_read(uint8_t port_num, uint8_t slave_addr,
+                                     uint8_t mem_addr_len, uint32_t mem_addr,
+                                     uint16_t len, uint8_t *data,
+                                     uint32_t timeout_ms) {
+  struct dln2_i2c_bitbang_port *p =
+      dln2_i2c_bitbang_port_get(port_num, timeout_ms);
+  int ret;
+
+  if (!p)
+    return -1;
+
+  ret = dln2_i2c_bitbang_address(p, slave_addr, true, mem_addr_len, mem_addr);
+  for (uint16_t i = 0; !ret && i < len; i++) {
+    int val = dln2_i2c_bitbang_read_byte(p, i + 1 < len);
+    if (val < 0)
+      ret = val;
+    else
+      data[i] = val;
+  }
+  dln2_i2c_bitbang_stop(p);
+
+  return ret ? ret : len;
+}
+
+static int32_t dln2_i2c_bitbang_write(uint8_t port_num, uint8_t slave_addr,
+                                      uint8_t mem_addr_len, uint32_t mem_addr,
+                                      uint16_t len, uint8_t *data,
+                                      uint32_t timeout_ms) {
+  struct dln2_i2c_bitbang_port *p =
+      dln2_i2c_bitbang_port_get(port_num, timeout_ms);
+  int32_t written = 0;
+  int ret;
+
+  if (!p)
+    return -1;
+
+  ret = dln2_i2c_bitbang_address(p, slave_addr, false, mem_addr_len, mem_addr);
+  if (ret) {
+    dln2_i2c_bitbang_stop(p);
+    return ret;
+  }
+
+  // A data NACK ends the transfer short, reported as the bytes ACKed
+  while (written < len) {
+    ret = dln2_i2c_bitbang_write_byte(p, data[written]);
+    if (ret)
+      break;
+    written++;
+  }
+  dln2_i2c_bitbang_stop(p);
+
+  return ret && ret != DLN2_I2C_BITBANG_NACK ? ret : written;
+}
+
+static int32_t dln2_i2c_bitbang_transfer(uint8_t port_num,
+                                         struct i2c_master_msg *msgs,
+                                         uint8_t count, uint32_t timeout_ms) {
+  struct dln2_i2c_bitbang_port *p =
+      dln2_i2c_bitbang_port_get(port_num, timeout_ms);
+  bool addressed = false;
+  uint8_t done;
+  int ret = 0;
+
+  if (!p)
+    return -1;
+
+  for (done = 0; done < count; done++) {
+    struct i2c_master_msg *msg = &msgs[done];
+    bool read = msg->flags & I2C_MASTER_MSG_READ;
+
+    ret = dln2_i2c_bitbang_start(p, done > 0);
+    if (!ret)
+      ret = dln2_i2c_bitbang_write_byte(p, msg->addr << 1 | read);
+    if (ret)
+      break;
+    addressed = true;
+
+    bool recv_len = read && (msg->flags & I2C_MASTER_MSG_RECV_LEN);
+
+    for (uint16_t i = 0; !ret && i < msg->len; i++) {
+      if (!read) {
+        ret = dln2_i2c_bitbang_write_byte(p, msg->buf[i]);
+        continue;
+      }
+      // The count byte is always ACKed, more follow
+      int val = dln2_i2c_bitbang_read_byte(p, i + 1 < msg->len ||
+                                                  (recv_len && !i));
+      if (val < 0) {
+        ret = val;
+      } else {
+        msg->buf[i] = val;
+        if (recv_len && !i) {
+          if (!val || val > I2C_MASTER_SMBUS_BLOCK_MAX)
+            ret = DLN2_I2C_BITBANG_NACK;
+          else
+            msg->len += val;
+        }
+      }
+    }
+    if (ret)
+      break;
+  }
+  dln2_i2c_bitbang_stop(p);
+
+  // Bus errors are reported even after the first message, NACKs aren't
+  if (ret && ret != DLN2_I2C_BITBANG_NACK)
+    return ret;
+
+  return (addressed || !ret) ? done : ret;
+}
+
+static int32_t dln2_i2c_bitbang_probe(uint8_t port_num, uint8_t addr,
+                                      uint32_t timeout_ms) {
+  struct dln2_i2c_bitbang_port *p =
+      dln2_i2c_bitbang_port_get(port_num, timeout_ms);
+  int ret;
+
+  if (!p)
+    return -1;
+
+  ret = dln2_i2c_bitbang_start(p, false);
+  if (!ret)
+    ret = dln2_i2c_bitbang_write_byte(p, addr << 1);
+  dln2_i2c_bitbang_stop(p);
+
+  return ret;
+}
+
+static bool dln2_i2c_bitbang_is_enabled(uint8_t port_num) {
+  return dln2_i2c_bitbang_ports[port_num].enabled;
+}
+
+// Also works on a disabled port, init() picks the frequency up
+static uint32_t dln2_i2c_bitbang_set_freq(uint8_t port_num, uint32_t freq) {
+  struct dln2_i2c_bitbang_port *p = &dln2_i2c_bitbang_ports[port_num];
+
+  if (!freq)
+    return 0;
+
+  dln2_i2c_bitbang_port_config(port_num)->freq = freq;
+  p->half_us = dln2_i2c_bitbang_half_us(freq);
+
+  return 500000 / p->half_us;
+}
+
+static uint32_t dln2_i2c_bitbang_get_freq(uint8_t port_num) {
+  return 500000 / dln2_i2c_bitbang_half_us(
+                      dln2_i2c_bitbang_port_config(port_num)->freq);
+}
+
+/*
+ * The combined driver, hardware ports first. The bit-banged functions above
+ * take the port number within the bit-banged ports.
+ */
+
+static inline bool dln2_i2c_is_hw(uint8_t port_num) {
+  return port_num < dln2_i2c_bitbang_hw_count;
+}
+
+static int32_t dln2_i2c_combined_init(uint8_t port_num, uint16_t sda,
+                                      uint16_t scl) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->init(port_num, sda, scl);
+  return dln2_i2c_bitbang_init(port_num - dln2_i2c_bitbang_hw_count, sda,
+                               scl);
+}
+
+static int32_t dln2_i2c_combined_deinit(uint8_t port_num) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->deinit(port_num);
+  return dln2_i2c_bitbang_deinit(port_num - dln2_i2c_bitbang_hw_count);
+}
+
+static int32_t dln2_i2c_combined_read(uint8_t port_num, uint8_t slave_addr,
+                                      uint8_t mem_addr_len, uint32_t mem_addr,
+                                      uint16_t len, uint8_t *data,
+                                      uint32_t timeout_ms) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->read(port_num, slave_addr, mem_addr_len,
+                                     mem_addr, len, data, timeout_ms);
+  return dln2_i2c_bitbang_read(port_num - dln2_i2c_bitbang_hw_count,
+                               slave_addr, mem_addr_len, mem_addr, len, data,
+                               timeout_ms);
+}
+
+static int32_t dln2_i2c_combined_write(uint8_t port_num, uint8_t slave_addr,
+                                       uint8_t mem_addr_len, uint32_t mem_addr,
+                                       uint16_t len, uint8_t *data,
+                                       uint32_t timeout_ms) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->write(port_num, slave_addr, mem_addr_len,
+                                      mem_addr, len, data, timeout_ms);
+  return dln2_i2c_bitbang_write(port_num - dln2_i2c_bitbang_hw_count,
+                                slave_addr, mem_addr_len, mem_addr, len, data,
+                                timeout_ms);
+}
+
+static bool dln2_i2c_combined_is_enabled(uint8_t port_num) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->is_enabled(port_num);
+  return dln2_i2c_bitbang_is_enabled(port_num - dln2_i2c_bitbang_hw_count);
+}
+
+static int32_t dln2_i2c_combined_transfer(uint8_t port_num,
+                                          struct i2c_master_msg *msgs,
+                                          uint8_t count, uint32_t timeout_ms) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->transfer
+               ? dln2_i2c_bitbang_hw->transfer(port_num, msgs, count,
+                                               timeout_ms)
+               : I2C_MASTER_ERR_NOT_SUPPORTED;
+  return dln2_i2c_bitbang_transfer(port_num - dln2_i2c_bitbang_hw_count, msgs,
+                                   count, timeout_ms);
+}
+
+static int32_t dln2_i2c_combined_probe(uint8_t port_num, uint8_t addr,
+                                       uint32_t timeout_ms) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->probe
+               ? dln2_i2c_bitbang_hw->probe(port_num, addr, timeout_ms)
+               : I2C_MASTER_ERR_NOT_SUPPORTED;
+  return dln2_i2c_bitbang_probe(port_num - dln2_i2c_bitbang_hw_count, addr,
+                                timeout_ms);
+}
+
+// Bit-banged ports keep the CPU busy anyway, they run blocking transfers
+static int32_t dln2_i2c_combined_submit(uint8_t port_num,
+                                        struct i2c_master_msg *msgs,
+                                        uint8_t count, uint32_t timeout_ms,
+                                        i2c_master_done_t done, void *ctx) {
+  if (dln2_i2c_is_hw(port_num) && dln2_i2c_bitbang_hw->submit)
+    return dln2_i2c_bitbang_hw->submit(port_num, msgs, count, timeout_ms, done,
+                                       ctx);
+  return I2C_MASTER_ERR_NOT_SUPPORTED;
+}
+
+static uint32_t dln2_i2c_combined_set_freq(uint8_t port_num, uint32_t freq) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->set_freq
+               ? dln2_i2c_bitbang_hw->set_freq(port_num, freq)
+               : 0;
+  return dln2_i2c_bitbang_set_freq(port_num - dln2_i2c_bitbang_hw_count, freq);
+}
+
+static uint32_t dln2_i2c_combined_get_freq(uint8_t port_num) {
+  if (dln2_i2c_is_hw(port_num))
+    return dln2_i2c_bitbang_hw->get_freq
+               ? dln2_i2c_bitbang_hw->get_freq(port_num)
+               : dln2_i2c_bitbang_config[port_num].freq;
+  return dln2_i2c_bitbang_get_freq(port_num - dln2_i2c_bitbang_hw_count);
+}
+
+struct i2c_master_driver *
+dln2_i2c_bitbang_attach(struct i2c_master_driver *hw,
+                        const struct i2c_master_config *config,
+                        uint8_t count) {
+  uint8_t hw_count = hw ? hw->master_count : 0;
+
+  if (!count)
+    return hw;
+
+  if (hw_count > DLN2_I2C_MAX_PORTS)
+    hw_count = DLN2_I2C_MAX_PORTS;
+  if (count > DLN2_I2C_MAX_PORTS - hw_count) {
+    LOG_WARN("I2C: only %u bit-banged ports fit\n",
+             DLN2_I2C_MAX_PORTS - hw_count);
+    count = DLN2_I2C_MAX_PORTS - hw_count;
+  }
+
+  for (uint8_t i = 0; i < hw_count; i++)
+    dln2_i2c_bitbang_config[i] = hw->master_config[i];
+  for (uint8_t i = 0; i < count; i++)
+    dln2_i2c_bitbang_config[hw_count + i] = config[i];
+
+  for (uint8_t i = 0; i < count; i++)
+    dln2_i2c_bitbang_ports[i].enabled = false;
+
+  dln2_i2c_bitbang_hw = hw;
+  dln2_i2c_bitbang_hw_count = hw_count;
+
+  dln2_i2c_bitbang_driver = (struct i2c_master_driver){
+      .master_count = hw_count + count,
+      .master_config = dln2_i2c_bitbang_config,
+      .init = dln2_i2c_combined_init,
+      .deinit = dln2_i2c_combined_deinit,
+      .read = dln2_i2c_combined_read,
+      .write = dln2_i2c_combined_write,
+      .is_enabled = dln2_i2c_combined_is_enabled,
+      .set_freq = dln2_i2c_combined_set_freq,
+      .get_freq = dln2_i2c_combined_get_freq,
+      .transfer = dln2_i2c_combined_transfer,
+      .probe = dln2_i2c_combined_probe,
+      .submit = dln2_i2c_combined_submit,
+      // Only the hardware driver has a timer
+      .timer_start_us = hw ? hw->timer_start_us : NULL,
+      .timer_stop = hw ? hw->timer_stop : NULL,
+  };
+
+  return &dln2_i2c_bitbang_driver;
+}
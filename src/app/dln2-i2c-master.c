@@ -12,6 +12,8 @@
 
 #include <stdio.h>
 #include "dln2.h"
+#include "dln2-gpio.h"
+#include "dln2_log.h"
 #include "i2c_master_driver.h"
 
 #define LOG1 printf
@@ -32,11 +34,202 @@
 #define DLN_I2C_MASTER_PULLUP_DISABLE DLN2_I2C_MASTER_CMD(0x0A)
 #define DLN_I2C_MASTER_PULLUP_IS_ENABLED DLN2_I2C_MASTER_CMD(0x0B)
 
-// Linux driver timeout is 200ms
+// Combined transfer with repeated starts, not part of the DLN protocol
+#define DLN2_I2C_MASTER_TRANSFER DLN2_I2C_MASTER_CMD(0x60)
+// Bus recovery, not part of the DLN protocol either
+#define DLN2_I2C_MASTER_RECOVER DLN2_I2C_MASTER_CMD(0x61)
+#define DLN2_I2C_MASTER_GET_RECOVERY_STATS DLN2_I2C_MASTER_CMD(0x62)
+// Paged memory (EEPROM) write, not part of the DLN protocol
+#define DLN2_I2C_MASTER_MEM_WRITE_BEGIN DLN2_I2C_MASTER_CMD(0x63)
+#define DLN2_I2C_MASTER_MEM_WRITE_DATA DLN2_I2C_MASTER_CMD(0x64)
+// SMBus protocols with PEC, not part of the DLN protocol
+#define DLN2_I2C_MASTER_SMBUS DLN2_I2C_MASTER_CMD(0x65)
+// Register polling with change events, not part of the DLN protocol
+#define DLN2_I2C_MASTER_POLL_ADD DLN2_I2C_MASTER_CMD(0x66)
+#define DLN2_I2C_MASTER_POLL_REMOVE DLN2_I2C_MASTER_CMD(0x67)
+#define DLN2_I2C_MASTER_POLL_CHANGED_EV DLN2_I2C_MASTER_CMD(0x68)
+
+// Linux driver timeout is 200ms, the upper limit of the computed timeouts
 #define DLN2_I2C_TIMEOUT_US (150 * 1000)
+// Added to the time the bytes take on the bus, for slaves stretching the clock
+#define DLN2_I2C_STRETCH_MS 10
+#define DLN2_I2C_DEFAULT_FREQ 100000
+
+// Same limit as the bit-banged ports
+#define DLN2_I2C_MAX_PORTS 8
+
+// Half SCL period while clocking out a stuck slave
+#define DLN2_I2C_RECOVERY_HALF_US 5
+
+#define DLN2_I2C_MEM_PAGE_MAX 256
+// 24xx EEPROMs finish a write cycle within 5-10ms
+#define DLN2_I2C_MEM_CYCLE_MS 10
+#define DLN2_I2C_MEM_POLL_US 100
+// Failed page addresses listed in a MEM_WRITE_DATA response
+#define DLN2_I2C_MEM_MAX_FAILED 16
+
+// SMBus protocols, the size argument of Linux i2c_smbus_xfer()
+#define DLN2_I2C_SMBUS_QUICK 0
+#define DLN2_I2C_SMBUS_BYTE 1
+#define DLN2_I2C_SMBUS_BYTE_DATA 2
+#define DLN2_I2C_SMBUS_WORD_DATA 3
+#define DLN2_I2C_SMBUS_PROC_CALL 4
+#define DLN2_I2C_SMBUS_BLOCK_DATA 5
+#define DLN2_I2C_SMBUS_BLOCK_PROC_CALL 7
+#define DLN2_I2C_SMBUS_I2C_BLOCK_DATA 8
+
+#define DLN2_I2C_SMBUS_PEC 0x01
+
+#define DLN2_I2C_POLL_MAX_JOBS 32
+#define DLN2_I2C_POLL_TICK_US 1000
+// Register values are little endian unless the job says otherwise
+#define DLN2_I2C_POLL_BIG_ENDIAN 0x01
+
+#define DLN2_I2C_MAX_MSGS 16
+
+// Per address timeout of a bus scan, most addresses don't answer
+#define DLN2_I2C_SCAN_TIMEOUT_MS 2
+// Default scan range, the addresses not reserved by the I2C specification
+#define DLN2_I2C_SCAN_FIRST 0x08
+#define DLN2_I2C_SCAN_LAST 0x77
+
+/*
+ * The READ, WRITE or TRANSFER command in flight on a port. With a driver that
+ * can submit transfers the slot is answered from dln2_i2c_master_task(), and
+ * commands for the port arriving in the meantime wait in its deferred queue
+ * to keep their order. USB, the other ports and the other modules keep
+ * running during the transfer.
+ */
+struct dln2_i2c_master_async
+{
+    struct dln2_slot *slot;
+    struct i2c_master_msg msgs[DLN2_I2C_MAX_MSGS];
+    uint8_t count;
+    uint16_t rsp_len; // response size on success
+    uint8_t mem_addr[4];
+    volatile bool done;
+    volatile int32_t result;
+};
+
+// Bus errors seen on a port and the recoveries they triggered
+struct dln2_i2c_master_stats
+{
+    uint32_t timeouts;
+    uint32_t arbitration_lost;
+    uint32_t bus_busy;
+    uint32_t recoveries;
+    uint32_t recovery_failures;
+} TU_ATTR_PACKED;
+
+/*
+ * Paged memory write in progress. The host streams the data in
+ * MEM_WRITE_DATA commands, each page is written and ACK polled as soon as
+ * it's complete.
+ */
+struct dln2_i2c_master_mem_write
+{
+    bool active;
+    uint8_t port;
+    uint8_t addr;
+    uint8_t mem_addr_len;
+    uint16_t page_size;
+    uint16_t cycle_ms;
+    uint32_t mem_addr;  // of the first byte in buf
+    uint32_t remaining; // still to come from the host
+    uint32_t written;
+    uint16_t fill;
+    uint8_t buf[sizeof(uint32_t) + DLN2_I2C_MEM_PAGE_MAX]; // memory address goes in front
+};
+
+struct dln2_i2c_master_port
+{
+    struct dln2_i2c_master_async async;
+    struct dln2_slot_queue deferred;
+    struct dln2_i2c_master_stats stats;
+    struct dln2_i2c_master_mem_write mem_write;
+    // Read data of a combined transfer, it would overwrite the messages after it
+    uint8_t buf[DLN2_BUF_SIZE];
+};
+
+static struct dln2_i2c_master_port dln2_i2c_ports[DLN2_I2C_MAX_PORTS];
+
+// CRC-8, polynomial x^8 + x^2 + x + 1, for the SMBus PEC
+static const uint8_t dln2_i2c_crc8_table[256] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31,
+    0x24, 0x23, 0x2a, 0x2d, 0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+    0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d, 0xe0, 0xe7, 0xee, 0xe9,
+    0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+    0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1,
+    0xb4, 0xb3, 0xba, 0xbd, 0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+    0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea, 0xb7, 0xb0, 0xb9, 0xbe,
+    0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+    0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16,
+    0x03, 0x04, 0x0d, 0x0a, 0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+    0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a, 0x89, 0x8e, 0x87, 0x80,
+    0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+    0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8,
+    0xdd, 0xda, 0xd3, 0xd4, 0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+    0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44, 0x19, 0x1e, 0x17, 0x10,
+    0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+    0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f,
+    0x6a, 0x6d, 0x64, 0x63, 0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+    0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13, 0xae, 0xa9, 0xa0, 0xa7,
+    0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+    0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef,
+    0xfa, 0xfd, 0xf4, 0xf3,
+};
+
+/*
+ * A register read every period_ms. The timer only counts ticks, the reads
+ * run from dln2_i2c_master_task(), which sends DLN2_I2C_MASTER_POLL_CHANGED_EV
+ * when the masked value moved more than threshold since the last event.
+ */
+struct dln2_i2c_master_poll_job
+{
+    bool active;
+    bool valid;  // an event has been sent
+    bool report; // event pending
+    uint8_t port;
+    uint8_t addr;
+    uint8_t reg_len;
+    uint8_t len;
+    uint8_t flags;
+    uint16_t period_ms;
+    uint32_t reg;
+    uint32_t mask;
+    uint32_t threshold;
+    uint32_t next; // tick of the next read
+    uint32_t value;
+    uint32_t reported;
+};
+
+static struct dln2_i2c_master_poll_job dln2_i2c_poll_jobs[DLN2_I2C_POLL_MAX_JOBS];
+static uint8_t dln2_i2c_poll_count; // the timer runs while there are jobs
+static volatile uint32_t dln2_i2c_poll_ticks;
 
 static struct i2c_master_driver *_i2c_master_driver = NULL;
-static struct gpio_driver *_gpio_driver = NULL;
+
+static void dln2_i2c_master_poll_remove(uint8_t id)
+{
+    struct dln2_i2c_master_poll_job *job = &dln2_i2c_poll_jobs[id];
+
+    if (!job->active)
+        return;
+
+    job->active = false;
+    if (!--dln2_i2c_poll_count)
+        _i2c_master_driver->timer_stop();
+}
+
+// The jobs of a port go with it
+static void dln2_i2c_master_poll_remove_port(uint8_t port)
+{
+    for (uint8_t id = 0; id < DLN2_I2C_POLL_MAX_JOBS; id++)
+    {
+        if (dln2_i2c_poll_jobs[id].port == port)
+            dln2_i2c_master_poll_remove(id);
+    }
+}
 
 static bool dln2_i2c_master_enable(struct dln2_slot *slot, bool enable)
 {
@@ -54,92 +247,1107 @@ static bool dln2_i2c_master_enable(struct dln2_slot *slot, bool enable)
 
     if (dln2_slot_header_data_size(slot) != sizeof(*port))
         return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
-    if (*port)
-        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+    DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX) = {0};
+    struct dln2_pin_conflict conflict;
+
+    if (!dln2_pin_mask_add(pins, scl) || !dln2_pin_mask_add(pins, sda))
+        return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
 
     if (enable)
     {
         if (_i2c_master_driver->is_enabled(*port))
             return dln2_response_error(slot, 0); // Already enabled, treat as success
 
-        res = dln2_pin_request(scl, DLN2_MODULE_I2C_MASTER);
-        if (res)
-            return dln2_response_error(slot, res);
-
-        res = dln2_pin_request(sda, DLN2_MODULE_I2C_MASTER);
+        res = dln2_pin_group_request(pins, DLN2_MODULE_I2C_MASTER, &conflict);
         if (res)
         {
-            dln2_pin_free(scl, DLN2_MODULE_I2C_MASTER);
+            LOG_DEBUG("pin %u in use by module 0x%02x", conflict.pin, conflict.module);
             return dln2_response_error(slot, res);
         }
 
         if (0 != _i2c_master_driver->init(*port, sda, scl))
         {
             LOG1("I2C master initialization failed\n");
+            dln2_pin_group_free(pins, DLN2_MODULE_I2C_MASTER, NULL);
             return dln2_response_error(slot, DLN2_RES_FAIL);
         }
+
+        // Drivers may reset the frequency on deinit, restore the host's choice
+        uint32_t freq = _i2c_master_driver->master_config[*port].freq;
+        if (_i2c_master_driver->set_freq && freq)
+            _i2c_master_driver->set_freq(*port, freq);
     }
     else
     {
-        res = dln2_pin_free(sda, DLN2_MODULE_I2C_MASTER);
-        if (res)
-            return dln2_response_error(slot, res);
-
-        res = dln2_pin_free(scl, DLN2_MODULE_I2C_MASTER);
+        res = dln2_pin_group_free(pins, DLN2_MODULE_I2C_MASTER, &conflict);
         if (res)
+        {
+            LOG_DEBUG("pin %u owned by module 0x%02x", conflict.pin, conflict.module);
             return dln2_response_error(slot, res);
+        }
 
+        dln2_i2c_master_poll_remove_port(*port);
+        dln2_i2c_ports[*port].mem_write.active = false;
         _i2c_master_driver->deinit(*port);
     }
 
     return dln2_response(slot, 0);
 }
 
-bool dln2_i2c_master_initiate_recovery(struct dln2_slot *slot)
+static inline void dln2_i2c_master_recovery_delay(void)
+{
+    if (dln2_gpio_drv_has_delay())
+        dln2_gpio_drv_delay_us(DLN2_I2C_RECOVERY_HALF_US);
+    else
+        dln2_delay(1);
+}
+
+/*
+ * To free a frozen I2C bus, clock SCL up to 16 times until the stuck slave
+ * releases SDA, followed by a STOP condition. The lines are driven open drain
+ * like the bit-banged ports do, the port must be deinitialized.
+ */
+static bool dln2_i2c_master_bus_clear(uint16_t sda, uint16_t scl)
+{
+    bool ok;
+
+    dln2_gpio_drv_init(sda);
+    dln2_gpio_drv_put(sda, false);
+    dln2_gpio_drv_set_dir(sda, false);
+    dln2_gpio_drv_init(scl);
+    dln2_gpio_drv_put(scl, false);
+    dln2_gpio_drv_set_dir(scl, false);
+
+    for (int i = 0; i < 16 && !dln2_gpio_drv_get(sda); i++)
+    {
+        dln2_gpio_drv_set_dir(scl, true);
+        dln2_i2c_master_recovery_delay();
+        dln2_gpio_drv_set_dir(scl, false);
+        dln2_i2c_master_recovery_delay();
+    }
+
+    ok = dln2_gpio_drv_get(sda) && dln2_gpio_drv_get(scl);
+    if (ok)
+    {
+        dln2_gpio_drv_set_dir(scl, true);
+        dln2_gpio_drv_set_dir(sda, true);
+        dln2_i2c_master_recovery_delay();
+        dln2_gpio_drv_set_dir(scl, false);
+        dln2_i2c_master_recovery_delay();
+        dln2_gpio_drv_set_dir(sda, false);
+        dln2_i2c_master_recovery_delay();
+    }
+
+    dln2_gpio_drv_deinit(scl);
+    dln2_gpio_drv_deinit(sda);
+
+    return ok;
+}
+
+// Clear the bus and bring the port back up with the host's frequency
+static bool dln2_i2c_master_recover(uint8_t port)
+{
+    struct i2c_master_config *config = &_i2c_master_driver->master_config[port];
+    struct dln2_i2c_master_stats *stats = &dln2_i2c_ports[port].stats;
+    bool ok;
+
+    LOG_DEBUG("I2C port %u: attempting bus recovery", port);
+
+    _i2c_master_driver->deinit(port);
+    ok = dln2_i2c_master_bus_clear(config->sda_io_num, config->scl_io_num);
+    if (!ok)
+        LOG_DEBUG("I2C bus recovery failed, SDA or SCL is still low");
+
+    if (_i2c_master_driver->init(port, config->sda_io_num, config->scl_io_num))
+    {
+        LOG_DEBUG("I2C port %u: re-init failed", port);
+        ok = false;
+    }
+    else if (_i2c_master_driver->set_freq && config->freq)
+    {
+        _i2c_master_driver->set_freq(port, config->freq);
+    }
+
+    stats->recoveries++;
+    if (!ok)
+        stats->recovery_failures++;
+
+    return ok;
+}
+
+// Count bus errors and recover from them, returns true if ret was one
+static bool dln2_i2c_master_bus_error(uint8_t port, int32_t ret)
+{
+    struct dln2_i2c_master_stats *stats = &dln2_i2c_ports[port].stats;
+
+    switch (ret)
+    {
+    case I2C_MASTER_ERR_TIMEOUT:
+        stats->timeouts++;
+        break;
+    case I2C_MASTER_ERR_ARB_LOST:
+        stats->arbitration_lost++;
+        break;
+    case I2C_MASTER_ERR_BUS_BUSY:
+        stats->bus_busy++;
+        break;
+    default:
+        return false;
+    }
+
+    dln2_i2c_master_recover(port);
+
+    return true;
+}
+
+static bool dln2_i2c_master_initiate_recovery(struct dln2_slot *slot)
 {
     uint8_t *port = dln2_slot_header_data(slot);
 
+    if (dln2_slot_header_data_size(slot) != sizeof(*port))
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
     if (*port >= _i2c_master_driver->master_count)
         return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    if (!_i2c_master_driver->is_enabled(*port))
+        return dln2_response_error(slot, DLN2_RES_FAIL);
 
-    uint16_t scl = _i2c_master_driver->master_config[*port].scl_io_num;
-    uint16_t sda = _i2c_master_driver->master_config[*port].sda_io_num;
+    if (!dln2_i2c_master_recover(*port))
+        return dln2_response_error(slot, DLN2_RES_FAIL);
+
+    return dln2_response(slot, 0);
+}
+
+static bool dln2_i2c_master_get_recovery_stats(struct dln2_slot *slot)
+{
+    uint8_t *port = dln2_slot_header_data(slot);
+
+    if (dln2_slot_header_data_size(slot) != sizeof(*port))
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+    if (*port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+    struct dln2_i2c_master_stats *stats = &dln2_i2c_ports[*port].stats;
+
+    LOG_DEBUG("%s: port=%u timeouts=%lu recoveries=%lu", __func__, *port,
+              (unsigned long)stats->timeouts, (unsigned long)stats->recoveries);
+
+    memcpy(dln2_slot_response_data(slot), stats, sizeof(*stats));
+
+    return dln2_response(slot, sizeof(*stats));
+}
+
+static bool dln2_i2c_master_set_frequency(struct dln2_slot *slot)
+{
+    struct
+    {
+        uint8_t port;
+        uint32_t frequency;
+    } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+    LOG_DEBUG("%s: port=%u frequency=%lu", __func__, cmd->port,
+              (unsigned long)cmd->frequency);
+
+    if (dln2_slot_header_data_size(slot) != sizeof(*cmd))
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+    if (cmd->port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    if (!_i2c_master_driver->set_freq)
+        return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+
+    uint32_t freq = _i2c_master_driver->set_freq(cmd->port, cmd->frequency);
+    LOG_DEBUG("actual frequency: %luHz", (unsigned long)freq);
+    if (!freq)
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+    // Kept in the port config so that it survives disable/enable
+    _i2c_master_driver->master_config[cmd->port].freq = cmd->frequency;
+
+    return dln2_response_u32(slot, freq);
+}
+
+static uint32_t dln2_i2c_master_port_freq(uint8_t port)
+{
+    if (_i2c_master_driver->get_freq)
+        return _i2c_master_driver->get_freq(port);
+    return _i2c_master_driver->master_config[port].freq;
+}
+
+static bool dln2_i2c_master_get_frequency(struct dln2_slot *slot)
+{
+    uint8_t *port = dln2_slot_header_data(slot);
+
+    if (dln2_slot_header_data_size(slot) != sizeof(*port))
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+    if (*port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+    uint32_t freq = dln2_i2c_master_port_freq(*port);
+
+    LOG_DEBUG("%s: port=%u frequency=%lu", __func__, *port, (unsigned long)freq);
+
+    return dln2_response_u32(slot, freq);
+}
+
+/*
+ * Twice the time the bytes take on the bus, 9 clocks each with the address
+ * and START/STOP, plus what slaves may stretch the clock. A hung device then
+ * costs a few milliseconds instead of the full DLN2_I2C_TIMEOUT_US.
+ */
+static uint32_t dln2_i2c_master_timeout_ms(uint8_t port, const struct i2c_master_msg *msgs,
+                                           uint8_t count)
+{
+    uint32_t freq = dln2_i2c_master_port_freq(port);
+    uint32_t clocks = 0;
+
+    if (!freq)
+        freq = DLN2_I2C_DEFAULT_FREQ;
+
+    for (uint8_t i = 0; i < count; i++)
+        clocks += (msgs[i].len + 1) * 9 + 2;
 
-    // To reset a frozen I2C bus, the master must force the SCL (clock) line high and toggle it 8–16 times
-    // to force any stuck slave device to release the SDA (data) line, followed by a STOP condition.
+    uint32_t ms = (2 * clocks * 1000 + freq - 1) / freq + DLN2_I2C_STRETCH_MS;
 
-    LOG1("I2C master initialization failed, attempting bus recovery\n");
-    _gpio_driver->init(sda);
-    _gpio_driver->set_dir(sda, false);
+    return ms < DLN2_I2C_TIMEOUT_US / 1000 ? ms : DLN2_I2C_TIMEOUT_US / 1000;
+}
 
-    _gpio_driver->init(scl);
-    _gpio_driver->set_dir(scl, true);
+/*
+ * Run messages through the driver's transfer op. Drivers without it can still
+ * do a single message, or a register read with the register address written
+ * ahead of a read from the same device.
+ */
+static int32_t dln2_i2c_master_transfer_msgs(uint8_t port, struct i2c_master_msg *msgs,
+                                             uint8_t count, uint32_t timeout_ms)
+{
+    int32_t ret = I2C_MASTER_ERR_NOT_SUPPORTED;
 
-    for (int i = 0; i < 16; i++)
+    if (_i2c_master_driver->transfer)
+        ret = _i2c_master_driver->transfer(port, msgs, count, timeout_ms);
+    if (ret != I2C_MASTER_ERR_NOT_SUPPORTED)
+        return ret;
+
+    struct i2c_master_msg *last = &msgs[count - 1];
+    bool read = last->flags & I2C_MASTER_MSG_READ;
+
+    // read() can't stop after the count byte of an SMBus block
+    if (last->flags & I2C_MASTER_MSG_RECV_LEN)
+        return I2C_MASTER_ERR_NOT_SUPPORTED;
+    uint32_t mem_addr = 0;
+    uint8_t mem_addr_len = 0;
+
+    if (count == 2)
     {
-        _gpio_driver->put(scl, 1);
-        dln2_delay(2);
-        _gpio_driver->put(scl, 0);
-        dln2_delay(2);
+        if ((msgs[0].flags & I2C_MASTER_MSG_READ) || !read ||
+            msgs[0].addr != last->addr || msgs[0].len > sizeof(mem_addr))
+            return I2C_MASTER_ERR_NOT_SUPPORTED;
+
+        mem_addr_len = msgs[0].len;
+        for (uint8_t i = 0; i < mem_addr_len; i++)
+            mem_addr = mem_addr << 8 | msgs[0].buf[i];
+    }
+    else if (count != 1)
+    {
+        return I2C_MASTER_ERR_NOT_SUPPORTED;
+    }
+
+    if (read)
+        ret = _i2c_master_driver->read(port, last->addr, mem_addr_len, mem_addr,
+                                       last->len, last->buf, timeout_ms);
+    else
+        ret = _i2c_master_driver->write(port, last->addr, 0, 0, last->len,
+                                        last->buf, timeout_ms);
+    if (ret < 0)
+        return ret;
+
+    return ret == last->len ? count : count - 1;
+}
+
+// The DLN result of a transfer of count messages
+static uint16_t dln2_i2c_master_result(uint8_t port, int32_t ret, uint8_t count)
+{
+    // The transfer still failed, the host may retry on the recovered bus
+    dln2_i2c_master_bus_error(port, ret);
+
+    if (ret == I2C_MASTER_ERR_NOT_SUPPORTED)
+        return DLN2_RES_COMMAND_NOT_SUPPORTED;
+    if (ret < 0)
+        return DLN2_RES_I2C_MASTER_SENDING_ADDRESS_FAILED;
+    // The linux driver returns -EPROTO if length differs, so use a descriptive error (there was no read error code)
+    if (ret != count)
+        return DLN2_RES_I2C_MASTER_SENDING_DATA_FAILED;
+
+    return DLN2_RES_SUCCESS;
+}
+
+static bool dln2_i2c_master_finish(struct dln2_slot *slot, uint8_t port, int32_t ret,
+                                   uint8_t count, uint16_t rsp_len)
+{
+    uint16_t res = dln2_i2c_master_result(port, ret, count);
+
+    if (res)
+        return dln2_response_error(slot, res);
 
-        if (_gpio_driver->get(sda))
+    switch (dln2_slot_header(slot)->id)
+    {
+    case DLN2_I2C_MASTER_READ:
+        // The data is already in place behind the length
+        put_unaligned_le16(rsp_len, dln2_slot_response_data(slot));
+        return dln2_response(slot, rsp_len + 2);
+    case DLN2_I2C_MASTER_TRANSFER:
+        memcpy(dln2_slot_response_data(slot), dln2_i2c_ports[port].buf, rsp_len);
+        break;
+    }
+
+    return dln2_response(slot, rsp_len);
+}
+
+// Driver callback, may run in interrupt context
+static void dln2_i2c_master_done(uint8_t port, int32_t result, void *ctx)
+{
+    struct dln2_i2c_master_async *async = ctx;
+
+    (void)port;
+    async->result = result;
+    async->done = true;
+}
+
+// Run the messages in the port's async.msgs, in the background if the driver can
+static bool dln2_i2c_master_start(struct dln2_slot *slot, uint8_t port,
+                                  uint8_t count, uint16_t rsp_len)
+{
+    struct dln2_i2c_master_async *async = &dln2_i2c_ports[port].async;
+    uint32_t timeout_ms = dln2_i2c_master_timeout_ms(port, async->msgs, count);
+    int32_t ret = I2C_MASTER_ERR_NOT_SUPPORTED;
+
+    async->count = count;
+    async->rsp_len = rsp_len;
+    async->done = false;
+
+    if (_i2c_master_driver->submit)
+    {
+        async->slot = slot;
+        ret = _i2c_master_driver->submit(port, async->msgs, count, timeout_ms,
+                                         dln2_i2c_master_done, async);
+        if (!ret)
+            return true;
+        async->slot = NULL;
+    }
+
+    if (ret == I2C_MASTER_ERR_NOT_SUPPORTED)
+        ret = dln2_i2c_master_transfer_msgs(port, async->msgs, count, timeout_ms);
+
+    return dln2_i2c_master_finish(slot, port, ret, count, rsp_len);
+}
+
+/*
+ * Messages are {addr, flags, len} followed by len bytes for a write, the
+ * response is the data of all read messages one after the other.
+ */
+static bool dln2_i2c_master_transfer(struct dln2_slot *slot)
+{
+    struct
+    {
+        uint8_t port;
+        uint8_t count;
+        uint8_t data[];
+    } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+    struct dln2_i2c_master_msg_hdr
+    {
+        uint8_t addr;
+        uint8_t flags;
+        uint16_t len;
+    } TU_ATTR_PACKED;
+    struct i2c_master_msg *msgs;
+    size_t len = dln2_slot_header_data_size(slot);
+    size_t pos = 0, read_len = 0;
+    uint8_t *buf;
+
+    if (len < sizeof(*cmd))
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+    len -= sizeof(*cmd);
+
+    LOG_DEBUG("%s: port=%u count=%u", __func__, cmd->port, cmd->count);
+
+    if (cmd->port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    if (!cmd->count || cmd->count > DLN2_I2C_MAX_MSGS)
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+    msgs = dln2_i2c_ports[cmd->port].async.msgs;
+    buf = dln2_i2c_ports[cmd->port].buf;
+
+    for (uint8_t i = 0; i < cmd->count; i++)
+    {
+        struct dln2_i2c_master_msg_hdr *hdr = (void *)&cmd->data[pos];
+        struct i2c_master_msg *msg = &msgs[i];
+
+        if (len - pos < sizeof(*hdr))
+            return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+        pos += sizeof(*hdr);
+
+        msg->addr = hdr->addr;
+        msg->flags = hdr->flags;
+        msg->len = hdr->len;
+        if (msg->addr > 0x7f || msg->flags & ~I2C_MASTER_MSG_READ)
+            return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+        if (msg->flags & I2C_MASTER_MSG_READ)
+        {
+            msg->buf = &buf[read_len];
+            read_len += msg->len;
+            if (read_len > DLN2_BUF_SIZE - sizeof(struct dln2_response))
+                return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+        }
+        else
         {
-            LOG1("I2C bus recovery successful after %d clock pulses\n", i + 1);
+            if (len - pos < msg->len)
+                return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+            msg->buf = &cmd->data[pos];
+            pos += msg->len;
+        }
+    }
+
+    if (pos != len)
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+
+    return dln2_i2c_master_start(slot, cmd->port, cmd->count, read_len);
+}
+
+// SMBus PEC over the address byte and len bytes of the message
+static uint8_t dln2_i2c_master_msg_pec(uint8_t crc, const struct i2c_master_msg *msg,
+                                       uint16_t len)
+{
+    crc = dln2_i2c_crc8_table[crc ^ (msg->addr << 1 | (msg->flags & I2C_MASTER_MSG_READ))];
+    for (uint16_t i = 0; i < len; i++)
+        crc = dln2_i2c_crc8_table[crc ^ msg->buf[i]];
+
+    return crc;
+}
+
+/*
+ * SMBus transactions with the arguments of Linux i2c_smbus_xfer(). The
+ * command byte comes from the command field, data holds what follows it on
+ * writes. Block writes add the count byte here, an I2C block read takes its
+ * length in one data byte. With DLN2_I2C_SMBUS_PEC the PEC is added to
+ * writes and checked on reads. The response is the read data without the
+ * PEC: the byte, the word little endian, or the block with its count first.
+ */
+static bool dln2_i2c_master_smbus(struct dln2_slot *slot)
+{
+    struct
+    {
+        uint8_t port;
+        uint8_t addr;
+        uint8_t read;
+        uint8_t command;
+        uint8_t protocol;
+        uint8_t flags;
+        uint8_t len;
+        uint8_t data[];
+    } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+    uint8_t wbuf[2 + I2C_MASTER_SMBUS_BLOCK_MAX + 1]; // command, count, data, PEC
+    struct i2c_master_msg msgs[2];
+    size_t len = dln2_slot_header_data_size(slot);
+
+    if (len < sizeof(*cmd) || len != sizeof(*cmd) + cmd->len)
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+
+    LOG_DEBUG("%s: port=%u addr=0x%02x read=%u command=0x%02x protocol=%u flags=0x%x len=%u",
+              __func__, cmd->port, cmd->addr, cmd->read, cmd->command, cmd->protocol, cmd->flags,
+              cmd->len);
+
+    if (cmd->port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    if (cmd->addr > 0x7f || cmd->read > 1 || cmd->flags & ~DLN2_I2C_SMBUS_PEC)
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+    uint8_t n = cmd->len;
+    bool read = cmd->read;
+    bool pec = cmd->flags & DLN2_I2C_SMBUS_PEC;
+    bool has_command = true, block = false, recv_len = false;
+    uint8_t rlen = 0;
+    bool valid;
+
+    switch (cmd->protocol)
+    {
+    case DLN2_I2C_SMBUS_QUICK:
+        has_command = false;
+        pec = false;
+        valid = !n;
+        break;
+    case DLN2_I2C_SMBUS_BYTE:
+        // Receive byte has no write phase, send byte is only the command
+        has_command = !read;
+        rlen = read;
+        valid = !n;
+        break;
+    case DLN2_I2C_SMBUS_BYTE_DATA:
+        rlen = read;
+        valid = n == (read ? 0 : 1);
+        break;
+    case DLN2_I2C_SMBUS_WORD_DATA:
+        rlen = read ? 2 : 0;
+        valid = n == (read ? 0 : 2);
+        break;
+    case DLN2_I2C_SMBUS_PROC_CALL:
+        read = true;
+        rlen = 2;
+        valid = n == 2;
+        break;
+    case DLN2_I2C_SMBUS_BLOCK_DATA:
+        block = !read;
+        recv_len = read;
+        valid = read ? !n : n && n <= I2C_MASTER_SMBUS_BLOCK_MAX;
+        break;
+    case DLN2_I2C_SMBUS_BLOCK_PROC_CALL:
+        read = true;
+        block = true;
+        recv_len = true;
+        valid = n && n <= I2C_MASTER_SMBUS_BLOCK_MAX;
+        break;
+    case DLN2_I2C_SMBUS_I2C_BLOCK_DATA:
+        pec = false;
+        if (read)
+        {
+            valid = n == 1 && cmd->data[0] && cmd->data[0] <= I2C_MASTER_SMBUS_BLOCK_MAX;
+            rlen = cmd->data[0];
+            n = 0;
+        }
+        else
+        {
+            valid = n && n <= I2C_MASTER_SMBUS_BLOCK_MAX;
+        }
+        break;
+    default:
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+    }
+
+    if (!valid)
+        return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+
+    uint8_t count = 0;
+
+    // Everything but a quick read or a receive byte starts with a write
+    if (has_command || !read)
+    {
+        uint8_t wlen = 0;
+
+        if (has_command)
+            wbuf[wlen++] = cmd->command;
+        if (block)
+            wbuf[wlen++] = n;
+        memcpy(&wbuf[wlen], cmd->data, n);
+        wlen += n;
+
+        msgs[count++] = (struct i2c_master_msg){
+            .addr = cmd->addr,
+            .len = wlen,
+            .buf = wbuf,
+        };
+        if (pec && !read)
+            wbuf[msgs[0].len++] = dln2_i2c_master_msg_pec(0, &msgs[0], wlen);
+    }
+
+    if (read)
+    {
+        msgs[count++] = (struct i2c_master_msg){
+            .addr = cmd->addr,
+            .flags = I2C_MASTER_MSG_READ | (recv_len ? I2C_MASTER_MSG_RECV_LEN : 0),
+            .len = (recv_len ? 1 : rlen) + pec,
+            .buf = dln2_i2c_ports[cmd->port].buf,
+        };
+    }
+
+    uint8_t port = cmd->port;
+    int32_t ret = dln2_i2c_master_transfer_msgs(port, msgs, count,
+                                                dln2_i2c_master_timeout_ms(port, msgs, count));
+    uint16_t res = dln2_i2c_master_result(port, ret, count);
+    if (res)
+        return dln2_response_error(slot, res);
+    if (!read)
+        return dln2_response(slot, 0);
+
+    struct i2c_master_msg *rmsg = &msgs[count - 1];
+    uint16_t data_len = rmsg->len - pec;
+
+    if (pec)
+    {
+        uint8_t crc = count > 1 ? dln2_i2c_master_msg_pec(0, &msgs[0], msgs[0].len) : 0;
+
+        crc = dln2_i2c_master_msg_pec(crc, rmsg, data_len);
+        if (crc != rmsg->buf[data_len])
+        {
+            LOG_DEBUG("PEC mismatch: 0x%02x != 0x%02x", rmsg->buf[data_len], crc);
+            // There's no DLN result code for a bad PEC
+            return dln2_response_error(slot, DLN2_RES_FAIL);
+        }
+    }
+
+    memcpy(dln2_slot_response_data(slot), rmsg->buf, data_len);
+
+    return dln2_response(slot, data_len);
+}
+
+static void dln2_i2c_master_poll_tick(void)
+{
+    dln2_i2c_poll_ticks++;
+}
+
+/*
+ * Reading len bytes (1-4) from register reg, reg_len bytes wide. A mask of 0
+ * keeps all bits, a threshold of 0 reports every change. The first reading
+ * is always reported. The response is the job id for POLL_REMOVE and the
+ * events.
+ */
+static bool dln2_i2c_master_poll_add(struct dln2_slot *slot)
+{
+    struct
+    {
+        uint8_t port;
+        uint8_t addr;
+        uint8_t reg_len;
+        uint32_t reg;
+        uint8_t len;
+        uint8_t flags;
+        uint16_t period_ms;
+        uint32_t mask;
+        uint32_t threshold;
+    } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+    struct dln2_i2c_master_poll_job *job = NULL;
+    uint8_t id;
+
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+
+    LOG_DEBUG("%s: port=%u addr=0x%02x reg=0x%lx len=%u period=%ums", __func__,
+              cmd->port, cmd->addr, (unsigned long)cmd->reg, cmd->len, cmd->period_ms);
+
+    if (!_i2c_master_driver->timer_start_us)
+        return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+    if (cmd->port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    if (cmd->addr > 0x7f || cmd->reg_len > sizeof(cmd->reg) || !cmd->len ||
+        cmd->len > sizeof(job->value) || cmd->flags & ~DLN2_I2C_POLL_BIG_ENDIAN)
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+    if (!cmd->period_ms)
+        return dln2_response_error(slot, DLN2_RES_INVALID_EVENT_PERIOD);
+    if (!_i2c_master_driver->is_enabled(cmd->port))
+        return dln2_response_error(slot, DLN2_RES_FAIL);
+
+    for (id = 0; id < DLN2_I2C_POLL_MAX_JOBS; id++)
+    {
+        if (!dln2_i2c_poll_jobs[id].active)
+        {
+            job = &dln2_i2c_poll_jobs[id];
             break;
         }
     }
+    if (!job)
+        return dln2_response_error(slot, DLN2_RES_FAIL);
 
-    if (!_gpio_driver->get(sda))
+    if (!dln2_i2c_poll_count &&
+        !_i2c_master_driver->timer_start_us(DLN2_I2C_POLL_TICK_US, dln2_i2c_master_poll_tick))
+        return dln2_response_error(slot, DLN2_RES_FAIL);
+
+    *job = (struct dln2_i2c_master_poll_job){
+        .active = true,
+        .port = cmd->port,
+        .addr = cmd->addr,
+        .reg_len = cmd->reg_len,
+        .len = cmd->len,
+        .flags = cmd->flags,
+        .period_ms = cmd->period_ms,
+        .reg = cmd->reg,
+        .mask = cmd->mask ? cmd->mask : UINT32_MAX,
+        .threshold = cmd->threshold,
+        .next = dln2_i2c_poll_ticks,
+    };
+    dln2_i2c_poll_count++;
+
+    return dln2_response_u8(slot, id);
+}
+
+static bool dln2_i2c_master_poll_remove_job(struct dln2_slot *slot)
+{
+    uint8_t *id = dln2_slot_header_data(slot);
+
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*id));
+
+    LOG_DEBUG("%s: id=%u", __func__, *id);
+
+    if (*id >= DLN2_I2C_POLL_MAX_JOBS || !dln2_i2c_poll_jobs[*id].active)
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+    dln2_i2c_master_poll_remove(*id);
+
+    return dln2_response(slot, 0);
+}
+
+static bool dln2_i2c_master_poll_read(struct dln2_i2c_master_poll_job *job, uint32_t *value)
+{
+    uint8_t reg[sizeof(job->reg)], buf[sizeof(*value)];
+    struct i2c_master_msg msgs[2];
+    uint8_t count = 0;
+
+    if (job->reg_len)
+    {
+        for (uint8_t i = 0; i < job->reg_len; i++)
+            reg[i] = job->reg >> (8 * (job->reg_len - 1 - i));
+        msgs[count++] = (struct i2c_master_msg){
+            .addr = job->addr,
+            .len = job->reg_len,
+            .buf = reg,
+        };
+    }
+    msgs[count++] = (struct i2c_master_msg){
+        .addr = job->addr,
+        .flags = I2C_MASTER_MSG_READ,
+        .len = job->len,
+        .buf = buf,
+    };
+
+    int32_t ret = dln2_i2c_master_transfer_msgs(job->port, msgs, count,
+                                                dln2_i2c_master_timeout_ms(job->port, msgs, count));
+    if (ret != count)
     {
-        LOG1("I2C bus recovery failed, SDA line is still low\n");
-        _gpio_driver->deinit(scl);
-        _gpio_driver->deinit(sda);
+        dln2_i2c_master_bus_error(job->port, ret);
+        return false;
+    }
+
+    *value = 0;
+    for (uint8_t i = 0; i < job->len; i++)
+    {
+        uint8_t shift = job->flags & DLN2_I2C_POLL_BIG_ENDIAN ? job->len - 1 - i : i;
+        *value |= (uint32_t)buf[i] << (8 * shift);
+    }
+
+    return true;
+}
+
+static bool dln2_i2c_master_poll_event(uint8_t id, struct dln2_i2c_master_poll_job *job)
+{
+    struct
+    {
+        uint8_t id;
+        uint8_t port;
+        uint8_t addr;
+        uint32_t reg;
+        uint32_t value;
+    } TU_ATTR_PACKED *event;
+
+    struct dln2_slot *slot = dln2_get_slot();
+    if (!slot)
+        return false;
+
+    struct dln2_header *hdr = dln2_slot_header(slot);
+    hdr->size = sizeof(*hdr) + sizeof(*event);
+    hdr->id = DLN2_I2C_MASTER_POLL_CHANGED_EV;
+    hdr->echo = 0;
+    hdr->handle = DLN2_HANDLE_EVENT;
+
+    event = dln2_slot_header_data(slot);
+    event->id = id;
+    event->port = job->port;
+    event->addr = job->addr;
+    event->reg = job->reg;
+    event->value = job->value;
+
+    dln2_queue_slot_in(slot);
+    return true;
+}
+
+// The reported value is only updated once the event is queued, so it is retried
+static void dln2_i2c_master_poll_task(void)
+{
+    uint32_t now = dln2_i2c_poll_ticks;
+
+    for (uint8_t id = 0; id < DLN2_I2C_POLL_MAX_JOBS; id++)
+    {
+        struct dln2_i2c_master_poll_job *job = &dln2_i2c_poll_jobs[id];
+        uint32_t value;
+
+        // Polling shares the bus, it waits for background transfers
+        if (!job->active || dln2_i2c_ports[job->port].async.slot)
+            continue;
+
+        if ((int32_t)(now - job->next) >= 0)
+        {
+            job->next += job->period_ms * (1000 / DLN2_I2C_POLL_TICK_US);
+            // Skip the reads that were missed
+            if ((int32_t)(now - job->next) >= 0)
+                job->next = now + job->period_ms * (1000 / DLN2_I2C_POLL_TICK_US);
+
+            if (dln2_i2c_master_poll_read(job, &value))
+            {
+                uint32_t diff;
+
+                value &= job->mask;
+                diff = value > job->reported ? value - job->reported : job->reported - value;
+                job->value = value;
+                job->report = !job->valid || diff > job->threshold;
+            }
+        }
+
+        if (job->report && dln2_i2c_master_poll_event(id, job))
+        {
+            job->reported = job->value;
+            job->valid = true;
+            job->report = false;
+        }
+    }
+}
+
+// Address only probe, falls back to a zero length write, returns 0 on ACK
+static int32_t dln2_i2c_master_probe(uint8_t port, uint8_t addr, uint32_t timeout_ms)
+{
+    int32_t ret = I2C_MASTER_ERR_NOT_SUPPORTED;
+
+    if (_i2c_master_driver->probe)
+        ret = _i2c_master_driver->probe(port, addr, timeout_ms);
+    if (ret != I2C_MASTER_ERR_NOT_SUPPORTED)
+        return ret;
+
+    struct i2c_master_msg msg = {.addr = addr};
+
+    ret = dln2_i2c_master_transfer_msgs(port, &msg, 1, timeout_ms);
+
+    return ret == 1 ? 0 : ret < 0 ? ret : -1;
+}
+
+/*
+ * The DLN command only has the port, an optional first and last address
+ * restrict the scan to a range.
+ */
+static bool dln2_i2c_master_scan_devices(struct dln2_slot *slot)
+{
+    struct
+    {
+        uint8_t port;
+        uint8_t first;
+        uint8_t last;
+    } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+    struct
+    {
+        uint8_t count;
+        uint8_t list[128];
+    } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+    size_t len = dln2_slot_header_data_size(slot);
+    uint8_t first = DLN2_I2C_SCAN_FIRST;
+    uint8_t last = DLN2_I2C_SCAN_LAST;
+
+    if (len != sizeof(cmd->port) && len != sizeof(*cmd))
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+
+    uint8_t port = cmd->port;
+    if (len == sizeof(*cmd))
+    {
+        first = cmd->first;
+        last = cmd->last;
+    }
+
+    LOG_DEBUG("%s: port=%u first=0x%02x last=0x%02x", __func__, port, first, last);
+
+    if (port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    if (first > last || last > 0x7f)
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+    if (!_i2c_master_driver->is_enabled(port))
         return dln2_response_error(slot, DLN2_RES_FAIL);
+
+    // The response overlaps the command, which has been consumed by now
+    memset(rsp, 0, sizeof(*rsp));
+    for (uint16_t addr = first; addr <= last; addr++)
+    {
+        int32_t ret = dln2_i2c_master_probe(port, addr, DLN2_I2C_SCAN_TIMEOUT_MS);
+
+        if (!ret)
+            rsp->list[rsp->count++] = addr;
+        else if (dln2_i2c_master_bus_error(port, ret))
+            return dln2_response_error(slot, DLN2_RES_FAIL);
+    }
+
+    LOG_DEBUG("found %u devices", rsp->count);
+
+    return dln2_response(slot, sizeof(*rsp));
+}
+
+// The device ignores its address until the write cycle has ended
+static bool dln2_i2c_master_mem_ack_poll(uint8_t port, uint8_t addr, uint16_t cycle_ms)
+{
+    uint32_t elapsed_us = 0;
+
+    while (dln2_i2c_master_probe(port, addr, DLN2_I2C_SCAN_TIMEOUT_MS))
+    {
+        if (elapsed_us >= cycle_ms * 1000)
+            return false;
+
+        if (dln2_gpio_drv_has_delay())
+        {
+            dln2_gpio_drv_delay_us(DLN2_I2C_MEM_POLL_US);
+            elapsed_us += DLN2_I2C_MEM_POLL_US;
+        }
+        else
+        {
+            dln2_delay(1);
+            elapsed_us += 1000;
+        }
     }
 
+    return true;
+}
+
+static bool dln2_i2c_master_mem_write_page(struct dln2_i2c_master_mem_write *mw)
+{
+    uint8_t *buf = &mw->buf[sizeof(uint32_t) - mw->mem_addr_len];
+    struct i2c_master_msg msg = {
+        .addr = mw->addr,
+        .len = mw->mem_addr_len + mw->fill,
+        .buf = buf,
+    };
+    int32_t ret;
+    bool ok;
+
+    for (uint8_t i = 0; i < mw->mem_addr_len; i++)
+        buf[i] = mw->mem_addr >> (8 * (mw->mem_addr_len - 1 - i));
+
+    ret = dln2_i2c_master_transfer_msgs(mw->port, &msg, 1,
+                                        dln2_i2c_master_timeout_ms(mw->port, &msg, 1));
+    ok = ret == 1 && dln2_i2c_master_mem_ack_poll(mw->port, mw->addr, mw->cycle_ms);
+    if (ok)
+        mw->written += mw->fill;
+    else
+        dln2_i2c_master_bus_error(mw->port, ret);
+
+    mw->mem_addr += mw->fill;
+    mw->fill = 0;
+
+    return ok;
+}
+
+/*
+ * Start writing length bytes at mem_addr. A page_size of 0 means the device
+ * has no pages, the writes are then split at DLN2_I2C_MEM_PAGE_MAX.
+ * A new BEGIN drops the rest of an unfinished write.
+ */
+static bool dln2_i2c_master_mem_write_begin(struct dln2_slot *slot)
+{
+    struct
+    {
+        uint8_t port;
+        uint8_t addr;
+        uint8_t mem_addr_len;
+        uint16_t page_size;
+        uint32_t mem_addr;
+        uint32_t length;
+        uint16_t cycle_ms;
+    } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+    struct dln2_i2c_master_mem_write *mw;
+
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+
+    LOG_DEBUG("%s: port=%u addr=0x%02x mem_addr=0x%lx length=%lu page_size=%u", __func__,
+              cmd->port, cmd->addr, (unsigned long)cmd->mem_addr, (unsigned long)cmd->length,
+              cmd->page_size);
+
+    if (cmd->port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+    mw = &dln2_i2c_ports[cmd->port].mem_write;
+    mw->active = false;
+
+    if (cmd->addr > 0x7f || !cmd->mem_addr_len || cmd->mem_addr_len > sizeof(uint32_t) ||
+        cmd->page_size > DLN2_I2C_MEM_PAGE_MAX || !cmd->length)
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+    if (!_i2c_master_driver->is_enabled(cmd->port))
+        return dln2_response_error(slot, DLN2_RES_FAIL);
+
+    mw->port = cmd->port;
+    mw->addr = cmd->addr;
+    mw->mem_addr_len = cmd->mem_addr_len;
+    mw->page_size = cmd->page_size ? cmd->page_size : DLN2_I2C_MEM_PAGE_MAX;
+    mw->cycle_ms = cmd->cycle_ms ? cmd->cycle_ms : DLN2_I2C_MEM_CYCLE_MS;
+    mw->mem_addr = cmd->mem_addr;
+    mw->remaining = cmd->length;
+    mw->written = 0;
+    mw->fill = 0;
+    mw->active = true;
+
     return dln2_response(slot, 0);
 }
 
+/*
+ * The response has the bytes written so far and the memory addresses of the
+ * pages this command's data failed on. The last page is written when the
+ * data reaches the length given to BEGIN.
+ */
+static bool dln2_i2c_master_mem_write_data(struct dln2_slot *slot)
+{
+    struct
+    {
+        uint8_t port;
+        uint8_t data[];
+    } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+    struct
+    {
+        uint32_t written;
+        uint8_t failed;
+        uint32_t failed_addr[DLN2_I2C_MEM_MAX_FAILED];
+    } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+    struct dln2_i2c_master_mem_write *mw;
+    uint32_t failed_addr[DLN2_I2C_MEM_MAX_FAILED];
+    size_t len = dln2_slot_header_data_size(slot);
+    uint8_t failed = 0;
+
+    if (len < sizeof(*cmd))
+        return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+    len -= sizeof(*cmd);
+
+    LOG_DEBUG("%s: port=%u len=%zu", __func__, cmd->port, len);
+
+    if (cmd->port >= _i2c_master_driver->master_count)
+        return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+    mw = &dln2_i2c_ports[cmd->port].mem_write;
+    if (!mw->active)
+        return dln2_response_error(slot, DLN2_RES_FAIL);
+    if (len > mw->remaining)
+        return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+
+    // The response overlaps the data, failures are collected on the side
+    for (size_t pos = 0; pos < len;)
+    {
+        uint32_t page_left = mw->page_size - (mw->mem_addr + mw->fill) % mw->page_size;
+        size_t n = len - pos < page_left ? len - pos : page_left;
+        uint32_t page_addr = mw->mem_addr;
+
+        memcpy(&mw->buf[sizeof(uint32_t) + mw->fill], &cmd->data[pos], n);
+        mw->fill += n;
+        mw->remaining -= n;
+        pos += n;
+
+        if (n < page_left && mw->remaining)
+            break;
+
+        if (!dln2_i2c_master_mem_write_page(mw))
+        {
+            if (failed < DLN2_I2C_MEM_MAX_FAILED)
+                failed_addr[failed] = page_addr;
+            if (failed < UINT8_MAX)
+                failed++;
+        }
+    }
+
+    if (!mw->remaining)
+        mw->active = false;
+
+    uint8_t listed = failed < DLN2_I2C_MEM_MAX_FAILED ? failed : DLN2_I2C_MEM_MAX_FAILED;
+
+    rsp->written = mw->written;
+    rsp->failed = failed;
+    memcpy(rsp->failed_addr, failed_addr, listed * sizeof(uint32_t));
+
+    return dln2_response(slot, sizeof(*rsp) - sizeof(rsp->failed_addr) + listed * sizeof(uint32_t));
+}
+
 struct dln2_i2c_master_read_msg_tx
 {
     uint8_t port;
@@ -157,7 +1365,10 @@ static bool dln2_i2c_master_read(struct dln2_slot *slot)
         uint16_t bufferLength;
         uint8_t buffer[256];
     } TU_ATTR_PACKED *rx = (struct dln2_i2c_master_read_msg_rsp *)dln2_slot_response_data(slot);
-    size_t len = msg->buf_len;
+    struct i2c_master_msg *msgs;
+    uint8_t *mem_addr;
+    uint16_t len = msg->buf_len;
+    uint8_t count = 0;
 
     LOG1("    %s: port=%u addr=0x%02x buf_len=%u\n", __func__, msg->port, msg->addr, msg->buf_len);
 
@@ -165,19 +1376,33 @@ static bool dln2_i2c_master_read(struct dln2_slot *slot)
         return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
     if (msg->port >= _i2c_master_driver->master_count)
         return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    if (msg->mem_addr_len > sizeof(msg->mem_addr))
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+    if (len > DLN2_BUF_SIZE - sizeof(struct dln2_response) - sizeof(rx->bufferLength))
+        return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
 
-    int ret = _i2c_master_driver->read(msg->port, msg->addr, msg->mem_addr_len, msg->mem_addr, len, rx->buffer, DLN2_I2C_TIMEOUT_US / 1000);
-    put_unaligned_le16(len, rx);
-    LOG2("        i2c_master_driver->read: ret =%d\n", ret);
+    msgs = dln2_i2c_ports[msg->port].async.msgs;
+    mem_addr = dln2_i2c_ports[msg->port].async.mem_addr;
 
-    if (ret < 0)
-        return dln2_response_error(slot, DLN2_RES_I2C_MASTER_SENDING_ADDRESS_FAILED);
-    // The linux driver returns -EPROTO if length differs, so use a descriptive error (there was no read error code)
-    if (ret != len)
-        return dln2_response_error(slot, DLN2_RES_I2C_MASTER_SENDING_DATA_FAILED);
+    // The read data overwrites the command, the register address goes first
+    if (msg->mem_addr_len)
+    {
+        for (uint8_t i = 0; i < msg->mem_addr_len; i++)
+            mem_addr[i] = msg->mem_addr >> (8 * (msg->mem_addr_len - 1 - i));
+        msgs[count++] = (struct i2c_master_msg){
+            .addr = msg->addr,
+            .len = msg->mem_addr_len,
+            .buf = mem_addr,
+        };
+    }
+    msgs[count++] = (struct i2c_master_msg){
+        .addr = msg->addr,
+        .flags = I2C_MASTER_MSG_READ,
+        .len = len,
+        .buf = rx->buffer,
+    };
 
-    put_unaligned_le16(len, rx);
-    return dln2_response(slot, len + 2);
+    return dln2_i2c_master_start(slot, msg->port, count, len);
 }
 
 struct dln2_i2c_master_write_msg
@@ -217,20 +1442,32 @@ static bool dln2_i2c_master_write(struct dln2_slot *slot)
         return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
     if (msg->port >= _i2c_master_driver->master_count)
         return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    if (msg->mem_addr_len > sizeof(msg->mem_addr))
+        return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+    // The driver reads the data straight from the slot
+    if (msg->buf_len > dln2_slot_header_data_size(slot) - sizeof(*msg))
+        return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
 
-    int ret = _i2c_master_driver->write(msg->port, msg->addr, msg->mem_addr_len, msg->mem_addr, msg->buf_len, msg->buf, DLN2_I2C_TIMEOUT_US / 1000);
+    uint8_t port = msg->port;
+    uint8_t mem_addr_len = msg->mem_addr_len;
+    uint32_t mem_addr = msg->mem_addr;
+    uint16_t len = msg->buf_len;
 
-    if (ret < 0)
-    {
-        return dln2_response_error(slot, DLN2_RES_I2C_MASTER_SENDING_ADDRESS_FAILED);
-    }
-    if (ret != msg->buf_len)
-        return dln2_response_error(slot, DLN2_RES_I2C_MASTER_SENDING_DATA_FAILED);
+    // One message, the register address goes in front of the data it overwrites
+    uint8_t *buf = msg->buf - mem_addr_len;
+    for (uint8_t i = 0; i < mem_addr_len; i++)
+        buf[i] = mem_addr >> (8 * (mem_addr_len - 1 - i));
+
+    dln2_i2c_ports[port].async.msgs[0] = (struct i2c_master_msg){
+        .addr = msg->addr,
+        .len = mem_addr_len + len,
+        .buf = buf,
+    };
 
-    return dln2_response(slot, msg->buf_len);
+    return dln2_i2c_master_start(slot, port, 1, len);
 }
 
-bool dln2_handle_i2c(struct dln2_slot *slot)
+static bool dln2_i2c_master_dispatch(struct dln2_slot *slot)
 {
     struct dln2_header *hdr = dln2_slot_header(slot);
 
@@ -254,10 +1491,10 @@ bool dln2_handle_i2c(struct dln2_slot *slot)
         break;
     case DLN_I2C_MASTER_SET_FREQUENCY:
         LOG2("Received I2C_MASTER_SET_FREQUENCY command\n");
-        break;
+        return dln2_i2c_master_set_frequency(slot);
     case DLN_I2C_MASTER_GET_FREQUENCY:
         LOG2("Received I2C_MASTER_GET_FREQUENCY command\n");
-        break;
+        return dln2_i2c_master_get_frequency(slot);
     case DLN2_I2C_MASTER_WRITE:
         LOG2("Received I2C_MASTER_WRITE command\n");
         return dln2_i2c_master_write(slot);
@@ -268,7 +1505,7 @@ bool dln2_handle_i2c(struct dln2_slot *slot)
         break;
     case DLN_I2C_MASTER_SCAN_DEVICES:
         LOG2("Received I2C_MASTER_SCAN_DEVICES command\n");
-        break;
+        return dln2_i2c_master_scan_devices(slot);
     case DLN_I2C_MASTER_PULLUP_ENABLE:
         LOG2("Received I2C_MASTER_PULLUP_ENABLE command\n");
         break;
@@ -278,6 +1515,30 @@ bool dln2_handle_i2c(struct dln2_slot *slot)
     case DLN_I2C_MASTER_PULLUP_IS_ENABLED:
         LOG2("Received I2C_MASTER_PULLUP_IS_ENABLED command\n");
         break;
+    case DLN2_I2C_MASTER_TRANSFER:
+        LOG_DEBUG("Received I2C_MASTER_TRANSFER command");
+        return dln2_i2c_master_transfer(slot);
+    case DLN2_I2C_MASTER_RECOVER:
+        LOG_DEBUG("Received I2C_MASTER_RECOVER command");
+        return dln2_i2c_master_initiate_recovery(slot);
+    case DLN2_I2C_MASTER_GET_RECOVERY_STATS:
+        LOG_DEBUG("Received I2C_MASTER_GET_RECOVERY_STATS command");
+        return dln2_i2c_master_get_recovery_stats(slot);
+    case DLN2_I2C_MASTER_MEM_WRITE_BEGIN:
+        LOG_DEBUG("Received I2C_MASTER_MEM_WRITE_BEGIN command");
+        return dln2_i2c_master_mem_write_begin(slot);
+    case DLN2_I2C_MASTER_MEM_WRITE_DATA:
+        LOG_DEBUG("Received I2C_MASTER_MEM_WRITE_DATA command");
+        return dln2_i2c_master_mem_write_data(slot);
+    case DLN2_I2C_MASTER_SMBUS:
+        LOG_DEBUG("Received I2C_MASTER_SMBUS command");
+        return dln2_i2c_master_smbus(slot);
+    case DLN2_I2C_MASTER_POLL_ADD:
+        LOG_DEBUG("Received I2C_MASTER_POLL_ADD command");
+        return dln2_i2c_master_poll_add(slot);
+    case DLN2_I2C_MASTER_POLL_REMOVE:
+        LOG_DEBUG("Received I2C_MASTER_POLL_REMOVE command");
+        return dln2_i2c_master_poll_remove_job(slot);
     default:
         LOG1("I2C: unknown command 0x%02x\n", hdr->id);
         return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
@@ -286,8 +1547,76 @@ bool dln2_handle_i2c(struct dln2_slot *slot)
     return false;
 }
 
+// The port a command is for, or -1 if it doesn't use a bus or has no valid port
+static int dln2_i2c_master_slot_port(struct dln2_slot *slot)
+{
+    uint8_t *port = dln2_slot_header_data(slot);
+
+    switch (dln2_slot_header(slot)->id)
+    {
+    case DLN2_I2C_MASTER_GET_PORT_COUNT:
+    case DLN2_I2C_MASTER_POLL_REMOVE:
+        return -1;
+    }
+
+    if (!dln2_slot_header_data_size(slot) || *port >= _i2c_master_driver->master_count)
+        return -1;
+
+    return *port;
+}
+
+bool dln2_handle_i2c(struct dln2_slot *slot)
+{
+    int port = dln2_i2c_master_slot_port(slot);
+
+    if (port >= 0)
+    {
+        struct dln2_i2c_master_port *p = &dln2_i2c_ports[port];
+
+        if (p->async.slot || p->deferred.head)
+        {
+            LOG_DEBUG("I2C: transfer in progress on port %d, command deferred", port);
+            dln2_slot_enqueue(&p->deferred, slot);
+            return true;
+        }
+    }
+
+    return dln2_i2c_master_dispatch(slot);
+}
+
+void dln2_i2c_master_task(void)
+{
+    if (!_i2c_master_driver)
+        return;
+
+    for (uint8_t port = 0; port < _i2c_master_driver->master_count; port++)
+    {
+        struct dln2_i2c_master_port *p = &dln2_i2c_ports[port];
+        struct dln2_i2c_master_async *async = &p->async;
+        struct dln2_slot *slot = async->slot;
+
+        if (slot)
+        {
+            if (!async->done)
+                continue;
+            async->slot = NULL;
+            dln2_i2c_master_finish(slot, port, async->result, async->count,
+                                   async->rsp_len);
+        }
+
+        while (!async->slot && (slot = dln2_slot_dequeue(&p->deferred)))
+            dln2_i2c_master_dispatch(slot);
+    }
+
+    if (dln2_i2c_poll_count)
+        dln2_i2c_master_poll_task();
+}
+
 void dln2_i2c_master_init(struct dln2_peripherials *peripherals)
 {
-    _i2c_master_driver = (peripherals->i2c_master);
-    _gpio_driver = peripherals->gpio;
+    _i2c_master_driver = dln2_i2c_bitbang_attach(peripherals->i2c_master,
+                                                 peripherals->i2c_bitbang,
+                                                 peripherals->i2c_bitbang_count);
+    if (_i2c_master_driver && _i2c_master_driver->master_count > DLN2_I2C_MAX_PORTS)
+        _i2c_master_driver->master_count = DLN2_I2C_MAX_PORTS;
 }
@@ -0,0 +1,461 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * 1-Wire master, not part of the DLN protocol
+ *
+ * Bit-banged at standard speed on any GPIO with an external pull-up. The pin
+ * is emulated open drain: the output latch stays low and the bus is pulled
+ * down by switching the pin to output.
+ *
+ * Each command runs a whole transaction so the host never has to do the
+ * timing. DLN2_ONEWIRE_CONVERT starts a conversion on all devices, waits for
+ * it and reads back the scratchpad of each listed device, it blocks the
+ * command handling for up to timeout_ms.
+ */
+
+#include "dln2-gpio.h"
+#include "dln2.h"
+#include "dln2_log.h"
+
+#define DLN2_ONEWIRE_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_ONEWIRE)
+
+#define DLN2_ONEWIRE_GET_PORT_COUNT DLN2_ONEWIRE_CMD(0x00)
+#define DLN2_ONEWIRE_ENABLE DLN2_ONEWIRE_CMD(0x01)
+#define DLN2_ONEWIRE_DISABLE DLN2_ONEWIRE_CMD(0x02)
+#define DLN2_ONEWIRE_RESET DLN2_ONEWIRE_CMD(0x10)
+#define DLN2_ONEWIRE_TRANSFER DLN2_ONEWIRE_CMD(0x11)
+#define DLN2_ONEWIRE_SEARCH DLN2_ONEWIRE_CMD(0x12)
+#define DLN2_ONEWIRE_CONVERT DLN2_ONEWIRE_CMD(0x13)
+
+// DLN2_ONEWIRE_TRANSFER flags
+#define DLN2_ONEWIRE_FLAG_RESET 0x01
+#define DLN2_ONEWIRE_FLAG_MATCH_ROM 0x02
+#define DLN2_ONEWIRE_FLAG_SKIP_ROM 0x04
+#define DLN2_ONEWIRE_FLAG_CHECK_CRC 0x08
+
+// DLN2_ONEWIRE_CONVERT per device status
+#define DLN2_ONEWIRE_STATUS_OK 0
+#define DLN2_ONEWIRE_STATUS_NO_PRESENCE 1
+#define DLN2_ONEWIRE_STATUS_CRC_ERROR 2
+
+#define ONEWIRE_SEARCH_ROM 0xf0
+#define ONEWIRE_ALARM_SEARCH 0xec
+#define ONEWIRE_MATCH_ROM 0x55
+#define ONEWIRE_SKIP_ROM 0xcc
+
+#define DLN2_ONEWIRE_MAX_PORTS 4
+#define DLN2_ONEWIRE_MAX_SEARCH 30
+#define DLN2_ONEWIRE_MAX_CONVERT 16
+#define DLN2_ONEWIRE_MAX_READ 16
+
+static bool dln2_onewire_enabled[DLN2_ONEWIRE_MAX_PORTS];
+static uint16_t dln2_onewire_pins[DLN2_ONEWIRE_MAX_PORTS];
+
+static inline void dln2_onewire_low(uint16_t pin) {
+  dln2_gpio_drv_set_dir(pin, true);
+}
+
+static inline void dln2_onewire_release(uint16_t pin) {
+  dln2_gpio_drv_set_dir(pin, false);
+}
+
+// Returns true if a device answered with a presence pulse
+static bool dln2_onewire_reset(uint16_t pin) {
+  dln2_onewire_low(pin);
+  dln2_gpio_drv_delay_us(480);
+
+  uint32_t irq = dln2_gpio_drv_critical_enter();
+  dln2_onewire_release(pin);
+  dln2_gpio_drv_delay_us(70);
+  bool presence = !dln2_gpio_drv_get(pin);
+  dln2_gpio_drv_critical_exit(irq);
+
+  dln2_gpio_drv_delay_us(410);
+
+  return presence;
+}
+
+static void dln2_onewire_write_bit(uint16_t pin, bool bit) {
+  uint32_t irq = dln2_gpio_drv_critical_enter();
+  dln2_onewire_low(pin);
+  dln2_gpio_drv_delay_us(bit ? 6 : 60);
+  dln2_onewire_release(pin);
+  dln2_gpio_drv_critical_exit(irq);
+
+  dln2_gpio_drv_delay_us(bit ? 64 : 10);
+}
+
+static bool dln2_onewire_read_bit(uint16_t pin) {
+  uint32_t irq = dln2_gpio_drv_critical_enter();
+  dln2_onewire_low(pin);
+  dln2_gpio_drv_delay_us(6);
+  dln2_onewire_release(pin);
+  dln2_gpio_drv_delay_us(9);
+  bool bit = dln2_gpio_drv_get(pin);
+  dln2_gpio_drv_critical_exit(irq);
+
+  dln2_gpio_drv_delay_us(55);
+
+  return bit;
+}
+
+static void dln2_onewire_write_byte(uint16_t pin, uint8_t val) {
+  for (unsigned int i = 0; i < 8; i++)
+    dln2_onewire_write_bit(pin, val & (1U << i));
+}
+
+static uint8_t dln2_onewire_read_byte(uint16_t pin) {
+  uint8_t val = 0;
+
+  for (unsigned int i = 0; i < 8; i++)
+    if (dln2_onewire_read_bit(pin))
+      val |= 1U << i;
+
+  return val;
+}
+
+static void dln2_onewire_write_rom(uint16_t pin, uint64_t rom) {
+  dln2_onewire_write_byte(pin, ONEWIRE_MATCH_ROM);
+  for (unsigned int i = 0; i < 8; i++)
+    dln2_onewire_write_byte(pin, rom >> (8 * i));
+}
+
+// Dallas/Maxim CRC8, the CRC of data followed by its CRC byte is 0
+static uint8_t dln2_onewire_crc8(const uint8_t *data, size_t len) {
+  uint8_t crc = 0;
+
+  while (len--) {
+    crc ^= *data++;
+    for (unsigned int i = 0; i < 8; i++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x8c : crc >> 1;
+  }
+
+  return crc;
+}
+
+/*
+ * Walk the ROM tree, taking the 1 branch at the deepest discrepancy left
+ * from the previous pass. Returns the number of ROMs found or -1 on a bad
+ * CRC, *more is set if there are devices that didn't fit in roms.
+ */
+static int dln2_onewire_search(uint16_t pin, uint8_t cmd, uint64_t *roms,
+                               int max, bool *more) {
+  uint64_t rom = 0;
+  int last_discrepancy = 0;
+  int count = 0;
+
+  *more = false;
+
+  do {
+    if (count == max) {
+      *more = true;
+      break;
+    }
+
+    if (!dln2_onewire_reset(pin))
+      break;
+    dln2_onewire_write_byte(pin, cmd);
+
+    int last_zero = 0;
+    for (int bit = 1; bit <= 64; bit++) {
+      bool id = dln2_onewire_read_bit(pin);
+      bool cmp = dln2_onewire_read_bit(pin);
+      bool dir;
+
+      // Nobody answered, the devices went away during the search
+      if (id && cmp)
+        return count;
+
+      if (id != cmp)
+        dir = id;
+      else if (bit < last_discrepancy)
+        dir = (rom >> (bit - 1)) & 1;
+      else
+        dir = bit == last_discrepancy;
+
+      if (id == cmp && !dir)
+        last_zero = bit;
+
+      if (dir)
+        rom |= 1ULL << (bit - 1);
+      else
+        rom &= ~(1ULL << (bit - 1));
+      dln2_onewire_write_bit(pin, dir);
+    }
+
+    uint8_t bytes[8];
+    for (unsigned int i = 0; i < 8; i++)
+      bytes[i] = rom >> (8 * i);
+    if (dln2_onewire_crc8(bytes, sizeof(bytes)))
+      return -1;
+
+    roms[count++] = rom;
+    last_discrepancy = last_zero;
+  } while (last_discrepancy);
+
+  return count;
+}
+
+static bool dln2_onewire_port_valid(uint8_t port) {
+  return port < DLN2_ONEWIRE_MAX_PORTS && dln2_onewire_enabled[port];
+}
+
+static bool dln2_onewire_enable(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint16_t pin;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_ONEWIRE_ENABLE: port=%u pin=%u\n", cmd->port, cmd->pin);
+
+  if (!dln2_gpio_drv_has_delay())
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  if (cmd->port >= DLN2_ONEWIRE_MAX_PORTS)
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if (dln2_onewire_enabled[cmd->port])
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  if (cmd->pin >= dln2_gpio_drv_count())
+    return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
+
+  uint16_t res = dln2_pin_request(cmd->pin, DLN2_MODULE_ONEWIRE);
+  if (res)
+    return dln2_response_error(slot, res);
+
+  dln2_gpio_drv_init(cmd->pin);
+  dln2_gpio_drv_put(cmd->pin, false);
+  dln2_onewire_release(cmd->pin);
+
+  dln2_onewire_pins[cmd->port] = cmd->pin;
+  dln2_onewire_enabled[cmd->port] = true;
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_onewire_disable(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+  LOG_INFO("DLN2_ONEWIRE_DISABLE: port=%u\n", *port);
+
+  if (!dln2_onewire_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  uint16_t pin = dln2_onewire_pins[*port];
+  dln2_onewire_release(pin);
+  dln2_gpio_drv_deinit(pin);
+  dln2_pin_free(pin, DLN2_MODULE_ONEWIRE);
+  dln2_onewire_enabled[*port] = false;
+
+  return dln2_response(slot, 0);
+}
+
+// Any 8-bit read length fits in the response
+_Static_assert(UINT8_MAX <= DLN2_BUF_SIZE - sizeof(struct dln2_response),
+               "1-Wire read_len does not fit in a slot");
+
+static bool dln2_onewire_transfer(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t flags;
+    uint64_t rom;
+    uint8_t write_len;
+    uint8_t read_len;
+    uint8_t data[];
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  uint8_t *rsp = dln2_slot_response_data(slot);
+  size_t len = dln2_slot_header_data_size(slot);
+
+  if (len < sizeof(*cmd) || len != sizeof(*cmd) + cmd->write_len)
+    return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+
+  LOG_INFO("DLN2_ONEWIRE_TRANSFER: port=%u flags=0x%02x write=%u read=%u\n",
+           cmd->port, cmd->flags, cmd->write_len, cmd->read_len);
+
+  if (!dln2_onewire_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if ((cmd->flags & DLN2_ONEWIRE_FLAG_CHECK_CRC) && cmd->read_len < 2)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+  uint16_t pin = dln2_onewire_pins[cmd->port];
+  uint8_t flags = cmd->flags;
+  uint8_t read_len = cmd->read_len;
+
+  if (flags & DLN2_ONEWIRE_FLAG_RESET && !dln2_onewire_reset(pin)) {
+    LOG_INFO("    no presence pulse\n");
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  }
+
+  if (flags & DLN2_ONEWIRE_FLAG_MATCH_ROM)
+    dln2_onewire_write_rom(pin, cmd->rom);
+  else if (flags & DLN2_ONEWIRE_FLAG_SKIP_ROM)
+    dln2_onewire_write_byte(pin, ONEWIRE_SKIP_ROM);
+
+  for (unsigned int i = 0; i < cmd->write_len; i++)
+    dln2_onewire_write_byte(pin, cmd->data[i]);
+
+  // The response overlaps the command, which has been consumed by now
+  for (unsigned int i = 0; i < read_len; i++)
+    rsp[i] = dln2_onewire_read_byte(pin);
+
+  if (flags & DLN2_ONEWIRE_FLAG_CHECK_CRC && dln2_onewire_crc8(rsp, read_len)) {
+    LOG_INFO("    CRC error\n");
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  }
+
+  return dln2_response(slot, read_len);
+}
+
+static bool dln2_onewire_search_cmd(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t alarm_only;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  struct {
+    uint8_t count;
+    uint8_t more;
+    uint64_t roms[];
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+  uint64_t roms[DLN2_ONEWIRE_MAX_SEARCH];
+  bool more;
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_ONEWIRE_SEARCH: port=%u alarm_only=%u\n", cmd->port,
+           cmd->alarm_only);
+
+  if (!dln2_onewire_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  int count = dln2_onewire_search(
+      dln2_onewire_pins[cmd->port],
+      cmd->alarm_only ? ONEWIRE_ALARM_SEARCH : ONEWIRE_SEARCH_ROM, roms,
+      DLN2_ONEWIRE_MAX_SEARCH, &more);
+  if (count < 0) {
+    LOG_INFO("    CRC error\n");
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  }
+
+  rsp->count = count;
+  rsp->more = more;
+  for (int i = 0; i < count; i++)
+    rsp->roms[i] = roms[i];
+
+  return dln2_response(slot, sizeof(*rsp) + count * sizeof(rsp->roms[0]));
+}
+
+static bool dln2_onewire_convert(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t convert_cmd;
+    uint8_t read_cmd;
+    uint8_t read_len;
+    uint16_t timeout_ms;
+    uint8_t count;
+    uint64_t roms[];
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  uint8_t *rsp = dln2_slot_response_data(slot);
+  size_t len = dln2_slot_header_data_size(slot);
+  uint64_t roms[DLN2_ONEWIRE_MAX_CONVERT];
+
+  if (len < sizeof(*cmd) ||
+      len != sizeof(*cmd) + cmd->count * sizeof(cmd->roms[0]))
+    return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+
+  LOG_INFO("DLN2_ONEWIRE_CONVERT: port=%u convert=0x%02x read=0x%02x/%u "
+           "timeout=%ums count=%u\n",
+           cmd->port, cmd->convert_cmd, cmd->read_cmd, cmd->read_len,
+           cmd->timeout_ms, cmd->count);
+
+  if (!dln2_onewire_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if (cmd->count > DLN2_ONEWIRE_MAX_CONVERT || cmd->read_len < 2 ||
+      cmd->read_len > DLN2_ONEWIRE_MAX_READ ||
+      (size_t)cmd->count * (1 + cmd->read_len) >
+          DLN2_BUF_SIZE - sizeof(struct dln2_response))
+    return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+
+  uint16_t pin = dln2_onewire_pins[cmd->port];
+  uint8_t read_cmd = cmd->read_cmd;
+  uint8_t read_len = cmd->read_len;
+  uint8_t count = cmd->count;
+  for (unsigned int i = 0; i < count; i++)
+    roms[i] = cmd->roms[i];
+
+  if (!dln2_onewire_reset(pin)) {
+    LOG_INFO("    no presence pulse\n");
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  }
+  dln2_onewire_write_byte(pin, ONEWIRE_SKIP_ROM);
+  dln2_onewire_write_byte(pin, cmd->convert_cmd);
+
+  // Externally powered devices hold the bus low while converting
+  uint16_t waited = 0;
+  while (!dln2_onewire_read_bit(pin)) {
+    if (waited++ >= cmd->timeout_ms) {
+      LOG_INFO("    conversion timed out\n");
+      return dln2_response_error(slot, DLN2_RES_FAIL);
+    }
+    dln2_delay(1);
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    uint8_t *entry = rsp + i * (1 + read_len);
+    uint8_t *data = entry + 1;
+
+    if (!dln2_onewire_reset(pin)) {
+      entry[0] = DLN2_ONEWIRE_STATUS_NO_PRESENCE;
+      memset(data, 0, read_len);
+      continue;
+    }
+
+    dln2_onewire_write_rom(pin, roms[i]);
+    dln2_onewire_write_byte(pin, read_cmd);
+    for (unsigned int j = 0; j < read_len; j++)
+      data[j] = dln2_onewire_read_byte(pin);
+
+    entry[0] = dln2_onewire_crc8(data, read_len)
+                   ? DLN2_ONEWIRE_STATUS_CRC_ERROR
+                   : DLN2_ONEWIRE_STATUS_OK;
+  }
+
+  return dln2_response(slot, count * (1 + read_len));
+}
+
+bool dln2_handle_onewire(struct dln2_slot *slot) {
+  struct dln2_header *hdr = dln2_slot_header(slot);
+  uint8_t *port = dln2_slot_header_data(slot);
+
+  switch (hdr->id) {
+  case DLN2_ONEWIRE_GET_PORT_COUNT:
+    DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+    return dln2_response_u8(slot, DLN2_ONEWIRE_MAX_PORTS);
+  case DLN2_ONEWIRE_ENABLE:
+    return dln2_onewire_enable(slot);
+  case DLN2_ONEWIRE_DISABLE:
+    return dln2_onewire_disable(slot);
+  case DLN2_ONEWIRE_RESET:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_onewire_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u8(slot,
+                            dln2_onewire_reset(dln2_onewire_pins[*port]));
+  case DLN2_ONEWIRE_TRANSFER:
+    return dln2_onewire_transfer(slot);
+  case DLN2_ONEWIRE_SEARCH:
+    return dln2_onewire_search_cmd(slot);
+  case DLN2_ONEWIRE_CONVERT:
+    return dln2_onewire_convert(slot);
+  default:
+    LOG_INFO("1-Wire command not supported: 0x%04x\n", hdr->id);
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+}
@@ -0,0 +1,500 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * Parallel bus, not part of the DLN protocol
+ *
+ * Bit-banged 8 or 16 bit 8080 style bus: data lines plus optional WR, RD, DC
+ * (register select) and CS lines, all active low except DC. A write puts a
+ * word on the data lines with WR low and latches it on the rising edge, a
+ * read pulls RD low and samples the data lines before releasing it. A
+ * parallel ADC is driven with RD as its strobe.
+ *
+ * When all data lines sit in one 32-pin GPIO port each word goes out with a
+ * single port_set_clr() that also pulls WR low, when they are consecutive
+ * pins in order the word is just shifted into place.
+ *
+ * The bursts run from the slot payload and block command handling until they
+ * are done, so a FILL is limited to one 320x240 frame and larger areas take
+ * several commands. The byte counters let the host work out the throughput.
+ */
+
+#include "dln2-gpio.h"
+#include "dln2.h"
+#include "dln2_log.h"
+
+#define DLN2_PARBUS_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_PARBUS)
+
+#define DLN2_PARBUS_GET_PORT_COUNT DLN2_PARBUS_CMD(0x00)
+#define DLN2_PARBUS_ENABLE DLN2_PARBUS_CMD(0x01)
+#define DLN2_PARBUS_DISABLE DLN2_PARBUS_CMD(0x02)
+#define DLN2_PARBUS_WRITE DLN2_PARBUS_CMD(0x10)
+#define DLN2_PARBUS_READ DLN2_PARBUS_CMD(0x11)
+#define DLN2_PARBUS_FILL DLN2_PARBUS_CMD(0x12)
+#define DLN2_PARBUS_GET_STATS DLN2_PARBUS_CMD(0x20)
+
+// Burst flags, DC is driven high (data) with FLAG_DC, low (command) without
+#define DLN2_PARBUS_FLAG_DC 0x01
+
+// DLN2_PARBUS_ENABLE response, how the data lines are driven
+#define DLN2_PARBUS_MODE_PINS 0       // One pin at a time
+#define DLN2_PARBUS_MODE_SCATTER 1    // One port, pins in any order
+#define DLN2_PARBUS_MODE_CONTIGUOUS 2 // One port, consecutive pins
+
+#define DLN2_PARBUS_PIN_NONE 0xffff
+
+#define DLN2_PARBUS_MAX_PORTS 2
+#define DLN2_PARBUS_MAX_WIDTH 16
+#define DLN2_PARBUS_FILL_MAX (320 * 240)
+
+struct dln2_parbus_port {
+  bool enabled;
+  uint8_t width;
+  uint8_t hold_us;
+  uint8_t mode;
+  uint16_t wr;
+  uint16_t rd;
+  uint16_t dc;
+  uint16_t cs;
+  uint16_t data[DLN2_PARBUS_MAX_WIDTH];
+
+  // Single port modes
+  uint32_t port;
+  uint32_t data_mask;
+  uint32_t data_bits[DLN2_PARBUS_MAX_WIDTH];
+  uint8_t shift;
+  uint32_t wr_mask; // WR when it is in the data port, else 0
+
+  uint32_t write_bytes;
+  uint32_t read_bytes;
+  uint32_t bursts;
+};
+
+static struct dln2_parbus_port dln2_parbus_ports[DLN2_PARBUS_MAX_PORTS];
+
+static inline uint32_t dln2_parbus_pin_port(uint16_t pin) {
+  return pin / DLN2_GPIO_PORT_WIDTH;
+}
+
+static inline uint32_t dln2_parbus_pin_bit(uint16_t pin) {
+  return 1U << (pin % DLN2_GPIO_PORT_WIDTH);
+}
+
+static inline void dln2_parbus_put_ctrl(uint16_t pin, bool value) {
+  if (pin != DLN2_PARBUS_PIN_NONE)
+    dln2_gpio_drv_put(pin, value);
+}
+
+static inline void dln2_parbus_hold(struct dln2_parbus_port *p) {
+  if (p->hold_us)
+    dln2_gpio_drv_delay_us(p->hold_us);
+}
+
+static void dln2_parbus_write_word(struct dln2_parbus_port *p, uint16_t val) {
+  uint32_t set;
+
+  switch (p->mode) {
+  case DLN2_PARBUS_MODE_CONTIGUOUS:
+    set = ((uint32_t)val << p->shift) & p->data_mask;
+    break;
+  case DLN2_PARBUS_MODE_SCATTER:
+    set = 0;
+    for (uint8_t i = 0; i < p->width; i++)
+      if (val & (1U << i))
+        set |= p->data_bits[i];
+    break;
+  default:
+    for (uint8_t i = 0; i < p->width; i++)
+      dln2_gpio_drv_put(p->data[i], val & (1U << i));
+    dln2_gpio_drv_put(p->wr, false);
+    dln2_parbus_hold(p);
+    dln2_gpio_drv_put(p->wr, true);
+    return;
+  }
+
+  // Data and the WR falling edge in one register write
+  dln2_gpio_drv_port_set_clr(p->port, set, (p->data_mask & ~set) | p->wr_mask);
+  if (!p->wr_mask)
+    dln2_gpio_drv_put(p->wr, false);
+  dln2_parbus_hold(p);
+  if (p->wr_mask)
+    dln2_gpio_drv_port_set_clr(p->port, p->wr_mask, 0);
+  else
+    dln2_gpio_drv_put(p->wr, true);
+}
+
+static uint16_t dln2_parbus_read_word(struct dln2_parbus_port *p) {
+  uint16_t val = 0;
+
+  dln2_gpio_drv_put(p->rd, false);
+  dln2_parbus_hold(p);
+
+  switch (p->mode) {
+  case DLN2_PARBUS_MODE_CONTIGUOUS:
+    val = dln2_gpio_drv_port_get(p->port, p->data_mask) >> p->shift;
+    break;
+  case DLN2_PARBUS_MODE_SCATTER: {
+    uint32_t in = dln2_gpio_drv_port_get(p->port, p->data_mask);
+    for (uint8_t i = 0; i < p->width; i++)
+      if (in & p->data_bits[i])
+        val |= 1U << i;
+    break;
+  }
+  default:
+    for (uint8_t i = 0; i < p->width; i++)
+      if (dln2_gpio_drv_get(p->data[i]))
+        val |= 1U << i;
+    break;
+  }
+
+  dln2_gpio_drv_put(p->rd, true);
+
+  return val;
+}
+
+static void dln2_parbus_data_dir(struct dln2_parbus_port *p, bool out) {
+  for (uint8_t i = 0; i < p->width; i++)
+    dln2_gpio_drv_set_dir(p->data[i], out);
+}
+
+static void dln2_parbus_begin(struct dln2_parbus_port *p, uint8_t flags) {
+  dln2_parbus_put_ctrl(p->dc, flags & DLN2_PARBUS_FLAG_DC);
+  dln2_parbus_put_ctrl(p->cs, false);
+  p->bursts++;
+}
+
+static void dln2_parbus_end(struct dln2_parbus_port *p) {
+  dln2_parbus_put_ctrl(p->cs, true);
+}
+
+// Work out the fastest way to drive the data lines
+static void dln2_parbus_setup_mode(struct dln2_parbus_port *p) {
+  uint32_t port = dln2_parbus_pin_port(p->data[0]);
+  bool contiguous = true;
+
+  p->mode = DLN2_PARBUS_MODE_PINS;
+  p->data_mask = 0;
+  p->wr_mask = 0;
+
+  for (uint8_t i = 0; i < p->width; i++) {
+    if (dln2_parbus_pin_port(p->data[i]) != port)
+      return;
+    if (p->data[i] != p->data[0] + i)
+      contiguous = false;
+    p->data_bits[i] = dln2_parbus_pin_bit(p->data[i]);
+    p->data_mask |= p->data_bits[i];
+  }
+
+  p->port = port;
+  p->shift = p->data[0] % DLN2_GPIO_PORT_WIDTH;
+  p->mode =
+      contiguous ? DLN2_PARBUS_MODE_CONTIGUOUS : DLN2_PARBUS_MODE_SCATTER;
+  if (p->wr != DLN2_PARBUS_PIN_NONE && dln2_parbus_pin_port(p->wr) == port)
+    p->wr_mask = dln2_parbus_pin_bit(p->wr);
+}
+
+// Add a pin to the claim mask, fails on an invalid or repeated pin
+static bool dln2_parbus_mask_add(uint32_t *mask, uint16_t pin) {
+  if (pin >= dln2_gpio_drv_count() || pin >= DLN2_PIN_MAX ||
+      dln2_bitmap_test(mask, pin))
+    return false;
+  dln2_bitmap_set(mask, pin);
+  return true;
+}
+
+static bool dln2_parbus_port_valid(uint8_t port) {
+  return port < DLN2_PARBUS_MAX_PORTS && dln2_parbus_ports[port].enabled;
+}
+
+static bool dln2_parbus_enable(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t width;
+    uint8_t hold_us;
+    uint16_t wr;
+    uint16_t rd;
+    uint16_t dc;
+    uint16_t cs;
+    uint16_t data[DLN2_PARBUS_MAX_WIDTH];
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX) = {0};
+  struct dln2_pin_conflict conflict;
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_PARBUS_ENABLE: port=%u width=%u hold=%uus wr=%u rd=%u "
+           "dc=%u cs=%u\n",
+           cmd->port, cmd->width, cmd->hold_us, cmd->wr, cmd->rd, cmd->dc,
+           cmd->cs);
+
+  if (cmd->port >= DLN2_PARBUS_MAX_PORTS)
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if (dln2_parbus_ports[cmd->port].enabled)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+  if (cmd->width != 8 && cmd->width != 16)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+  if (cmd->hold_us && !dln2_gpio_drv_has_delay())
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  if (cmd->wr == DLN2_PARBUS_PIN_NONE && cmd->rd == DLN2_PARBUS_PIN_NONE)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+  uint16_t ctrl[] = {cmd->wr, cmd->rd, cmd->dc, cmd->cs};
+  for (unsigned int i = 0; i < TU_ARRAY_SIZE(ctrl); i++)
+    if (ctrl[i] != DLN2_PARBUS_PIN_NONE &&
+        !dln2_parbus_mask_add(pins, ctrl[i]))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
+  for (uint8_t i = 0; i < cmd->width; i++)
+    if (!dln2_parbus_mask_add(pins, cmd->data[i]))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
+
+  // The group request lets a module claim its own pins again
+  for (uint16_t w = 0; w < DLN2_PIN_WORDS; w++)
+    if (pins[w] & dln2_pin_module_word(DLN2_MODULE_PARBUS, w))
+      return dln2_response_error(slot, DLN2_RES_PIN_IN_USE);
+
+  uint16_t res = dln2_pin_group_request(pins, DLN2_MODULE_PARBUS, &conflict);
+  if (res) {
+    LOG_INFO("    pin %u in use by module 0x%02x\n", conflict.pin,
+             conflict.module);
+    return dln2_response_error(slot, res);
+  }
+
+  struct dln2_parbus_port *p = &dln2_parbus_ports[cmd->port];
+
+  memset(p, 0, sizeof(*p));
+  p->width = cmd->width;
+  p->hold_us = cmd->hold_us;
+  p->wr = cmd->wr;
+  p->rd = cmd->rd;
+  p->dc = cmd->dc;
+  p->cs = cmd->cs;
+  memcpy(p->data, cmd->data, sizeof(p->data));
+  dln2_parbus_setup_mode(p);
+
+  // Strobes and CS idle high, data lines driven low
+  for (unsigned int i = 0; i < TU_ARRAY_SIZE(ctrl); i++) {
+    if (ctrl[i] == DLN2_PARBUS_PIN_NONE)
+      continue;
+    dln2_gpio_drv_init(ctrl[i]);
+    dln2_gpio_drv_put(ctrl[i], ctrl[i] != p->dc);
+    dln2_gpio_drv_set_dir(ctrl[i], true);
+  }
+  for (uint8_t i = 0; i < p->width; i++) {
+    dln2_gpio_drv_init(p->data[i]);
+    dln2_gpio_drv_put(p->data[i], false);
+    dln2_gpio_drv_set_dir(p->data[i], true);
+  }
+
+  p->enabled = true;
+  LOG_INFO("    mode=%u\n", p->mode);
+
+  return dln2_response_u8(slot, p->mode);
+}
+
+static bool dln2_parbus_disable(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX) = {0};
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+  LOG_INFO("DLN2_PARBUS_DISABLE: port=%u\n", *port);
+
+  if (!dln2_parbus_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_parbus_port *p = &dln2_parbus_ports[*port];
+  uint16_t ctrl[] = {p->wr, p->rd, p->dc, p->cs};
+  uint32_t pin;
+
+  for (unsigned int i = 0; i < TU_ARRAY_SIZE(ctrl); i++)
+    if (ctrl[i] != DLN2_PARBUS_PIN_NONE)
+      dln2_parbus_mask_add(pins, ctrl[i]);
+  for (uint8_t i = 0; i < p->width; i++)
+    dln2_parbus_mask_add(pins, p->data[i]);
+
+  dln2_bitmap_for_each_set(pin, pins, DLN2_PIN_MAX)
+    dln2_gpio_drv_deinit(pin);
+  dln2_pin_group_free(pins, DLN2_MODULE_PARBUS, NULL);
+  p->enabled = false;
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_parbus_write(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t flags;
+    uint8_t data[];
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  size_t len = dln2_slot_header_data_size(slot);
+
+  if (len < sizeof(*cmd))
+    return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+  len -= sizeof(*cmd);
+
+  LOG_INFO("DLN2_PARBUS_WRITE: port=%u flags=0x%02x len=%zu\n", cmd->port,
+           cmd->flags, len);
+
+  if (!dln2_parbus_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_parbus_port *p = &dln2_parbus_ports[cmd->port];
+
+  if (p->wr == DLN2_PARBUS_PIN_NONE)
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  if (p->width == 16 && len % 2)
+    return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+
+  dln2_parbus_begin(p, cmd->flags);
+  if (p->width == 8) {
+    for (size_t i = 0; i < len; i++)
+      dln2_parbus_write_word(p, cmd->data[i]);
+  } else {
+    for (size_t i = 0; i < len; i += 2)
+      dln2_parbus_write_word(p, cmd->data[i] | cmd->data[i + 1] << 8);
+  }
+  dln2_parbus_end(p);
+
+  p->write_bytes += len;
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_parbus_read(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t flags;
+    uint16_t count;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  uint8_t *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_PARBUS_READ: port=%u flags=0x%02x count=%u\n", cmd->port,
+           cmd->flags, cmd->count);
+
+  if (!dln2_parbus_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_parbus_port *p = &dln2_parbus_ports[cmd->port];
+  uint8_t flags = cmd->flags;
+  size_t len = cmd->count * (p->width / 8);
+
+  if (p->rd == DLN2_PARBUS_PIN_NONE)
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  if (len > DLN2_BUF_SIZE - sizeof(struct dln2_response))
+    return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+
+  // The response overlaps the command, which has been consumed by now
+  dln2_parbus_data_dir(p, false);
+  dln2_parbus_begin(p, flags);
+  for (size_t i = 0; i < len; i += p->width / 8) {
+    uint16_t val = dln2_parbus_read_word(p);
+    rsp[i] = val;
+    if (p->width == 16)
+      rsp[i + 1] = val >> 8;
+  }
+  dln2_parbus_end(p);
+  dln2_parbus_data_dir(p, true);
+
+  p->read_bytes += len;
+
+  return dln2_response(slot, len);
+}
+
+// Write the same word count times, e.g. to clear a display
+static bool dln2_parbus_fill(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t flags;
+    uint16_t value;
+    uint32_t count;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_PARBUS_FILL: port=%u flags=0x%02x value=0x%04x count=%lu\n",
+           cmd->port, cmd->flags, cmd->value, (unsigned long)cmd->count);
+
+  if (!dln2_parbus_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_parbus_port *p = &dln2_parbus_ports[cmd->port];
+
+  if (p->wr == DLN2_PARBUS_PIN_NONE)
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  if (cmd->count > DLN2_PARBUS_FILL_MAX)
+    return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+
+  dln2_parbus_begin(p, cmd->flags);
+  for (uint32_t i = 0; i < cmd->count; i++)
+    dln2_parbus_write_word(p, cmd->value);
+  dln2_parbus_end(p);
+
+  p->write_bytes += cmd->count * (p->width / 8);
+
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_parbus_get_stats(struct dln2_slot *slot) {
+  struct {
+    uint8_t port;
+    uint8_t clear;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  struct {
+    uint32_t write_bytes;
+    uint32_t read_bytes;
+    uint32_t bursts;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_PARBUS_GET_STATS: port=%u clear=%u\n", cmd->port,
+           cmd->clear);
+
+  if (!dln2_parbus_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_parbus_port *p = &dln2_parbus_ports[cmd->port];
+  bool clear = cmd->clear;
+
+  rsp->write_bytes = p->write_bytes;
+  rsp->read_bytes = p->read_bytes;
+  rsp->bursts = p->bursts;
+
+  if (clear) {
+    p->write_bytes = 0;
+    p->read_bytes = 0;
+    p->bursts = 0;
+  }
+
+  return dln2_response(slot, sizeof(*rsp));
+}
+
+bool dln2_handle_parbus(struct dln2_slot *slot) {
+  struct dln2_header *hdr = dln2_slot_header(slot);
+
+  switch (hdr->id) {
+  case DLN2_PARBUS_GET_PORT_COUNT:
+    DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+    return dln2_response_u8(slot, DLN2_PARBUS_MAX_PORTS);
+  case DLN2_PARBUS_ENABLE:
+    return dln2_parbus_enable(slot);
+  case DLN2_PARBUS_DISABLE:
+    return dln2_parbus_disable(slot);
+  case DLN2_PARBUS_WRITE:
+    return dln2_parbus_write(slot);
+  case DLN2_PARBUS_READ:
+    return dln2_parbus_read(slot);
+  case DLN2_PARBUS_FILL:
+    return dln2_parbus_fill(slot);
+  case DLN2_PARBUS_GET_STATS:
+    return dln2_parbus_get_stats(slot);
+  default:
+    LOG_INFO("Parallel bus command not supported: 0x%04x\n", hdr->id);
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+}
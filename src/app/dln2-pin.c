@@ -12,61 +12,192 @@
 
 #include <stdio.h>
 #include "dln2.h"
+#include "dln2_bitmap.h"
 
+// Number of modules that can own pins at the same time
+#define DLN2_PIN_MODULES 12
 
-#define DLN2_PIN_MAX 44
-#define DLN2_PIN_NOT_AVAILABLE 0xff
-
-struct dln2_pin_state
+/*
+ * Each module that owns pins gets a bitmap of its pins. dln2_pins_claimed is
+ * the union of all of them so that conflicts can be checked a word at a time.
+ */
+struct dln2_pin_module
 {
     uint8_t module;
+    DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX);
 };
 
-static struct dln2_pin_state dln2_pin_states[DLN2_PIN_MAX];
+static struct dln2_pin_module dln2_pin_modules[DLN2_PIN_MODULES];
+static DLN2_DECLARE_BITMAP(dln2_pins_claimed, DLN2_PIN_MAX);
+static DLN2_DECLARE_BITMAP(dln2_pins_unavailable, DLN2_PIN_MAX);
+
+static struct dln2_pin_module *dln2_pin_module_get(uint8_t module, bool alloc)
+{
+    struct dln2_pin_module *free_entry = NULL;
+
+    if (!module || module == DLN2_PIN_NOT_AVAILABLE)
+        return NULL;
+
+    for (unsigned int i = 0; i < DLN2_PIN_MODULES; i++)
+    {
+        struct dln2_pin_module *entry = &dln2_pin_modules[i];
+        if (entry->module == module)
+            return entry;
+        if (!entry->module && !free_entry)
+            free_entry = entry;
+    }
+
+    if (!alloc || !free_entry)
+        return NULL;
+
+    free_entry->module = module;
+    memset(free_entry->pins, 0, sizeof(free_entry->pins));
+    return free_entry;
+}
+
+uint8_t dln2_pin_owner(uint16_t pin)
+{
+    if (pin >= DLN2_PIN_MAX || dln2_bitmap_test(dln2_pins_unavailable, pin))
+        return DLN2_PIN_NOT_AVAILABLE;
+    if (!dln2_bitmap_test(dln2_pins_claimed, pin))
+        return 0;
+
+    for (unsigned int i = 0; i < DLN2_PIN_MODULES; i++)
+    {
+        struct dln2_pin_module *entry = &dln2_pin_modules[i];
+        if (entry->module && dln2_bitmap_test(entry->pins, pin))
+            return entry->module;
+    }
+
+    return 0;
+}
+
+// Returns one 32 pin word of the pins owned by module
+uint32_t dln2_pin_module_word(uint8_t module, uint16_t word)
+{
+    struct dln2_pin_module *entry = dln2_pin_module_get(module, false);
+
+    if (!entry || word >= DLN2_PIN_WORDS)
+        return 0;
+
+    return entry->pins[word];
+}
+
+// Find the first pin in mask that is unavailable or owned by someone else
+static bool dln2_pin_group_conflict(const uint32_t *mask, const uint32_t *own,
+                                    struct dln2_pin_conflict *conflict)
+{
+    for (uint32_t w = 0; w < DLN2_PIN_WORDS; w++)
+    {
+        uint32_t other = dln2_pins_claimed[w] & ~(own ? own[w] : 0);
+        uint32_t busy = mask[w] & (other | dln2_pins_unavailable[w]);
+        if (!busy)
+            continue;
+
+        uint16_t pin = w * DLN2_BITMAP_WORD_BITS + __builtin_ctz(busy);
+        if (conflict)
+        {
+            conflict->pin = pin;
+            conflict->module = dln2_pin_owner(pin);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Claim all pins in mask (DLN2_PIN_WORDS words) for module. Either all pins
+ * are claimed or none, on failure conflict holds the first offending pin.
+ */
+uint16_t dln2_pin_group_request(const uint32_t *mask, uint8_t module,
+                                struct dln2_pin_conflict *conflict)
+{
+    struct dln2_pin_module *entry = dln2_pin_module_get(module, true);
+    if (!entry)
+        return DLN2_RES_FAIL;
+
+    if (dln2_pin_group_conflict(mask, entry->pins, conflict))
+        return DLN2_RES_PIN_IN_USE;
+
+    for (uint32_t w = 0; w < DLN2_PIN_WORDS; w++)
+    {
+        entry->pins[w] |= mask[w];
+        dln2_pins_claimed[w] |= mask[w];
+    }
+
+    return 0;
+}
+
+/*
+ * Release all pins in mask held by module. Pins that are not claimed are
+ * ignored, nothing is released if a pin belongs to another module.
+ */
+uint16_t dln2_pin_group_free(const uint32_t *mask, uint8_t module,
+                             struct dln2_pin_conflict *conflict)
+{
+    struct dln2_pin_module *entry = dln2_pin_module_get(module, false);
+
+    if (dln2_pin_group_conflict(mask, entry ? entry->pins : NULL, conflict))
+        return DLN2_RES_PIN_NOT_CONNECTED_TO_MODULE;
+
+    if (!entry)
+        return 0;
+
+    for (uint32_t w = 0; w < DLN2_PIN_WORDS; w++)
+    {
+        entry->pins[w] &= ~mask[w];
+        dln2_pins_claimed[w] &= ~mask[w];
+    }
+
+    return 0;
+}
 
 bool dln2_pin_is_requested(uint16_t pin, uint8_t module)
 {
     if (pin >= DLN2_PIN_MAX)
         return false;
 
-    struct dln2_pin_state *state = &dln2_pin_states[pin];
-    return state->module == module;
+    if (dln2_bitmap_test(dln2_pins_unavailable, pin))
+        return false;
+
+    struct dln2_pin_module *entry = dln2_pin_module_get(module, false);
+    return entry && dln2_bitmap_test(entry->pins, pin);
 }
 
 uint16_t dln2_pin_request(uint16_t pin, uint8_t module)
 {
-    if (pin >= DLN2_PIN_MAX)
-        return DLN2_RES_INVALID_PIN_NUMBER;
+    DLN2_DECLARE_BITMAP(mask, DLN2_PIN_MAX) = {0};
 
-    struct dln2_pin_state *state = &dln2_pin_states[pin];
-    if (state->module && state->module != module)
-        return DLN2_RES_PIN_IN_USE;
+    if (!dln2_pin_mask_add(mask, pin))
+        return DLN2_RES_INVALID_PIN_NUMBER;
 
-    state->module = module;
-    return 0;
+    return dln2_pin_group_request(mask, module, NULL);
 }
 
 uint16_t dln2_pin_free(uint16_t pin, uint8_t module)
 {
-    if (pin >= DLN2_PIN_MAX)
-        return DLN2_RES_INVALID_PIN_NUMBER;
+    DLN2_DECLARE_BITMAP(mask, DLN2_PIN_MAX) = {0};
 
-    struct dln2_pin_state *state = &dln2_pin_states[pin];
-    if (state->module && state->module != module)
-        return DLN2_RES_PIN_NOT_CONNECTED_TO_MODULE;
+    if (!dln2_pin_mask_add(mask, pin))
+        return DLN2_RES_INVALID_PIN_NUMBER;
 
-    state->module = 0;
-    return 0;
+    return dln2_pin_group_free(mask, module, NULL);
 }
 
-void dln2_pin_set_available(uint32_t mask)
+// mask is a bitmap of pin_count bits, a cleared bit makes the pin unavailable
+void dln2_pin_set_available(const uint32_t *mask, uint16_t pin_count)
 {
-    for (uint32_t i = 0; i < DLN2_PIN_MAX; i++)
+    if (pin_count > DLN2_PIN_MAX)
+        pin_count = DLN2_PIN_MAX;
+
+    for (uint32_t w = 0; w < DLN2_PIN_WORDS; w++)
     {
-        if (!(mask & 1))
-            dln2_pin_states[i].module = DLN2_PIN_NOT_AVAILABLE;
-        mask >>= 1;
+        uint32_t avail = 0;
+        if (w < DLN2_BITMAP_WORDS((uint32_t)pin_count))
+            avail = mask[w] & dln2_bitmap_word_mask(w, pin_count);
+        dln2_pins_unavailable[w] = ~avail & dln2_bitmap_word_mask(w, DLN2_PIN_MAX);
     }
-    dln2_pin_states[30].module = DLN2_PIN_NOT_AVAILABLE;
-    dln2_pin_states[31].module = DLN2_PIN_NOT_AVAILABLE;
+    dln2_bitmap_set(dln2_pins_unavailable, 30);
+    dln2_bitmap_set(dln2_pins_unavailable, 31);
 }
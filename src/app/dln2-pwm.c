@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * PWM module
+ *
+ * Implements the DLN PWM command set. Enabling a port claims the pins of all
+ * its channels. The duty cycle is in 0.01% units (0 - 10000).
+ *
+ * DLN2_PWM_SET_CHANNELS is not part of the DLN protocol, it updates the
+ * frequency and duty cycle of several channels of a port so that they change
+ * together when the driver supports it.
+ */
+
+#include "dln2.h"
+#include "dln2_log.h"
+#include "pwm_driver.h"
+
+#define DLN2_PWM_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_PWM)
+
+#define DLN2_PWM_GET_PORT_COUNT DLN2_PWM_CMD(0x00)
+#define DLN2_PWM_GET_CHANNEL_COUNT DLN2_PWM_CMD(0x01)
+#define DLN2_PWM_ENABLE DLN2_PWM_CMD(0x02)
+#define DLN2_PWM_DISABLE DLN2_PWM_CMD(0x03)
+#define DLN2_PWM_IS_ENABLED DLN2_PWM_CMD(0x04)
+#define DLN2_PWM_CHANNEL_ENABLE DLN2_PWM_CMD(0x05)
+#define DLN2_PWM_CHANNEL_DISABLE DLN2_PWM_CMD(0x06)
+#define DLN2_PWM_CHANNEL_IS_ENABLED DLN2_PWM_CMD(0x07)
+#define DLN2_PWM_SET_FREQUENCY DLN2_PWM_CMD(0x08)
+#define DLN2_PWM_GET_FREQUENCY DLN2_PWM_CMD(0x09)
+#define DLN2_PWM_SET_DUTY_CYCLE DLN2_PWM_CMD(0x0A)
+#define DLN2_PWM_GET_DUTY_CYCLE DLN2_PWM_CMD(0x0B)
+#define DLN2_PWM_SET_CHANNELS DLN2_PWM_CMD(0x60)
+
+#define DLN2_PWM_MAX_PORTS 4
+#define DLN2_PWM_MAX_CHANNELS 8
+#define DLN2_PWM_DEFAULT_FREQ 1000
+
+struct dln2_pwm_port_chan {
+  uint8_t port;
+  uint8_t channel;
+} TU_ATTR_PACKED;
+
+struct dln2_pwm_channel {
+  bool enabled;
+  uint32_t freq;
+  uint16_t duty;
+};
+
+struct dln2_pwm_port {
+  bool enabled;
+  struct dln2_pwm_channel channels[DLN2_PWM_MAX_CHANNELS];
+};
+
+static struct pwm_driver *_pwm_driver;
+static struct dln2_pwm_port dln2_pwm_ports[DLN2_PWM_MAX_PORTS];
+
+static bool dln2_pwm_port_valid(uint8_t port) {
+  return _pwm_driver && port < _pwm_driver->port_count &&
+         port < DLN2_PWM_MAX_PORTS;
+}
+
+static uint8_t dln2_pwm_channel_count(uint8_t port) {
+  uint8_t count = _pwm_driver->ports[port].channel_count;
+
+  return count < DLN2_PWM_MAX_CHANNELS ? count : DLN2_PWM_MAX_CHANNELS;
+}
+
+// Returns a DLN2_RES_* code, the channel must also be on an enabled port
+static uint16_t dln2_pwm_check(const struct dln2_pwm_port_chan *pc) {
+  if (!dln2_pwm_port_valid(pc->port))
+    return DLN2_RES_INVALID_PORT_NUMBER;
+  if (pc->channel >= dln2_pwm_channel_count(pc->port))
+    return DLN2_RES_INVALID_CHANNEL_NUMBER;
+  if (!dln2_pwm_ports[pc->port].enabled)
+    return DLN2_RES_FAIL;
+  return DLN2_RES_SUCCESS;
+}
+
+static void dln2_pwm_port_pins(uint8_t port, uint32_t *pins) {
+  for (uint8_t ch = 0; ch < dln2_pwm_channel_count(port); ch++)
+    dln2_pin_mask_add(pins, _pwm_driver->ports[port].pins[ch]);
+}
+
+static bool dln2_pwm_enable(struct dln2_slot *slot, bool enable) {
+  uint8_t *port = dln2_slot_header_data(slot);
+  DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX) = {0};
+  struct dln2_pin_conflict conflict;
+  uint16_t res;
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+  LOG_INFO("%s: port=%u\n", enable ? "DLN2_PWM_ENABLE" : "DLN2_PWM_DISABLE",
+           *port);
+
+  if (!dln2_pwm_port_valid(*port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  struct dln2_pwm_port *p = &dln2_pwm_ports[*port];
+
+  if (p->enabled != enable) {
+    dln2_pwm_port_pins(*port, pins);
+
+    if (enable) {
+      res = dln2_pin_group_request(pins, DLN2_MODULE_PWM, &conflict);
+      if (res) {
+        LOG_INFO("    pin %u in use by module 0x%02x\n", conflict.pin,
+                 conflict.module);
+        return dln2_response_error(slot, res);
+      }
+
+      if (!_pwm_driver->port_enable(*port)) {
+        dln2_pin_group_free(pins, DLN2_MODULE_PWM, NULL);
+        return dln2_response_error(slot, DLN2_RES_FAIL);
+      }
+
+      for (uint8_t ch = 0; ch < DLN2_PWM_MAX_CHANNELS; ch++) {
+        p->channels[ch].enabled = false;
+        p->channels[ch].freq = DLN2_PWM_DEFAULT_FREQ;
+        p->channels[ch].duty = 0;
+      }
+      p->enabled = true;
+    } else {
+      for (uint8_t ch = 0; ch < dln2_pwm_channel_count(*port); ch++) {
+        if (p->channels[ch].enabled)
+          _pwm_driver->channel_enable(*port, ch, false);
+        p->channels[ch].enabled = false;
+      }
+      _pwm_driver->port_disable(*port);
+      dln2_pin_group_free(pins, DLN2_MODULE_PWM, NULL);
+      p->enabled = false;
+    }
+  }
+
+  if (!enable)
+    return dln2_response(slot, 0);
+
+  // Conflicts are reported as DLN2_RES_PIN_IN_USE, the pin is only logged
+  return dln2_response_u16(slot, 0);
+}
+
+static bool dln2_pwm_channel_enable(struct dln2_slot *slot, bool enable) {
+  struct dln2_pwm_port_chan *pc = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*pc));
+  LOG_INFO("%s: port=%u channel=%u\n",
+           enable ? "DLN2_PWM_CHANNEL_ENABLE" : "DLN2_PWM_CHANNEL_DISABLE",
+           pc->port, pc->channel);
+
+  uint16_t res = dln2_pwm_check(pc);
+  if (res)
+    return dln2_response_error(slot, res);
+
+  struct dln2_pwm_channel *ch = &dln2_pwm_ports[pc->port].channels[pc->channel];
+
+  if (ch->enabled != enable) {
+    if (enable) {
+      ch->freq = _pwm_driver->set_freq(pc->port, pc->channel, ch->freq);
+      ch->duty = _pwm_driver->set_duty(pc->port, pc->channel, ch->duty);
+    }
+    _pwm_driver->channel_enable(pc->port, pc->channel, enable);
+    ch->enabled = enable;
+  }
+
+  if (enable)
+    return dln2_response_u8(slot, pc->channel);
+  return dln2_response(slot, 0);
+}
+
+static bool dln2_pwm_set_freq(struct dln2_slot *slot) {
+  struct {
+    struct dln2_pwm_port_chan pc;
+    uint32_t freq;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_PWM_SET_FREQUENCY: port=%u channel=%u freq=%lu\n",
+           cmd->pc.port, cmd->pc.channel, (unsigned long)cmd->freq);
+
+  uint16_t res = dln2_pwm_check(&cmd->pc);
+  if (res)
+    return dln2_response_error(slot, res);
+
+  struct dln2_pwm_channel *ch =
+      &dln2_pwm_ports[cmd->pc.port].channels[cmd->pc.channel];
+  uint32_t freq = _pwm_driver->set_freq(cmd->pc.port, cmd->pc.channel,
+                                        cmd->freq);
+  if (!freq)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+  ch->freq = freq;
+  // The hardware may have lost duty resolution at the new frequency
+  ch->duty = _pwm_driver->set_duty(cmd->pc.port, cmd->pc.channel, ch->duty);
+
+  return dln2_response_u32(slot, freq);
+}
+
+static bool dln2_pwm_set_duty(struct dln2_slot *slot) {
+  struct {
+    struct dln2_pwm_port_chan pc;
+    uint16_t duty;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  LOG_INFO("DLN2_PWM_SET_DUTY_CYCLE: port=%u channel=%u duty=%u\n",
+           cmd->pc.port, cmd->pc.channel, cmd->duty);
+
+  uint16_t res = dln2_pwm_check(&cmd->pc);
+  if (res)
+    return dln2_response_error(slot, res);
+  if (cmd->duty > PWM_DUTY_MAX)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+
+  struct dln2_pwm_channel *ch =
+      &dln2_pwm_ports[cmd->pc.port].channels[cmd->pc.channel];
+  ch->duty = _pwm_driver->set_duty(cmd->pc.port, cmd->pc.channel, cmd->duty);
+
+  return dln2_response_u16(slot, ch->duty);
+}
+
+static bool dln2_pwm_set_channels(struct dln2_slot *slot) {
+  struct dln2_pwm_channel_cfg {
+    uint8_t channel;
+    uint32_t freq; // 0 keeps the current frequency
+    uint16_t duty;
+  } TU_ATTR_PACKED;
+  struct {
+    uint8_t port;
+    uint8_t count;
+    struct dln2_pwm_channel_cfg channels[];
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+  struct {
+    uint32_t freq;
+    uint16_t duty;
+  } TU_ATTR_PACKED *rsp = dln2_slot_response_data(slot);
+  size_t len = dln2_slot_header_data_size(slot);
+
+  if (len < sizeof(*cmd) ||
+      len != sizeof(*cmd) + cmd->count * sizeof(cmd->channels[0]))
+    return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
+
+  LOG_INFO("DLN2_PWM_SET_CHANNELS: port=%u count=%u\n", cmd->port, cmd->count);
+
+  if (!dln2_pwm_port_valid(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+  if (!dln2_pwm_ports[cmd->port].enabled)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  if (cmd->count > DLN2_PWM_MAX_CHANNELS)
+    return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
+
+  // Check everything up front so the update is all or nothing
+  for (unsigned int i = 0; i < cmd->count; i++) {
+    if (cmd->channels[i].channel >= dln2_pwm_channel_count(cmd->port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_CHANNEL_NUMBER);
+    if (cmd->channels[i].duty > PWM_DUTY_MAX)
+      return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
+  }
+
+  // The response overlaps the request, work from a copy
+  struct dln2_pwm_channel_cfg cfgs[DLN2_PWM_MAX_CHANNELS];
+  uint8_t port = cmd->port;
+  uint8_t count = cmd->count;
+  memcpy(cfgs, cmd->channels, count * sizeof(cfgs[0]));
+
+  if (_pwm_driver->update_begin)
+    _pwm_driver->update_begin(port);
+
+  for (unsigned int i = 0; i < count; i++) {
+    uint8_t channel = cfgs[i].channel;
+    struct dln2_pwm_channel *ch = &dln2_pwm_ports[port].channels[channel];
+
+    if (cfgs[i].freq) {
+      uint32_t freq = _pwm_driver->set_freq(port, channel, cfgs[i].freq);
+      if (freq)
+        ch->freq = freq;
+    }
+    ch->duty = _pwm_driver->set_duty(port, channel, cfgs[i].duty);
+
+    rsp[i].freq = ch->freq;
+    rsp[i].duty = ch->duty;
+  }
+
+  if (_pwm_driver->update_commit)
+    _pwm_driver->update_commit(port);
+
+  return dln2_response(slot, count * sizeof(*rsp));
+}
+
+bool dln2_handle_pwm(struct dln2_slot *slot) {
+  struct dln2_header *hdr = dln2_slot_header(slot);
+  uint8_t *port = dln2_slot_header_data(slot);
+  struct dln2_pwm_port_chan *pc = dln2_slot_header_data(slot);
+  uint16_t res;
+
+  switch (hdr->id) {
+  case DLN2_PWM_GET_PORT_COUNT:
+    DLN2_VERIFY_COMMAND_SIZE(slot, 0);
+    if (!_pwm_driver)
+      return dln2_response_u8(slot, 0);
+    return dln2_response_u8(slot, _pwm_driver->port_count < DLN2_PWM_MAX_PORTS
+                                      ? _pwm_driver->port_count
+                                      : DLN2_PWM_MAX_PORTS);
+  case DLN2_PWM_GET_CHANNEL_COUNT:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_pwm_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u8(slot, dln2_pwm_channel_count(*port));
+  case DLN2_PWM_ENABLE:
+    return dln2_pwm_enable(slot, true);
+  case DLN2_PWM_DISABLE:
+    return dln2_pwm_enable(slot, false);
+  case DLN2_PWM_IS_ENABLED:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
+    if (!dln2_pwm_port_valid(*port))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+    return dln2_response_u8(slot, dln2_pwm_ports[*port].enabled);
+  case DLN2_PWM_CHANNEL_ENABLE:
+    return dln2_pwm_channel_enable(slot, true);
+  case DLN2_PWM_CHANNEL_DISABLE:
+    return dln2_pwm_channel_enable(slot, false);
+  case DLN2_PWM_CHANNEL_IS_ENABLED:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*pc));
+    res = dln2_pwm_check(pc);
+    if (res)
+      return dln2_response_error(slot, res);
+    return dln2_response_u8(
+        slot, dln2_pwm_ports[pc->port].channels[pc->channel].enabled);
+  case DLN2_PWM_SET_FREQUENCY:
+    return dln2_pwm_set_freq(slot);
+  case DLN2_PWM_GET_FREQUENCY:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*pc));
+    res = dln2_pwm_check(pc);
+    if (res)
+      return dln2_response_error(slot, res);
+    return dln2_response_u32(
+        slot, dln2_pwm_ports[pc->port].channels[pc->channel].freq);
+  case DLN2_PWM_SET_DUTY_CYCLE:
+    return dln2_pwm_set_duty(slot);
+  case DLN2_PWM_GET_DUTY_CYCLE:
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*pc));
+    res = dln2_pwm_check(pc);
+    if (res)
+      return dln2_response_error(slot, res);
+    return dln2_response_u16(
+        slot, dln2_pwm_ports[pc->port].channels[pc->channel].duty);
+  case DLN2_PWM_SET_CHANNELS:
+    return dln2_pwm_set_channels(slot);
+  default:
+    LOG_INFO("PWM command not supported: 0x%04x\n", hdr->id);
+    return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
+  }
+}
+
+void dln2_pwm_init(struct dln2_peripherials *peripherals) {
+  _pwm_driver = peripherals->pwm;
+}
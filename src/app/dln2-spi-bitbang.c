@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: CC0-1.0
+/*
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/*
+ * Bit-banged SPI master ports
+ *
+ * dln2_spi_bitbang_attach() wraps the hardware spi_master_driver in one that
+ * has the bit-banged buses listed in struct dln2_peripherials appended as
+ * extra ports, the same way as the I2C bit-banged ports.
+ *
+ * SCK and MOSI are push-pull outputs, MISO is optional (0xffff) for write
+ * only buses. The half clock period comes from the GPIO driver's delay_us(),
+ * so the bus runs at most at 500kHz.
+ */
+
+#include "dln2-gpio.h"
+#include "dln2.h"
+#include "dln2_log.h"
+#include "spi_master_driver.h"
+
+// Hardware and bit-banged ports together
+#define DLN2_SPI_MAX_PORTS 8
+
+#define DLN2_SPI_BITBANG_DEFAULT_FREQ 100000
+#define DLN2_SPI_BITBANG_PIN_NONE 0xffff
+
+#define DLN2_SPI_BITBANG_CPHA (1 << 0)
+#define DLN2_SPI_BITBANG_CPOL (1 << 1)
+
+struct dln2_spi_bitbang_port {
+  bool enabled;
+  uint8_t mode;
+  uint8_t bpw;
+  uint16_t sck;
+  uint16_t mosi;
+  uint16_t miso;
+  uint32_t half_us;
+};
+
+static struct spi_master_driver *dln2_spi_bitbang_hw;
+static uint8_t dln2_spi_bitbang_hw_count;
+static struct spi_master dln2_spi_bitbang_master[DLN2_SPI_MAX_PORTS];
+static struct dln2_spi_bitbang_port dln2_spi_bitbang_ports[DLN2_SPI_MAX_PORTS];
+static struct spi_master_driver dln2_spi_bitbang_driver;
+
+static inline void dln2_spi_bitbang_delay(struct dln2_spi_bitbang_port *p) {
+  dln2_gpio_drv_delay_us(p->half_us);
+}
+
+static uint16_t dln2_spi_bitbang_frame(struct dln2_spi_bitbang_port *p,
+                                       uint16_t out) {
+  bool cpol = p->mode & DLN2_SPI_BITBANG_CPOL;
+  bool cpha = p->mode & DLN2_SPI_BITBANG_CPHA;
+  bool has_miso = p->miso != DLN2_SPI_BITBANG_PIN_NONE;
+  uint16_t in = 0;
+
+  for (int bit = p->bpw - 1; bit >= 0; bit--) {
+    bool val = out & (1U << bit);
+    bool sample;
+
+    if (cpha) {
+      // Data changes on the leading edge, sampled on the trailing one
+      dln2_gpio_drv_put(p->sck, !cpol);
+      dln2_gpio_drv_put(p->mosi, val);
+      dln2_spi_bitbang_delay(p);
+      dln2_gpio_drv_put(p->sck, cpol);
+      sample = has_miso && dln2_gpio_drv_get(p->miso);
+      dln2_spi_bitbang_delay(p);
+    } else {
+      dln2_gpio_drv_put(p->mosi, val);
+      dln2_spi_bitbang_delay(p);
+      dln2_gpio_drv_put(p->sck, !cpol);
+      sample = has_miso && dln2_gpio_drv_get(p->miso);
+      dln2_spi_bitbang_delay(p);
+      dln2_gpio_drv_put(p->sck, cpol);
+    }
+
+    if (sample)
+      in |= 1U << bit;
+  }
+
+  return in;
+}
+
+static uint32_t dln2_spi_bitbang_set_freq(uint8_t port, uint32_t freq_hz) {
+  struct dln2_spi_bitbang_port *p = &dln2_spi_bitbang_ports[port];
+
+  if (!freq_hz)
+    freq_hz = DLN2_SPI_BITBANG_DEFAULT_FREQ;
+  p->half_us = (500000 + freq_hz - 1) / freq_hz;
+
+  return 500000 / p->half_us;
+}
+
+static uint32_t dln2_spi_bitbang_get_min_freq(uint8_t port) {
+  (void)port;
+  // half_us is 32-bit, the slowest clock rounds up to 1Hz
+  return 1;
+}
+
+static uint32_t dln2_spi_bitbang_get_max_freq(uint8_t port) {
+  (void)port;
+  return 500000;
+}
+
+static bool dln2_spi_bitbang_set_format(uint8_t port, uint8_t mode,
+                                        uint8_t bpw) {
+  struct dln2_spi_bitbang_port *p = &dln2_spi_bitbang_ports[port];
+
+  if (bpw < 1 || bpw > 16)
+    return false;
+
+  p->mode = mode;
+  p->bpw = bpw;
+  if (p->enabled)
+    dln2_gpio_drv_put(p->sck, mode & DLN2_SPI_BITBANG_CPOL);
+
+  return true;
+}
+
+static bool dln2_spi_bitbang_enable(uint8_t port) {
+  struct spi_master *m =
+      &dln2_spi_bitbang_master[dln2_spi_bitbang_hw_count + port];
+  struct dln2_spi_bitbang_port *p = &dln2_spi_bitbang_ports[port];
+  uint32_t count = dln2_gpio_drv_count();
+
+  if (!dln2_gpio_drv_has_delay() || m->sck_pin >= count ||
+      m->mosi_pin >= count ||
+      (m->miso_pin != DLN2_SPI_BITBANG_PIN_NONE && m->miso_pin >= count))
+    return false;
+
+  p->sck = m->sck_pin;
+  p->mosi = m->mosi_pin;
+  p->miso = m->miso_pin;
+  if (!dln2_spi_bitbang_set_format(port, m->mode, m->bpw ? m->bpw : 8))
+    return false;
+  dln2_spi_bitbang_set_freq(port, m->freq);
+
+  dln2_gpio_drv_init(p->sck);
+  dln2_gpio_drv_put(p->sck, p->mode & DLN2_SPI_BITBANG_CPOL);
+  dln2_gpio_drv_set_dir(p->sck, true);
+  dln2_gpio_drv_init(p->mosi);
+  dln2_gpio_drv_put(p->mosi, false);
+  dln2_gpio_drv_set_dir(p->mosi, true);
+  if (p->miso != DLN2_SPI_BITBANG_PIN_NONE)
+    dln2_gpio_drv_init(p->miso);
+
+  p->enabled = true;
+  LOG_INFO("SPI bit-bang port %u: sck=%u mosi=%u miso=%u %luHz\n", port,
+           p->sck, p->mosi, p->miso, (unsigned long)(500000 / p->half_us));
+
+  return true;
+}
+
+static void dln2_spi_bitbang_disable(uint8_t port) {
+  struct dln2_spi_bitbang_port *p = &dln2_spi_bitbang_ports[port];
+
+  if (!p->enabled)
+    return;
+
+  dln2_gpio_drv_deinit(p->sck);
+  dln2_gpio_drv_deinit(p->mosi);
+  if (p->miso != DLN2_SPI_BITBANG_PIN_NONE)
+    dln2_gpio_drv_deinit(p->miso);
+  p->enabled = false;
+}
+
+static bool dln2_spi_bitbang_transfer(uint8_t port, const uint8_t *tx,
+                                      uint8_t *rx, uint16_t len) {
+  struct dln2_spi_bitbang_port *p = &dln2_spi_bitbang_ports[port];
+  uint16_t step = p->bpw > 8 ? 2 : 1;
+
+  if (!p->enabled || len % step)
+    return false;
+
+  for (uint16_t i = 0; i < len; i += step) {
+    uint16_t out = 0, in;
+
+    if (tx)
+      out = step == 2 ? tx[i] | tx[i + 1] << 8 : tx[i];
+    in = dln2_spi_bitbang_frame(p, out);
+    if (rx) {
+      rx[i] = in;
+      if (step == 2)
+        rx[i + 1] = in >> 8;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * The combined driver, hardware ports first. The bit-banged functions above
+ * take the port number within the bit-banged ports.
+ */
+
+static inline bool dln2_spi_is_hw(uint8_t port) {
+  return port < dln2_spi_bitbang_hw_count;
+}
+
+static bool dln2_spi_combined_enable(uint8_t port) {
+  if (dln2_spi_is_hw(port))
+    return dln2_spi_bitbang_hw->enable(port);
+  return dln2_spi_bitbang_enable(port - dln2_spi_bitbang_hw_count);
+}
+
+static void dln2_spi_combined_disable(uint8_t port) {
+  if (dln2_spi_is_hw(port))
+    dln2_spi_bitbang_hw->disable(port);
+  else
+    dln2_spi_bitbang_disable(port - dln2_spi_bitbang_hw_count);
+}
+
+static uint32_t dln2_spi_combined_set_freq(uint8_t port, uint32_t freq_hz) {
+  if (dln2_spi_is_hw(port))
+    return dln2_spi_bitbang_hw->set_freq(port, freq_hz);
+  return dln2_spi_bitbang_set_freq(port - dln2_spi_bitbang_hw_count, freq_hz);
+}
+
+static uint32_t dln2_spi_combined_get_min_freq(uint8_t port) {
+  if (dln2_spi_is_hw(port))
+    return dln2_spi_bitbang_hw->get_min_freq
+               ? dln2_spi_bitbang_hw->get_min_freq(port)
+               : dln2_spi_bitbang_master[port].freq;
+  return dln2_spi_bitbang_get_min_freq(port - dln2_spi_bitbang_hw_count);
+}
+
+static uint32_t dln2_spi_combined_get_max_freq(uint8_t port) {
+  if (dln2_spi_is_hw(port))
+    return dln2_spi_bitbang_hw->get_max_freq
+               ? dln2_spi_bitbang_hw->get_max_freq(port)
+               : dln2_spi_bitbang_master[port].freq;
+  return dln2_spi_bitbang_get_max_freq(port - dln2_spi_bitbang_hw_count);
+}
+
+static bool dln2_spi_combined_set_format(uint8_t port, uint8_t mode,
+                                         uint8_t bpw) {
+  if (dln2_spi_is_hw(port))
+    return dln2_spi_bitbang_hw->set_format(port, mode, bpw);
+  return dln2_spi_bitbang_set_format(port - dln2_spi_bitbang_hw_count, mode,
+                                     bpw);
+}
+
+static bool dln2_spi_combined_transfer(uint8_t port, const uint8_t *tx,
+                                       uint8_t *rx, uint16_t len) {
+  if (dln2_spi_is_hw(port))
+    return dln2_spi_bitbang_hw->transfer(port, tx, rx, len);
+  return dln2_spi_bitbang_transfer(port - dln2_spi_bitbang_hw_count, tx, rx,
+                                   len);
+}
+
+static bool dln2_spi_combined_set_cs(uint8_t port, uint8_t cs, bool active) {
+  if (dln2_spi_is_hw(port) && dln2_spi_bitbang_hw->set_cs)
+    return dln2_spi_bitbang_hw->set_cs(port, cs, active);
+  return false;
+}
+
+static bool dln2_spi_combined_set_cs_timing(uint8_t port, uint32_t setup_ns,
+                                            uint32_t gap_ns) {
+  if (dln2_spi_is_hw(port) && dln2_spi_bitbang_hw->set_cs_timing)
+    return dln2_spi_bitbang_hw->set_cs_timing(port, setup_ns, gap_ns);
+  return false;
+}
+
+static bool dln2_spi_combined_submit(uint8_t port, const uint8_t *tx,
+                                     uint8_t *rx, uint16_t len,
+                                     spi_master_done_t done, void *ctx) {
+  if (dln2_spi_is_hw(port) && dln2_spi_bitbang_hw->submit)
+    return dln2_spi_bitbang_hw->submit(port, tx, rx, len, done, ctx);
+  return false;
+}
+
+struct spi_master_driver *
+dln2_spi_bitbang_attach(struct spi_master_driver *hw,
+                        const struct spi_master *master, uint8_t count) {
+  uint8_t hw_count = hw ? hw->master_count : 0;
+
+  if (!count)
+    return hw;
+
+  if (hw_count > DLN2_SPI_MAX_PORTS)
+    hw_count = DLN2_SPI_MAX_PORTS;
+  if (count > DLN2_SPI_MAX_PORTS - hw_count) {
+    LOG_WARN("SPI: only %u bit-banged ports fit\n",
+             DLN2_SPI_MAX_PORTS - hw_count);
+    count = DLN2_SPI_MAX_PORTS - hw_count;
+  }
+
+  for (uint8_t i = 0; i < hw_count; i++)
+    dln2_spi_bitbang_master[i] = hw->master[i];
+  for (uint8_t i = 0; i < count; i++) {
+    dln2_spi_bitbang_master[hw_count + i] = master[i];
+    dln2_spi_bitbang_ports[i].enabled = false;
+  }
+
+  dln2_spi_bitbang_hw = hw;
+  dln2_spi_bitbang_hw_count = hw_count;
+
+  dln2_spi_bitbang_driver = (struct spi_master_driver){
+      .master_count = hw_count + count,
+      .master = dln2_spi_bitbang_master,
+      .init = hw ? hw->init : NULL,
+      .enable = dln2_spi_combined_enable,
+      .disable = dln2_spi_combined_disable,
+      .set_freq = dln2_spi_combined_set_freq,
+      .get_min_freq = dln2_spi_combined_get_min_freq,
+      .get_max_freq = dln2_spi_combined_get_max_freq,
+      .set_format = dln2_spi_combined_set_format,
+      .transfer = dln2_spi_combined_transfer,
+      .set_cs = dln2_spi_combined_set_cs,
+      .set_cs_timing = dln2_spi_combined_set_cs_timing,
+      // The cycle counter isn't tied to a port
+      .delay_ns = hw ? hw->delay_ns : NULL,
+      .submit = dln2_spi_combined_submit,
+  };
+
+  return &dln2_spi_bitbang_driver;
+}
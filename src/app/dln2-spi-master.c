@@ -11,20 +11,25 @@
  * <http://creativecommons.org/publicdomain/zero/1.0/>.
  */
 
+#include "dln2-gpio.h"
 #include "dln2.h"
-#include "hardware/clocks.h"
-#include "hardware/gpio.h"
-#include "hardware/spi.h"
+#include "dln2_log.h"
+#include "spi_master_driver.h"
 #include <stdint.h>
-#include <stdio.h>
+#include <string.h>
 
-#define LOG1 // printf
+// Per-command, per-transfer and CS tracing, compiled out unless asked for
+#ifdef DLN2_SPI_MASTER_DEBUG
+#define LOG1 LOG_DEBUG
+#else
+#define LOG1(...)
+#endif
 
 #define DLN2_SPI_DEFAULT_FREQUENCY (1 * 1000 * 1000) // 1MHz
 
 #define DLN2_SPI_CMD(cmd) DLN2_CMD(cmd, DLN2_MODULE_SPI_MASTER)
 
-/* SPI commands used by the Linux driver */
+/* SPI commands used by the Linux driver, and the DLN delay settings */
 #define DLN_SPI_MASTER_GET_PORT_COUNT DLN2_SPI_CMD(0x00)
 #define DLN2_SPI_ENABLE DLN2_SPI_CMD(0x11)
 #define DLN2_SPI_DISABLE DLN2_SPI_CMD(0x12)
@@ -34,6 +39,12 @@
 #define DLN2_SPI_READ_WRITE DLN2_SPI_CMD(0x1A)
 #define DLN2_SPI_READ DLN2_SPI_CMD(0x1B)
 #define DLN2_SPI_WRITE DLN2_SPI_CMD(0x1C)
+#define DLN2_SPI_SET_DELAY_BETWEEN_SS DLN2_SPI_CMD(0x20)
+#define DLN2_SPI_GET_DELAY_BETWEEN_SS DLN2_SPI_CMD(0x21)
+#define DLN2_SPI_SET_DELAY_AFTER_SS DLN2_SPI_CMD(0x22)
+#define DLN2_SPI_GET_DELAY_AFTER_SS DLN2_SPI_CMD(0x23)
+#define DLN2_SPI_SET_DELAY_BETWEEN_FRAMES DLN2_SPI_CMD(0x24)
+#define DLN2_SPI_GET_DELAY_BETWEEN_FRAMES DLN2_SPI_CMD(0x25)
 #define DLN2_SPI_SET_SS DLN2_SPI_CMD(0x26)
 #define DLN2_SPI_SS_MULTI_ENABLE DLN2_SPI_CMD(0x38)
 #define DLN2_SPI_SS_MULTI_DISABLE DLN2_SPI_CMD(0x39)
@@ -48,79 +59,221 @@
 #define DLN2_SPI_MAX_XFER_SIZE 256
 #define DLN2_SPI_ATTR_LEAVE_SS_LOW (1 << 0)
 
+// Hardware and bit-banged ports together
+#define DLN2_SPI_MAX_PORTS 8
+#define DLN2_SPI_PIN_NONE 0xffff
+
+// Chip selects a port can have, one bit each in the SS masks
+#define DLN2_SPI_MAX_SS 8
+
+// Longest delay setting, the delays are busy waits
+#define DLN2_SPI_MAX_DELAY_NS (1000 * 1000)
+
 #define div_round_up(n, d) (((n) + (d) - 1) / (d))
 
-static uint8_t dln2_spi_tmp_buf[DLN2_SPI_MAX_XFER_SIZE];
+/*
+ * The READ, WRITE or READ_WRITE command in flight on a port. With a driver
+ * that can submit transfers the data moves by DMA straight between the slot
+ * and the controller, and the slot is answered from dln2_spi_master_task().
+ * Commands for the port arriving in the meantime wait in its deferred queue
+ * to keep their order.
+ */
+struct dln2_spi_master_async {
+  struct dln2_slot *slot;
+  uint8_t attr;
+  uint16_t rsp_len; // response size on success
+  volatile bool done;
+  volatile bool ok;
+};
+
+/*
+ * The host's settings for a port. They are kept here and applied on
+ * enable, the Linux driver disables the port while it changes them.
+ *
+ * The delays are in nanoseconds. When all selected chip selects are driven
+ * by the controller and it accepts the setup and frame gap delays, they are
+ * timed in hardware (hw_timing). Otherwise they are busy waits around the
+ * transfer, and a frame gap splits it into one transfer per frame.
+ */
+struct dln2_spi_master_port {
+  bool enabled;
+  uint8_t mode;
+  uint8_t bpw;
+  uint32_t freq;
+  uint8_t cs_selected; // chip selects toggled around transfers
+  uint8_t cs_enabled;  // chip selects enabled by the host
+  uint8_t cs_gpio;     // enabled chip selects driven as GPIOs
+  bool cs_asserted;    // left low by DLN2_SPI_ATTR_LEAVE_SS_LOW
+  uint32_t delay_after_ss; // 0 is half a clock period
+  uint32_t delay_between_ss;
+  uint32_t delay_between_frames;
+  bool hw_timing;
+  struct dln2_spi_master_async async;
+  struct dln2_slot_queue deferred;
+};
+
+static struct spi_master_driver *_spi_driver;
+static struct dln2_spi_master_port dln2_spi_ports[DLN2_SPI_MAX_PORTS];
+
+static inline bool dln2_spi_valid_port(uint8_t port) {
+  return _spi_driver && port < _spi_driver->master_count;
+}
+
+static uint32_t dln2_spi_min_frequency(uint8_t port) {
+  if (_spi_driver->get_min_freq)
+    return _spi_driver->get_min_freq(port);
+  return _spi_driver->master[port].freq;
+}
+
+static uint32_t dln2_spi_max_frequency(uint8_t port) {
+  if (_spi_driver->get_max_freq)
+    return _spi_driver->get_max_freq(port);
+  return _spi_driver->master[port].freq;
+}
+
+static uint16_t dln2_spi_ss_count(uint8_t port) {
+  uint16_t count = _spi_driver->master[port].slave_count;
+
+  return count < DLN2_SPI_MAX_SS ? count : DLN2_SPI_MAX_SS;
+}
+
+// Both delay ops are optional, without either there are no software delays
+static void dln2_spi_delay_ns(uint32_t ns) {
+  if (!ns)
+    return;
+
+  if (_spi_driver->delay_ns)
+    _spi_driver->delay_ns(ns);
+  else if (dln2_gpio_drv_has_delay())
+    dln2_gpio_drv_delay_us(div_round_up(ns, 1000));
+}
+
+// The delay dln2_spi_delay_ns() produces for a requested one
+static uint32_t dln2_spi_delay_actual(uint32_t ns) {
+  if (ns > DLN2_SPI_MAX_DELAY_NS)
+    ns = DLN2_SPI_MAX_DELAY_NS;
+  if (!_spi_driver->delay_ns)
+    ns = dln2_gpio_drv_has_delay() ? div_round_up(ns, 1000) * 1000 : 0;
+
+  return ns;
+}
+
+static uint32_t dln2_spi_after_ss_ns(struct dln2_spi_master_port *p) {
+  if (p->delay_after_ss || !p->freq)
+    return p->delay_after_ss;
+
+  return div_round_up(500000000, p->freq);
+}
+
+// Hand the delays to the controller if it drives all the selected lines
+static void dln2_spi_update_timing(uint8_t port) {
+  struct dln2_spi_master_port *p = &dln2_spi_ports[port];
+  uint8_t cs = p->cs_selected & p->cs_enabled;
+
+  p->hw_timing = false;
+  if (!p->enabled || !_spi_driver->set_cs_timing || !cs || (cs & p->cs_gpio))
+    return;
+
+  p->hw_timing = _spi_driver->set_cs_timing(port, dln2_spi_after_ss_ns(p),
+                                            p->delay_between_frames);
+}
+
+static void dln2_spi_cs_active(uint8_t port, bool active) {
+  struct dln2_spi_master_port *p = &dln2_spi_ports[port];
+  struct spi_master *m = &_spi_driver->master[port];
+  uint8_t mask = p->cs_selected & p->cs_enabled;
+
+  if (!mask || active == p->cs_asserted)
+    return;
+  p->cs_asserted = active;
+
+  LOG1("CS=%s mask=0x%02x", active ? "activate" : "deactivate", mask);
 
-struct spi_master_driver *_spi_driver;
-struct gpio_master_driver *_gpio_driver;
+  // Hold the lines half a clock period past the last edge
+  if (!active && !p->hw_timing && p->freq)
+    dln2_spi_delay_ns(div_round_up(500000000, p->freq));
+
+  for (uint8_t cs = 0; cs < DLN2_SPI_MAX_SS; cs++) {
+    if (!(mask & (1 << cs)))
+      continue;
+    if (p->cs_gpio & (1 << cs))
+      dln2_gpio_drv_put(m->slave[cs].cs_pin, !active);
+    else
+      _spi_driver->set_cs(port, cs, active);
+  }
+
+  // http://dlnware.com/dll/DlnSpiMasterSetDelayAfterSS
+  if (active && !p->hw_timing)
+    dln2_spi_delay_ns(dln2_spi_after_ss_ns(p));
+  else if (!active)
+    dln2_spi_delay_ns(p->delay_between_ss);
+}
 
 static bool dln2_spi_enable(struct dln2_slot *slot, bool enable) {
   uint8_t *port = dln2_slot_header_data(slot);
   // wait_for_completion is always DLN2_TRANSFERS_WAIT_COMPLETE in the Linux
-  // driver
+  // driver, transfers are over when a command gets here
   // uint8_t *wait_for_completion = dln2_slot_header_data(slot) + 1;
-  struct spi_master defined_spi = _spi_driver->master + &port;
-  uint sck = defined_spi->sck_pin;
-  uint mosi = defined_spi->mosi_pin;
-  uint miso = defined_spi->miso_pin;
   int res;
 
-  LOG1("%s: port=%u\n", enable ? "DLN2_SPI_ENABLE" : "DLN2_SPI_DISABLE", *port);
+  LOG1("%s: port=%u", enable ? "DLN2_SPI_ENABLE" : "DLN2_SPI_DISABLE",
+       *port);
 
   if (enable)
     DLN2_VERIFY_COMMAND_SIZE(slot, 1);
   else
     DLN2_VERIFY_COMMAND_SIZE(slot, 2);
 
-  if (*port)
+  if (!dln2_spi_valid_port(*port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
-  if (enable) {
-    res = dln2_pin_request(sck, DLN2_MODULE_SPI_MASTER);
-    if (res)
-      return dln2_response_error(slot, res);
+  struct spi_master *m = &_spi_driver->master[*port];
+  struct dln2_spi_master_port *p = &dln2_spi_ports[*port];
 
-    res = dln2_pin_request(mosi, DLN2_MODULE_SPI_MASTER);
-    if (res) {
-      dln2_pin_free(sck, DLN2_MODULE_SPI_MASTER);
-      return dln2_response_error(slot, res);
-    }
+  if (p->enabled == enable)
+    return dln2_response(slot, 0);
+
+  DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX) = {0};
+  struct dln2_pin_conflict conflict;
 
-    res = dln2_pin_request(miso, DLN2_MODULE_SPI_MASTER);
+  if (!dln2_pin_mask_add(pins, m->sck_pin) ||
+      !dln2_pin_mask_add(pins, m->mosi_pin) ||
+      (m->miso_pin != DLN2_SPI_PIN_NONE &&
+       !dln2_pin_mask_add(pins, m->miso_pin)))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
+
+  if (enable) {
+    res = dln2_pin_group_request(pins, DLN2_MODULE_SPI_MASTER, &conflict);
     if (res) {
-      dln2_pin_free(sck, DLN2_MODULE_SPI_MASTER);
-      dln2_pin_free(mosi, DLN2_MODULE_SPI_MASTER);
+      LOG1("SPI: pin %u in use by module 0x%02x", conflict.pin,
+           conflict.module);
       return dln2_response_error(slot, res);
     }
 
-    uint freq = _spi_driver->init(defined_spi);
-    LOG1("SPI: actual frequency: %uHz\n", freq);
-
-    spi_set_format(spi_default, dln2_spi_config.bpw,
-                   dln2_spi_config.mode & DLN2_SPI_CPOL,
-                   dln2_spi_config.mode & DLN2_SPI_CPHA, SPI_MSB_FIRST);
-
-    gpio_set_function(sck, GPIO_FUNC_SPI);
-    gpio_set_function(mosi, GPIO_FUNC_SPI);
-    gpio_set_function(miso, GPIO_FUNC_SPI);
+    // enable() starts from master[port], then the host's settings apply
+    if (!_spi_driver->enable(*port) ||
+        !_spi_driver->set_format(*port, p->mode, p->bpw)) {
+      LOG1("SPI: port %u failed to enable", *port);
+      _spi_driver->disable(*port);
+      dln2_pin_group_free(pins, DLN2_MODULE_SPI_MASTER, NULL);
+      return dln2_response_error(slot, DLN2_RES_FAIL);
+    }
+    p->freq = _spi_driver->set_freq(*port, p->freq);
+    LOG1("SPI: actual frequency: %luHz", (unsigned long)p->freq);
   } else {
-    res = dln2_pin_free(sck, DLN2_MODULE_SPI_MASTER);
-    if (res)
-      return dln2_response_error(slot, res);
-    gpio_set_function(sck, GPIO_FUNC_NULL);
-
-    res = dln2_pin_free(mosi, DLN2_MODULE_SPI_MASTER);
-    if (res)
-      return dln2_response_error(slot, res);
-    gpio_set_function(mosi, GPIO_FUNC_NULL);
-
-    res = dln2_pin_free(miso, DLN2_MODULE_SPI_MASTER);
-    if (res)
+    res = dln2_pin_group_free(pins, DLN2_MODULE_SPI_MASTER, &conflict);
+    if (res) {
+      LOG1("SPI: pin %u owned by module 0x%02x", conflict.pin,
+           conflict.module);
       return dln2_response_error(slot, res);
-    gpio_set_function(miso, GPIO_FUNC_NULL);
+    }
+    dln2_spi_cs_active(*port, false);
+    _spi_driver->disable(*port);
   }
 
+  p->enabled = enable;
+  dln2_spi_update_timing(*port);
+
   return dln2_response(slot, 0);
 }
 
@@ -133,15 +286,20 @@ static bool dln2_spi_set_mode(struct dln2_slot *slot) {
 
   DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
 
-  LOG1("DLN2_SPI_SET_MODE: port=%u mode=0x%02x\n", cmd->port, cmd->mode);
+  LOG1("DLN2_SPI_SET_MODE: port=%u mode=0x%02x", cmd->port, cmd->mode);
 
-  if (cmd->port)
+  if (!dln2_spi_valid_port(cmd->port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
+  struct dln2_spi_master_port *p = &dln2_spi_ports[cmd->port];
+
   if (cmd->mode & ~mask)
     return dln2_response_error(slot, DLN2_RES_INVALID_MODE);
 
-  dln2_spi_config.mode = cmd->mode;
+  if (p->enabled && !_spi_driver->set_format(cmd->port, cmd->mode, p->bpw))
+    return dln2_response_error(slot, DLN2_RES_INVALID_MODE);
+
+  p->mode = cmd->mode;
 
   return dln2_response(slot, 0);
 }
@@ -154,30 +312,23 @@ static bool dln2_spi_set_bpw(struct dln2_slot *slot) {
 
   DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
 
-  LOG1("DLN2_SPI_SET_BPW: port=%u bpw=%u\n", cmd->port, cmd->bpw);
+  LOG1("DLN2_SPI_SET_BPW: port=%u bpw=%u", cmd->port, cmd->bpw);
 
-  if (cmd->port)
+  if (!dln2_spi_valid_port(cmd->port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
-  // TODO: verify
-  // DLN2_RES_SPI_INVALID_FRAME_SIZE
-  dln2_spi_config.bpw = cmd->bpw;
+  struct dln2_spi_master_port *p = &dln2_spi_ports[cmd->port];
 
-  return dln2_response(slot, 0);
-}
+  // The range reported by GET_SUPPORTED_FRAME_SIZES
+  if (cmd->bpw < 4 || cmd->bpw > 16)
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
 
-static uint dln2_spi_min_frequency(void) {
-  uint freq_in = clock_get_hz(clk_peri);
-  uint prescale = 254, postdiv = 256;
+  if (p->enabled && !_spi_driver->set_format(cmd->port, p->mode, cmd->bpw))
+    return dln2_response_error(slot, DLN2_RES_INVALID_VALUE);
 
-  return freq_in / (prescale * postdiv);
-}
-
-static uint dln2_spi_max_frequency(void) {
-  uint freq_in = clock_get_hz(clk_peri);
-  uint prescale = 2, postdiv = 1;
+  p->bpw = cmd->bpw;
 
-  return freq_in / (prescale * postdiv);
+  return dln2_response(slot, 0);
 }
 
 static bool dln2_spi_set_frequency(struct dln2_slot *slot) {
@@ -185,42 +336,106 @@ static bool dln2_spi_set_frequency(struct dln2_slot *slot) {
     uint8_t port;
     uint32_t speed;
   } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
-  uint32_t speed;
+  uint32_t speed, min, max;
 
   DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
 
-  LOG1("DLN2_SPI_SET_FREQUENCY: port=%u speed=%u\n", cmd->port, cmd->speed);
+  LOG1("DLN2_SPI_SET_FREQUENCY: port=%u speed=%lu", cmd->port,
+       (unsigned long)cmd->speed);
 
-  if (cmd->port)
+  if (!dln2_spi_valid_port(cmd->port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
-  if (cmd->speed < dln2_spi_min_frequency())
-    cmd->speed = dln2_spi_min_frequency();
-  else if (cmd->speed > dln2_spi_max_frequency())
-    cmd->speed = dln2_spi_max_frequency();
+  min = dln2_spi_min_frequency(cmd->port);
+  max = dln2_spi_max_frequency(cmd->port);
+  speed = cmd->speed;
+  if (speed < min)
+    speed = min;
+  else if (speed > max)
+    speed = max;
 
-  speed = spi_set_baudrate(spi_default, cmd->speed);
-  LOG1("SPI: actual frequency: %uHz\n", speed);
-  dln2_spi_config.freq = speed;
+  speed = _spi_driver->set_freq(cmd->port, speed);
+  LOG1("SPI: actual frequency: %luHz", (unsigned long)speed);
+  dln2_spi_ports[cmd->port].freq = speed;
+  dln2_spi_update_timing(cmd->port);
 
   // The Linux driver ignores the returned value
   return dln2_response_u32(slot, speed);
 }
 
-static void dln2_spi_cs_active(bool active) {
-  // http://dlnware.com/dll/DlnSpiMasterSetDelayAfterSS
-  // With a 0ns delay time, the actual delay will be equal to 1/2 of the SPI
-  // clock frequency
-  uint64_t us = div_round_up(dln2_spi_config.freq, 2 * 1000000);
-  LOG1("    CS=%s wait=%llu\n", active ? "activate" : "deactivate", us);
+// One transfer per frame with the frame gap between them
+static bool dln2_spi_transfer_frames(uint8_t port, const uint8_t *tx,
+                                     uint8_t *rx, uint16_t len) {
+  struct dln2_spi_master_port *p = &dln2_spi_ports[port];
+  uint16_t step = p->bpw > 8 ? 2 : 1;
+
+  for (uint16_t i = 0; i < len; i += step) {
+    if (i)
+      dln2_spi_delay_ns(p->delay_between_frames);
+    if (!_spi_driver->transfer(port, tx ? tx + i : NULL, rx ? rx + i : NULL,
+                               len - i < step ? len - i : step))
+      return false;
+  }
 
-  if (!active)
-    sleep_us(us);
+  return true;
+}
+
+static bool dln2_spi_finish(struct dln2_slot *slot, uint8_t port, bool ok,
+                            uint8_t attr, uint16_t rsp_len) {
+  if (!ok || !(attr & DLN2_SPI_ATTR_LEAVE_SS_LOW))
+    dln2_spi_cs_active(port, false);
+
+  if (!ok)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
 
-  gpio_put(PICO_DEFAULT_SPI_CSN_PIN, !active);
+  return dln2_response(slot, rsp_len);
+}
+
+// Driver callback, may run in interrupt context
+static void dln2_spi_done(uint8_t port, bool ok, void *ctx) {
+  struct dln2_spi_master_async *async = ctx;
 
-  if (active)
-    sleep_us(us);
+  (void)port;
+  async->ok = ok;
+  async->done = true;
+}
+
+/*
+ * Run a transfer between slot buffers, in the background if the driver can.
+ * The command and response payloads both start 12 bytes into the slot, so a
+ * full duplex transfer receives in place over the data it sends.
+ */
+static bool dln2_spi_start(struct dln2_slot *slot, uint8_t port,
+                           const uint8_t *tx, uint8_t *rx, uint16_t len,
+                           uint8_t attr, uint16_t rsp_len) {
+  struct dln2_spi_master_port *p = &dln2_spi_ports[port];
+  struct dln2_spi_master_async *async = &p->async;
+  bool ok;
+
+  if (!p->enabled)
+    return dln2_response_error(slot, DLN2_RES_FAIL);
+
+  async->attr = attr;
+  async->rsp_len = rsp_len;
+  async->done = false;
+
+  dln2_spi_cs_active(port, true);
+
+  if (p->delay_between_frames && !p->hw_timing) {
+    ok = dln2_spi_transfer_frames(port, tx, rx, len);
+    return dln2_spi_finish(slot, port, ok, attr, rsp_len);
+  }
+
+  if (_spi_driver->submit) {
+    async->slot = slot;
+    if (_spi_driver->submit(port, tx, rx, len, dln2_spi_done, async))
+      return true;
+    async->slot = NULL;
+  }
+
+  ok = _spi_driver->transfer(port, tx, rx, len);
+
+  return dln2_spi_finish(slot, port, ok, attr, rsp_len);
 }
 
 static bool dln2_spi_read_write(struct dln2_slot *slot) {
@@ -230,37 +445,31 @@ static bool dln2_spi_read_write(struct dln2_slot *slot) {
     uint8_t attr;
     uint8_t buf[DLN2_SPI_MAX_XFER_SIZE];
   } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
-  uint8_t attr = cmd->attr;
   uint16_t *size = dln2_slot_response_data(slot);
   uint8_t *buf = dln2_slot_response_data(slot) + sizeof(*size);
+  uint8_t port = cmd->port;
+  uint8_t attr = cmd->attr;
+  uint16_t len = cmd->size;
 
-  size_t len = dln2_slot_header_data_size(slot);
-  if (len < 4)
+  size_t cmd_len = dln2_slot_header_data_size(slot);
+  if (cmd_len < 4)
     return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
 
-  LOG1("DLN2_SPI_READ_WRITE: port=%u size=%u attr=0x%02x\n", cmd->port,
-       cmd->size, cmd->attr);
+  LOG1("DLN2_SPI_READ_WRITE: port=%u size=%u attr=0x%02x", port, len,
+       attr);
 
-  if (cmd->port)
+  if (!dln2_spi_valid_port(port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
-  if (cmd->size > DLN2_SPI_MAX_XFER_SIZE)
+  if (len > DLN2_SPI_MAX_XFER_SIZE)
     return dln2_response_error(slot, DLN2_RES_BAD_PARAMETER);
-  if (cmd->size != (len - 4))
+  if (len != (cmd_len - 4))
     return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
 
-  dln2_spi_cs_active(true);
-
-  // The buffer addresses are 32-bit aligned and can be used directly.
-  // It looks like txbuf can move ahead 8 bytes on rxbuf so we can't use buf
-  // directly
-  spi_write_read_blocking(spi_default, cmd->buf, dln2_spi_tmp_buf, cmd->size);
-
-  if (!(attr & DLN2_SPI_ATTR_LEAVE_SS_LOW))
-    dln2_spi_cs_active(false);
-
-  memcpy(buf, dln2_spi_tmp_buf, cmd->size);
+  // Overwrites size and attr in the command, buf is at the same address
+  put_unaligned_le16(len, size);
 
-  return dln2_response(slot, sizeof(uint16_t) + cmd->size);
+  return dln2_spi_start(slot, port, cmd->buf, buf, len, attr,
+                        sizeof(uint16_t) + len);
 }
 
 static bool dln2_spi_read(struct dln2_slot *slot) {
@@ -269,31 +478,24 @@ static bool dln2_spi_read(struct dln2_slot *slot) {
     uint16_t size;
     uint8_t attr;
   } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
-  size_t len = cmd->size;
-  uint8_t attr = cmd->attr;
   uint16_t *size = dln2_slot_response_data(slot);
   uint8_t *buf = dln2_slot_response_data(slot) + sizeof(*size);
+  uint8_t port = cmd->port;
+  uint8_t attr = cmd->attr;
+  uint16_t len = cmd->size;
 
   DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
-  LOG1("DLN2_SPI_READ: port=%u size=%zu attr=0x%02x\n", cmd->port, len,
-       cmd->attr);
+  LOG1("DLN2_SPI_READ: port=%u size=%u attr=0x%02x", port, len, attr);
 
-  if (cmd->port)
+  if (!dln2_spi_valid_port(port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
   if (len > DLN2_SPI_MAX_XFER_SIZE)
     return dln2_response_error(slot, DLN2_RES_BAD_PARAMETER);
 
   put_unaligned_le16(len, size);
 
-  dln2_spi_cs_active(true);
-
-  // The buffer address is 32-bit aligned and can be used directly
-  spi_read_blocking(spi_default, 0, buf, len);
-
-  if (!(attr & DLN2_SPI_ATTR_LEAVE_SS_LOW))
-    dln2_spi_cs_active(false);
-
-  return dln2_response(slot, sizeof(uint16_t) + len);
+  return dln2_spi_start(slot, port, NULL, buf, len, attr,
+                        sizeof(uint16_t) + len);
 }
 
 static bool dln2_spi_write(struct dln2_slot *slot) {
@@ -308,25 +510,22 @@ static bool dln2_spi_write(struct dln2_slot *slot) {
   if (len < 4)
     return dln2_response_error(slot, DLN2_RES_INVALID_COMMAND_SIZE);
 
-  LOG1("DLN2_SPI_WRITE: port=%u size=%u attr=0x%02x\n", cmd->port, cmd->size,
+  LOG1("DLN2_SPI_WRITE: port=%u size=%u attr=0x%02x", cmd->port, cmd->size,
        cmd->attr);
 
-  if (cmd->port)
+  if (!dln2_spi_valid_port(cmd->port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
   if (cmd->size > DLN2_SPI_MAX_XFER_SIZE)
     return dln2_response_error(slot, DLN2_RES_BAD_PARAMETER);
   if (cmd->size != (len - 4))
     return dln2_response_error(slot, DLN2_RES_INVALID_BUFFER_SIZE);
 
-  dln2_spi_cs_active(true);
-
-  // The buffer address is 32-bit aligned and can be used directly
-  spi_write_blocking(spi_default, cmd->buf, cmd->size);
-
-  if (!(cmd->attr & DLN2_SPI_ATTR_LEAVE_SS_LOW))
-    dln2_spi_cs_active(false);
+  return dln2_spi_start(slot, cmd->port, cmd->buf, NULL, cmd->size, cmd->attr,
+                        0);
+}
 
-  return dln2_response(slot, 0);
+static inline uint8_t dln2_spi_ss_valid(uint8_t port) {
+  return (1 << dln2_spi_ss_count(port)) - 1;
 }
 
 static bool dln2_spi_set_ss(struct dln2_slot *slot) {
@@ -337,15 +536,20 @@ static bool dln2_spi_set_ss(struct dln2_slot *slot) {
 
   DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
 
-  LOG1("DLN2_SPI_SET_SS: port=%u cs_mask=0x%02x\n", cmd->port, cmd->cs_mask);
+  LOG1("DLN2_SPI_SET_SS: port=%u cs_mask=0x%02x", cmd->port, cmd->cs_mask);
 
-  if (cmd->port)
+  if (!dln2_spi_valid_port(cmd->port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
-  if (cmd->cs_mask & 0xFE != 0xFE)
+  // The selected chip selects are the cleared bits
+  uint8_t valid = dln2_spi_ss_valid(cmd->port);
+  uint8_t selected = ~cmd->cs_mask;
+
+  if (!selected || (selected & ~valid))
     return dln2_response_error(slot, DLN2_RES_SPI_MASTER_INVALID_SS_VALUE);
 
-  // Nothing to do since there's only one chip select
+  dln2_spi_ports[cmd->port].cs_selected = selected;
+  dln2_spi_update_timing(cmd->port);
 
   return dln2_response(slot, 0);
 }
@@ -355,48 +559,131 @@ static bool dln2_spi_ss_multi_enable(struct dln2_slot *slot, bool enable) {
     uint8_t port;
     uint8_t cs_mask;
   } *cmd = dln2_slot_header_data(slot);
-  uint cs = PICO_DEFAULT_SPI_CSN_PIN;
 
   DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
 
-  LOG1("%s: port=%u cs_mask=0x%02x\n",
+  LOG1("%s: port=%u cs_mask=0x%02x",
        enable ? "DLN2_SPI_SS_MULTI_ENABLE" : "DLN2_SPI_SS_MULTI_DISABLE",
        cmd->port, cmd->cs_mask);
 
-  if (cmd->port)
+  if (!dln2_spi_valid_port(cmd->port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
-  if (cmd->cs_mask != 0x01)
+  struct dln2_spi_master_port *p = &dln2_spi_ports[cmd->port];
+  struct spi_master *m = &_spi_driver->master[cmd->port];
+  uint8_t valid = dln2_spi_ss_valid(cmd->port);
+  uint8_t mask;
+  int res;
+
+  if (!cmd->cs_mask || (cmd->cs_mask & ~valid))
     return dln2_response_error(slot, DLN2_RES_SPI_MASTER_INVALID_SS_VALUE);
 
-  if (enable) {
-    int res = dln2_pin_request(cs, DLN2_MODULE_SPI_MASTER);
-    if (res)dln2_spi_init
-      return dln2_response_error(slot, res);
+  // Only the lines that change
+  mask = cmd->cs_mask & (enable ? ~p->cs_enabled : p->cs_enabled);
+  if (!mask)
+    return dln2_response(slot, 0);
 
-    gpio_init(cs);
-    gpio_set_dir(cs, GPIO_OUT);
-    gpio_put(cs, 1);
-  } else {
-    int res = dln2_pin_free(cs, DLN2_MODULE_SPI_MASTER);
-    if (res)
-      return dln2_response_error(slot, res);
+  DLN2_DECLARE_BITMAP(pins, DLN2_PIN_MAX) = {0};
+  struct dln2_pin_conflict conflict;
 
-    gpio_set_function(cs, GPIO_FUNC_NULL);
+  for (uint8_t cs = 0; cs < DLN2_SPI_MAX_SS; cs++) {
+    if ((mask & (1 << cs)) && !dln2_pin_mask_add(pins, m->slave[cs].cs_pin))
+      return dln2_response_error(slot, DLN2_RES_INVALID_PIN_NUMBER);
   }
 
+  if (enable)
+    res = dln2_pin_group_request(pins, DLN2_MODULE_SPI_MASTER, &conflict);
+  else
+    res = dln2_pin_group_free(pins, DLN2_MODULE_SPI_MASTER, &conflict);
+  if (res) {
+    LOG1("SPI: pin %u owned by module 0x%02x", conflict.pin,
+         conflict.module);
+    return dln2_response_error(slot, res);
+  }
+
+  for (uint8_t cs = 0; cs < DLN2_SPI_MAX_SS; cs++) {
+    uint8_t bit = 1 << cs;
+    uint16_t pin = m->slave[cs].cs_pin;
+
+    if (!(mask & bit))
+      continue;
+
+    if (enable) {
+      if (!_spi_driver->set_cs || !_spi_driver->set_cs(cmd->port, cs, false)) {
+        dln2_gpio_drv_init(pin);
+        dln2_gpio_drv_put(pin, true);
+        dln2_gpio_drv_set_dir(pin, true);
+        p->cs_gpio |= bit;
+      }
+      p->cs_enabled |= bit;
+    } else {
+      if (p->cs_gpio & bit)
+        dln2_gpio_drv_deinit(pin);
+      p->cs_gpio &= ~bit;
+      p->cs_enabled &= ~bit;
+    }
+  }
+
+  dln2_spi_update_timing(cmd->port);
+
   return dln2_response(slot, 0);
 }
 
+// The setting a SET or GET delay command is for
+static uint32_t *dln2_spi_delay_field(struct dln2_spi_master_port *p,
+                                      uint16_t id) {
+  switch (id) {
+  case DLN2_SPI_SET_DELAY_BETWEEN_SS:
+  case DLN2_SPI_GET_DELAY_BETWEEN_SS:
+    return &p->delay_between_ss;
+  case DLN2_SPI_SET_DELAY_AFTER_SS:
+  case DLN2_SPI_GET_DELAY_AFTER_SS:
+    return &p->delay_after_ss;
+  default:
+    return &p->delay_between_frames;
+  }
+}
+
+/*
+ * The delay commands share a layout, {port, delay} in and the actual delay
+ * out, the GET commands only take the port.
+ */
+static bool dln2_spi_delay(struct dln2_slot *slot, bool set) {
+  struct {
+    uint8_t port;
+    uint32_t delay;
+  } TU_ATTR_PACKED *cmd = dln2_slot_header_data(slot);
+
+  if (set)
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*cmd));
+  else
+    DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(cmd->port));
+
+  if (!dln2_spi_valid_port(cmd->port))
+    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
+
+  uint32_t *delay = dln2_spi_delay_field(&dln2_spi_ports[cmd->port],
+                                         dln2_slot_header(slot)->id);
+
+  if (set) {
+    LOG1("SPI: port=%u delay=%luns", cmd->port,
+         (unsigned long)cmd->delay);
+    *delay = dln2_spi_delay_actual(cmd->delay);
+    dln2_spi_update_timing(cmd->port);
+  }
+
+  return dln2_response_u32(slot, *delay);
+}
+
 static bool dln2_spi_get_supported_frame_sizes(struct dln2_slot *slot) {
   uint8_t *port = dln2_slot_header_data(slot);
   uint8_t *data = dln2_slot_response_data(slot);
   int i, j;
 
-  LOG1("DLN2_SPI_GET_SUPPORTED_FRAME_SIZES: port=%u\n", *port);
+  LOG1("DLN2_SPI_GET_SUPPORTED_FRAME_SIZES: port=%u", *port);
   DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
 
-  if (*port)
+  if (!dln2_spi_valid_port(*port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
   memset(data, 0, 1 + 36);
@@ -411,60 +698,37 @@ static bool dln2_spi_get_supported_frame_sizes(struct dln2_slot *slot) {
 static bool dln2_spi_get_ss_count(struct dln2_slot *slot) {
   uint8_t *port = dln2_slot_header_data(slot);
 
-  LOG1("DLN2_SPI_GET_SS_COUNT: port=%u\n", *port);
+  LOG1("DLN2_SPI_GET_SS_COUNT: port=%u", *port);
   DLN2_VERIFY_COMMAND_SIZE(slot, sizeof(*port));
 
-  if (*port)
-    return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
-
-  // set defaults
-  dln2_spi_config.freq = DLN2_SPI_DEFAULT_FREQUENCY;
-  dln2_spi_config.bpw = 8;
-
-  return dln2_response_u16(slot, 1);
-}
-
-static uint dln2_spi_get_frequency(struct dln2_slot *slot, uint32_t freq) {
-  struct dln2_header *hdr = dln2_slot_header(slot);
-  uint8_t *port = dln2_slot_header_data(slot);
-
-  LOG1("%s: port=%u freq=%u\n",
-       hdr->id == DLN2_SPI_GET_MIN_FREQUENCY ? "DLN2_SPI_GET_MIN_FREQUENCY"
-                                             : "DLN2_SPI_GET_MAX_FREQUENCY",
-       *port, freq);
-  DLN2_VERIFY_COMMAND_SIZE(slot, 1);
-
-  if (*port)
+  if (!dln2_spi_valid_port(*port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
-  return dln2_response_u32(slot, freq);
+  return dln2_response_u16(slot, dln2_spi_ss_count(*port));
 }
 
-static uint dln2_spi_get_master_count(struct dln2_slot *slot) {
-  struct dln2_header *hdr = dln2_slot_header(slot);
+static bool dln2_spi_get_frequency(struct dln2_slot *slot, bool max) {
   uint8_t *port = dln2_slot_header_data(slot);
 
-  uint8_t count = _spi_driver.master_count;
-
-  LOG1("%s: port=%u freq=%u\n",
-       hdr->id == DLN_SPI_MASTER_GET_PORT_COUNT
-           ? "DLN_SPI_MASTER_GET_PORT_COUNT "
-           : "INVALID",
-       *port, count);
+  LOG1("%s: port=%u",
+       max ? "DLN2_SPI_GET_MAX_FREQUENCY" : "DLN2_SPI_GET_MIN_FREQUENCY",
+       *port);
   DLN2_VERIFY_COMMAND_SIZE(slot, 1);
 
-  if (*port)
+  if (!dln2_spi_valid_port(*port))
     return dln2_response_error(slot, DLN2_RES_INVALID_PORT_NUMBER);
 
-  return dln2_response_u32(slot, count);
+  return dln2_response_u32(slot, max ? dln2_spi_max_frequency(*port)
+                                     : dln2_spi_min_frequency(*port));
 }
 
-bool dln2_handle_spi(struct dln2_slot *slot) {
+static bool dln2_spi_dispatch(struct dln2_slot *slot) {
   struct dln2_header *hdr = dln2_slot_header(slot);
 
   switch (hdr->id) {
   case DLN_SPI_MASTER_GET_PORT_COUNT:
-    return dln2_master_count(slot);
+    LOG1("DLN_SPI_MASTER_GET_PORT_COUNT");
+    return dln2_response_u8(slot, _spi_driver ? _spi_driver->master_count : 0);
   case DLN2_SPI_ENABLE:
     return dln2_spi_enable(slot, true);
   case DLN2_SPI_DISABLE:
@@ -481,6 +745,14 @@ bool dln2_handle_spi(struct dln2_slot *slot) {
     return dln2_spi_read(slot);
   case DLN2_SPI_WRITE:
     return dln2_spi_write(slot);
+  case DLN2_SPI_SET_DELAY_BETWEEN_SS:
+  case DLN2_SPI_SET_DELAY_AFTER_SS:
+  case DLN2_SPI_SET_DELAY_BETWEEN_FRAMES:
+    return dln2_spi_delay(slot, true);
+  case DLN2_SPI_GET_DELAY_BETWEEN_SS:
+  case DLN2_SPI_GET_DELAY_AFTER_SS:
+  case DLN2_SPI_GET_DELAY_BETWEEN_FRAMES:
+    return dln2_spi_delay(slot, false);
   case DLN2_SPI_SET_SS:
     return dln2_spi_set_ss(slot);
   case DLN2_SPI_SS_MULTI_ENABLE:
@@ -492,16 +764,82 @@ bool dln2_handle_spi(struct dln2_slot *slot) {
   case DLN2_SPI_GET_SS_COUNT:
     return dln2_spi_get_ss_count(slot);
   case DLN2_SPI_GET_MIN_FREQUENCY:
-    return dln2_spi_get_frequency(slot, dln2_spi_min_frequency());
+    return dln2_spi_get_frequency(slot, false);
   case DLN2_SPI_GET_MAX_FREQUENCY:
-    return dln2_spi_get_frequency(slot, dln2_spi_max_frequency());
+    return dln2_spi_get_frequency(slot, true);
   default:
-    LOG1("SPI: unknown command 0x%02x\n", hdr->id);
+    LOG1("SPI: unknown command 0x%02x", hdr->id);
     return dln2_response_error(slot, DLN2_RES_COMMAND_NOT_SUPPORTED);
   }
 }
 
+// The port a command is for, or -1 if it has no valid port
+static int dln2_spi_slot_port(struct dln2_slot *slot) {
+  uint8_t *port = dln2_slot_header_data(slot);
+
+  if (dln2_slot_header(slot)->id == DLN_SPI_MASTER_GET_PORT_COUNT)
+    return -1;
+
+  if (!dln2_slot_header_data_size(slot) || !dln2_spi_valid_port(*port))
+    return -1;
+
+  return *port;
+}
+
+bool dln2_handle_spi(struct dln2_slot *slot) {
+  int port = dln2_spi_slot_port(slot);
+
+  if (port >= 0) {
+    struct dln2_spi_master_port *p = &dln2_spi_ports[port];
+
+    if (p->async.slot || p->deferred.head) {
+      LOG1("SPI: transfer in progress on port %d, command deferred", port);
+      dln2_slot_enqueue(&p->deferred, slot);
+      return true;
+    }
+  }
+
+  return dln2_spi_dispatch(slot);
+}
+
+void dln2_spi_master_task(void) {
+  if (!_spi_driver)
+    return;
+
+  for (uint8_t port = 0; port < _spi_driver->master_count; port++) {
+    struct dln2_spi_master_port *p = &dln2_spi_ports[port];
+    struct dln2_spi_master_async *async = &p->async;
+    struct dln2_slot *slot = async->slot;
+
+    if (slot) {
+      if (!async->done)
+        continue;
+      async->slot = NULL;
+      dln2_spi_finish(slot, port, async->ok, async->attr, async->rsp_len);
+    }
+
+    while (!async->slot && (slot = dln2_slot_dequeue(&p->deferred)))
+      dln2_spi_dispatch(slot);
+  }
+}
+
 void dln2_spi_master_init(struct dln2_peripherials *peripherals) {
-  _spi_driver = peripherals->spi;
-  _gpio_driver = peripherals->gpio;
+  _spi_driver = dln2_spi_bitbang_attach(peripherals->spi_master,
+                                        peripherals->spi_bitbang,
+                                        peripherals->spi_bitbang_count);
+  if (!_spi_driver)
+    return;
+  if (_spi_driver->master_count > DLN2_SPI_MAX_PORTS)
+    _spi_driver->master_count = DLN2_SPI_MAX_PORTS;
+
+  for (uint8_t port = 0; port < _spi_driver->master_count; port++) {
+    struct spi_master *m = &_spi_driver->master[port];
+
+    dln2_spi_ports[port] = (struct dln2_spi_master_port){
+        .mode = m->mode,
+        .bpw = m->bpw ? m->bpw : 8,
+        .freq = m->freq ? m->freq : DLN2_SPI_DEFAULT_FREQUENCY,
+        .cs_selected = 0x01,
+    };
+  }
 }
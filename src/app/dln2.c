@@ -31,7 +31,7 @@ static struct dln2_slot_queue dln2_response_queue;
 static struct dln2_slot *dln2_slot_out;
 static struct dln2_slot *dln2_slot_in;
 
-static void dln2_slot_enqueue(struct dln2_slot_queue *queue, struct dln2_slot *slot)
+void dln2_slot_enqueue(struct dln2_slot_queue *queue, struct dln2_slot *slot)
 {
     slot->next = NULL;
 
@@ -47,7 +47,7 @@ static void dln2_slot_enqueue(struct dln2_slot_queue *queue, struct dln2_slot *s
     cursor->next = slot;
 }
 
-static struct dln2_slot *dln2_slot_dequeue(struct dln2_slot_queue *queue)
+struct dln2_slot *dln2_slot_dequeue(struct dln2_slot_queue *queue)
 {
     if (!queue->head)
         return NULL;
@@ -82,6 +82,12 @@ static const char *dln2_handle_names[] = {
     [DLN2_HANDLE_I2C] = "I2C",
     [DLN2_HANDLE_SPI] = "SPI",
     [DLN2_HANDLE_ADC] = "ADC",
+    [DLN2_HANDLE_COUNTER] = "COUNTER",
+    [DLN2_HANDLE_FREQ] = "FREQ",
+    [DLN2_HANDLE_PWM] = "PWM",
+    [DLN2_HANDLE_DAC] = "DAC",
+    [DLN2_HANDLE_ONEWIRE] = "ONEWIRE",
+    [DLN2_HANDLE_PARBUS] = "PARBUS",
 };
 
 void _dln2_print_slot(struct dln2_slot *slot, uint32_t indent, const char *caller)
@@ -277,6 +283,18 @@ static bool dln2_handle(struct dln2_slot *slot)
         return dln2_handle_spi(slot);
     case DLN2_HANDLE_ADC:
         return dln2_handle_adc(slot);
+    case DLN2_HANDLE_COUNTER:
+        return dln2_handle_counter(slot);
+    case DLN2_HANDLE_FREQ:
+        return dln2_handle_freq(slot);
+    case DLN2_HANDLE_PWM:
+        return dln2_handle_pwm(slot);
+    case DLN2_HANDLE_DAC:
+        return dln2_handle_dac(slot);
+    case DLN2_HANDLE_ONEWIRE:
+        return dln2_handle_onewire(slot);
+    case DLN2_HANDLE_PARBUS:
+        return dln2_handle_parbus(slot);
     }
 
     return dln2_response_error(slot, DLN2_RES_INVALID_HANDLE);
@@ -373,13 +391,3 @@ bool dln2_xfer_in(size_t len)
 
     return true;
 }
-
-bool dln2_handle_spi(struct dln2_slot *slot)
-{
-    LOG_INFO("Handle SPI slot ");
-
-    /* Pretend SPI is not ready yet */
-    return false;
-}
-
-
@@ -17,6 +17,7 @@
 #pragma once
 
 #include "common/tusb_common.h"
+#include "dln2_bitmap.h"
 #include "gpio_driver.h"
 #include <stdbool.h>
 #include <stdint.h>
@@ -26,7 +27,13 @@
 #define DLN2_MODULE_SPI_MASTER 0x02
 #define DLN2_MODULE_I2C_MASTER 0x03
 #define DLN2_MODULE_ADC 0x06
+#define DLN2_MODULE_PWM 0x07
+#define DLN2_MODULE_COUNTER 0x0d // DLN pulse counter
 #define DLN2_MODULE_UART 0x0e
+#define DLN2_MODULE_DAC 0x20 // not a DLN module
+#define DLN2_MODULE_ONEWIRE 0x21 // not a DLN module
+#define DLN2_MODULE_PARBUS 0x22 // not a DLN module
+#define DLN2_MODULE_FREQ 0x23 // not a DLN module
 
 enum dln2_handle {
   DLN2_HANDLE_EVENT = 0,
@@ -35,6 +42,12 @@ enum dln2_handle {
   DLN2_HANDLE_I2C,
   DLN2_HANDLE_SPI,
   DLN2_HANDLE_ADC,
+  DLN2_HANDLE_COUNTER,
+  DLN2_HANDLE_FREQ,
+  DLN2_HANDLE_PWM,
+  DLN2_HANDLE_DAC,
+  DLN2_HANDLE_ONEWIRE,
+  DLN2_HANDLE_PARBUS,
   DLN2_HANDLES,
   DLN2_HANDLE_UNUSED = 0xffff,
 };
@@ -52,10 +65,16 @@ struct dln2_response {
 } TU_ATTR_PACKED;
 
 #define DLN2_MAX_SLOTS 16
-#define DLN2_BUF_SIZE (256 + sizeof(struct dln2_response))
+// Room for a 256 byte SPI transfer behind its 12 byte command/response header
+#define DLN2_BUF_SIZE (256 + sizeof(struct dln2_response) + 2)
+
+// DMA moves SPI data straight to and from the slots, payloads at offset 12
+#ifndef DLN2_SLOT_ALIGN
+#define DLN2_SLOT_ALIGN 4
+#endif
 
 struct dln2_slot {
-  uint8_t data[DLN2_BUF_SIZE];
+  uint8_t data[DLN2_BUF_SIZE] TU_ATTR_ALIGNED(DLN2_SLOT_ALIGN);
   uint32_t index;
   size_t len;
   struct dln2_slot *next;
@@ -137,6 +156,8 @@ static inline void put_unaligned_le16(uint16_t val, void *p) {
 void _dln2_print_slot(struct dln2_slot *slot, uint32_t indent,
                       const char *caller);
 
+void dln2_slot_enqueue(struct dln2_slot_queue *queue, struct dln2_slot *slot);
+struct dln2_slot *dln2_slot_dequeue(struct dln2_slot_queue *queue);
 struct dln2_slot *dln2_get_slot(void);
 void dln2_queue_slot_in(struct dln2_slot *slot);
 
@@ -150,16 +171,54 @@ bool dln2_response_u16(struct dln2_slot *slot, uint16_t val);
 bool dln2_response_u32(struct dln2_slot *slot, uint32_t val);
 bool dln2_response_error(struct dln2_slot *slot, uint16_t result);
 
-void dln2_pin_set_available(uint32_t mask);
+// Largest number of pins the pin table and the GPIO bitmaps can track
+#ifndef DLN2_PIN_MAX
+#define DLN2_PIN_MAX 128
+#endif
+
+#define DLN2_PIN_WORDS DLN2_BITMAP_WORDS(DLN2_PIN_MAX)
+#define DLN2_PIN_NOT_AVAILABLE 0xff
+
+// Pin and owner that made a group request or free fail
+struct dln2_pin_conflict {
+  uint16_t pin;
+  uint8_t module;
+};
+
+// Add a pin to a DLN2_PIN_WORDS sized pin mask
+static inline bool dln2_pin_mask_add(uint32_t *mask, uint16_t pin) {
+  if (pin >= DLN2_PIN_MAX)
+    return false;
+  dln2_bitmap_set(mask, pin);
+  return true;
+}
+
+void dln2_pin_set_available(const uint32_t *mask, uint16_t pin_count);
 bool dln2_pin_is_requested(uint16_t pin, uint8_t module);
 uint16_t dln2_pin_request(uint16_t pin, uint8_t module);
 uint16_t dln2_pin_free(uint16_t pin, uint8_t module);
+uint8_t dln2_pin_owner(uint16_t pin);
+uint32_t dln2_pin_module_word(uint8_t module, uint16_t word);
+uint16_t dln2_pin_group_request(const uint32_t *mask, uint8_t module,
+                                struct dln2_pin_conflict *conflict);
+uint16_t dln2_pin_group_free(const uint32_t *mask, uint8_t module,
+                             struct dln2_pin_conflict *conflict);
 
 struct dln2_peripherials {
   struct gpio_driver *gpio;
   struct adc_driver *adc;
   struct i2c_master_driver *i2c_master;
   struct spi_master_driver *spi_master;
+  struct counter_driver *counter;
+  struct freq_driver *freq;
+  struct pwm_driver *pwm;
+  struct dac_driver *dac;
+
+  // Bit-banged buses on GPIO pins, numbered after the hardware controllers
+  struct i2c_master_config *i2c_bitbang;
+  uint8_t i2c_bitbang_count;
+  struct spi_master *spi_bitbang;
+  uint8_t spi_bitbang_count;
 };
 
 void dln2_delay(uint32_t millisec);
@@ -168,9 +227,30 @@ void dln2_gpio_task();
 bool dln2_handle_gpio(struct dln2_slot *slot);
 void dln2_i2c_master_init(struct dln2_peripherials *peripherals);
 bool dln2_handle_i2c(struct dln2_slot *slot);
+void dln2_i2c_master_task(void);
+struct i2c_master_driver *
+dln2_i2c_bitbang_attach(struct i2c_master_driver *hw,
+                        const struct i2c_master_config *config,
+                        uint8_t count);
 void dln2_spi_master_init(struct dln2_peripherials *peripherals);
 bool dln2_handle_spi(struct dln2_slot *slot);
+void dln2_spi_master_task(void);
+struct spi_master_driver *
+dln2_spi_bitbang_attach(struct spi_master_driver *hw,
+                        const struct spi_master *master, uint8_t count);
 void dln2_adc_init(struct dln2_peripherials *peripherals);
 bool dln2_handle_adc(struct dln2_slot *slot);
+void dln2_counter_init(struct dln2_peripherials *peripherals);
+void dln2_counter_task(void);
+bool dln2_handle_counter(struct dln2_slot *slot);
+void dln2_freq_init(struct dln2_peripherials *peripherals);
+void dln2_freq_task(void);
+bool dln2_handle_freq(struct dln2_slot *slot);
+void dln2_pwm_init(struct dln2_peripherials *peripherals);
+bool dln2_handle_pwm(struct dln2_slot *slot);
+void dln2_dac_init(struct dln2_peripherials *peripherals);
+bool dln2_handle_dac(struct dln2_slot *slot);
+bool dln2_handle_onewire(struct dln2_slot *slot);
+bool dln2_handle_parbus(struct dln2_slot *slot);
 
 #endif
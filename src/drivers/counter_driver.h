@@ -0,0 +1,57 @@
+#ifndef _COUNTER_DRIVER_H_
+#define _COUNTER_DRIVER_H_
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum counter_mode {
+  COUNTER_MODE_EDGE_RISE = 0, ///< Count rising edges on pin_a
+  COUNTER_MODE_EDGE_FALL,     ///< Count falling edges on pin_a
+  COUNTER_MODE_EDGE_BOTH,     ///< Count both edges on pin_a
+  COUNTER_MODE_DIRECTION,     ///< Rising edges on pin_a, pin_b high counts down
+  COUNTER_MODE_QUADRATURE,    ///< Quadrature decoding of pin_a/pin_b, x4
+};
+
+/*
+ * Called from interrupt context when the hardware counter of a port wrapped,
+ * delta is the signed number of counts that were folded away (e.g. +65536 when
+ * a 16-bit timer counting up passed its top).
+ */
+typedef void (*counter_wrap_callback_t)(uint8_t port, int32_t delta);
+
+struct counter_port {
+  uint16_t pin_a; ///< Count input, quadrature A
+  uint16_t pin_b; ///< Direction input, quadrature B
+};
+
+/*
+ * Hardware pulse counters (ESP32 PCNT units, STM32 timers in external clock
+ * or encoder mode). The pins are given as DLN pin numbers.
+ */
+struct counter_driver {
+  uint8_t port_count;
+  struct counter_port *ports;
+
+  /*! \brief Configure the port's counter for a mode, clear and start it
+   *
+   * \return false if the hardware can't count in this mode
+   */
+  bool (*enable)(uint8_t port, enum counter_mode mode);
+  void (*disable)(uint8_t port);
+
+  /*! \brief Read the hardware counter
+   *
+   * The value is relative to the last wrap reported to the wrap callback.
+   */
+  int32_t (*get)(uint8_t port);
+  void (*clear)(uint8_t port);
+
+  /*! \brief Stop or resume counting without losing the count */
+  void (*suspend)(uint8_t port, bool suspend);
+
+  void (*set_wrap_callback)(counter_wrap_callback_t callback);
+};
+
+#endif
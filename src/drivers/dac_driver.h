@@ -0,0 +1,42 @@
+#ifndef _DAC_DRIVER_H_
+#define _DAC_DRIVER_H_
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Called from interrupt context when half of the stream buffer has been
+ * played out, samples points at that half and may be refilled right away.
+ */
+typedef void (*dac_stream_callback_t)(uint16_t *samples, uint32_t count);
+
+struct dac_port {
+  uint8_t channel_count;
+  uint8_t bits;   ///< Resolution, values are right aligned
+  uint16_t *pins; ///< DLN pin number of each channel
+};
+
+// DAC channels (ESP32 DAC, STM32 DAC)
+struct dac_driver {
+  uint8_t port_count;
+  struct dac_port *ports;
+
+  bool (*channel_enable)(uint8_t port, uint8_t channel);
+  void (*channel_disable)(uint8_t port, uint8_t channel);
+  void (*write)(uint8_t port, uint8_t channel, uint16_t value);
+
+  /*! \brief Play buf in a loop at a fixed rate, e.g. timer triggered DMA
+   *
+   * The callback is called each time one half of buf has been played.
+   *
+   * \return the rate the hardware runs at or 0 if it can't stream
+   */
+  uint32_t (*stream_start)(uint8_t port, uint8_t channel, uint32_t rate_hz,
+                           uint16_t *buf, uint32_t len,
+                           dac_stream_callback_t callback);
+  void (*stream_stop)(uint8_t port, uint8_t channel);
+};
+
+#endif
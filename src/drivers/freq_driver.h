@@ -0,0 +1,38 @@
+#ifndef _FREQ_DRIVER_H_
+#define _FREQ_DRIVER_H_
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Called from interrupt context with captured signal periods, in ticks of
+ * clock_hz. A driver can report every period (periods = 1) or sum up several,
+ * e.g. from a DMA buffer of capture registers, to keep the interrupt rate
+ * down. When the timer runs a full cycle without an edge it reports
+ * periods = 0 with the elapsed ticks so a stopped signal reads as 0 Hz.
+ */
+typedef void (*freq_capture_callback_t)(uint8_t port, uint32_t periods,
+                                        uint32_t period_ticks,
+                                        uint32_t high_ticks);
+
+struct freq_port {
+  uint16_t pin;
+};
+
+/*
+ * Input capture on timer channels (STM32 TIMx in PWM input mode, ESP32 MCPWM
+ * capture). Each port measures the period and high time of one pin.
+ */
+struct freq_driver {
+  uint8_t port_count;
+  struct freq_port *ports;
+  uint32_t clock_hz; ///< Capture timer tick rate
+
+  bool (*enable)(uint8_t port);
+  void (*disable)(uint8_t port);
+  void (*set_capture_callback)(freq_capture_callback_t callback);
+};
+
+#endif
@@ -7,6 +7,8 @@
 #include <stdint.h>
 
 typedef void (*gpio_irq_callback_t)(unsigned int gpio, uint32_t event_mask);
+typedef void (*gpio_timer_callback_t)(void);
+typedef void (*gpio_sample_callback_t)(const uint32_t *samples, uint32_t count);
 
 struct gpio_driver {
   uint32_t gpio_count;
@@ -38,6 +40,103 @@ struct gpio_driver {
   void (*intr_enable)(uint32_t gpio);
   void (*set_irq_callback)(gpio_irq_callback_t callback);
   void (*uninstall_irq_callback)(void);
+
+  /*! \brief Read the input level of several pins at once
+   *
+   * GPIOs are grouped in ports of 32 consecutive GPIO numbers, port 0 holds
+   * GPIOs 0-31, port 1 GPIOs 32-63 and so on. Bit n of the mask and of the
+   * returned value corresponds to GPIO (port * 32 + n). These are the
+   * driver's own GPIO numbers like for the other ops, the caller has already
+   * translated the DLN pins through pins[].
+   *
+   * Optional, when NULL the pins are read one by one using get().
+   *
+   * \param port Physical port number
+   * \param mask GPIOs to read
+   * \return Input levels, bits not in mask are zero
+   */
+  uint32_t (*port_get)(uint32_t port, uint32_t mask);
+
+  /*! \brief Read the output latch of several pins at once
+   *
+   * Optional, when NULL the pins are read one by one using get_out_level().
+   */
+  uint32_t (*port_get_out_level)(uint32_t port, uint32_t mask);
+
+  /*! \brief Drive several output pins high and low in one operation
+   *
+   * Should be implemented with a single register write where the hardware
+   * allows it (GPIO_OUT_W1TS/GPIO_OUT_W1TC on ESP32, BSRR on STM32) so that
+   * all pins change at the same time. A pin is never in both masks. Port and
+   * masks are physical, see port_get().
+   *
+   * Optional, when NULL the pins are written one by one using put().
+   *
+   * \param port Physical port number
+   * \param set_mask GPIOs to drive high
+   * \param clr_mask GPIOs to drive low
+   */
+  void (*port_set_clr)(uint32_t port, uint32_t set_mask, uint32_t clr_mask);
+
+  /*! \brief Arm a one-shot hardware timer
+   *
+   * Calls callback from interrupt context delay_us microseconds after the
+   * call. Arming the timer again from the callback must be supported. Used
+   * for on-device timed GPIO sequences.
+   *
+   * Optional, features that need it are not supported when NULL.
+   *
+   * \param delay_us Delay in microseconds, at least 1
+   * \param callback Function to call when the timer expires
+   * \return true if the timer was armed
+   */
+  bool (*timer_start_us)(uint32_t delay_us, gpio_timer_callback_t callback);
+
+  /*! \brief Cancel the one-shot timer if it is armed
+   */
+  void (*timer_stop)(void);
+
+  /*! \brief Start sampling a port at a fixed rate into a double buffer
+   *
+   * Samples the input register of port (timer triggered DMA or similar)
+   * into buf, which is used as two halves of len / 2 samples. callback is
+   * called from interrupt context with each half as it fills up, sampling
+   * continues into the other half.
+   *
+   * Optional, when NULL the samples are taken with the one-shot timer. Only
+   * used for ports where pins[] is the identity.
+   *
+   * \param port Physical port number
+   * \param rate_hz Requested sample rate
+   * \param buf Sample buffer
+   * \param len Number of samples in buf, even
+   * \param callback Function to call with a full half
+   * \return Achieved sample rate in Hz, 0 on failure
+   */
+  uint32_t (*sample_start)(uint32_t port, uint32_t rate_hz, uint32_t *buf,
+                           uint32_t len, gpio_sample_callback_t callback);
+
+  /*! \brief Stop sampling started with sample_start()
+   */
+  void (*sample_stop)(void);
+
+  /*! \brief Busy-wait for a number of microseconds
+   *
+   * Used by the bit-banged buses, should be accurate to about a microsecond.
+   *
+   * Optional, the bit-banged buses are not supported when NULL.
+   */
+  void (*delay_us)(uint32_t us);
+
+  /*! \brief Keep interrupts from stretching a timing critical bus slot
+   *
+   * critical_enter() returns state that is handed back to critical_exit(),
+   * e.g. the saved interrupt mask. Sections last at most about 100us.
+   *
+   * Optional, the slots are then run with interrupts enabled.
+   */
+  uint32_t (*critical_enter)(void);
+  void (*critical_exit)(uint32_t state);
 };
 
 #endif
@@ -1,5 +1,35 @@
+#include <stdbool.h>
 #include <stdint.h>
 
+// Returned by optional ops that a port doesn't implement
+#define I2C_MASTER_ERR_NOT_SUPPORTED (-95)
+
+// Bus errors, the I2C module clears the bus and re-inits the port on these
+#define I2C_MASTER_ERR_ARB_LOST (-11)
+#define I2C_MASTER_ERR_BUS_BUSY (-16)
+#define I2C_MASTER_ERR_TIMEOUT (-110)
+
+#define I2C_MASTER_MSG_READ 0x01
+// SMBus block read, the first byte read is the count of bytes that follow.
+// len is 1 (2 with PEC) and the driver adds the count, at most 32.
+#define I2C_MASTER_MSG_RECV_LEN 0x02
+#define I2C_MASTER_SMBUS_BLOCK_MAX 32
+
+// One message of a combined transfer, like struct i2c_msg in Linux
+struct i2c_master_msg
+{
+    uint8_t addr;
+    uint8_t flags;
+    uint16_t len;
+    uint8_t *buf;
+};
+
+// Completion of a submitted transfer, result as returned by transfer()
+typedef void (*i2c_master_done_t)(uint8_t port_num, int32_t result, void *ctx);
+
+// Called from interrupt context on every expiry of the polling timer
+typedef void (*i2c_master_timer_callback_t)(void);
+
 struct i2c_master_config
 {
     const char *name;
@@ -60,4 +90,78 @@ struct i2c_master_driver
      * @return true if the port is enabled, false otherwise.
      */
     bool (*is_enabled)(uint8_t port_num);
+
+    /**
+     * @brief Set the SCL frequency of a port.
+     * May be called before init(), the port then starts at this frequency.
+     * @param port_num The I2C master port number.
+     * @param freq The requested frequency in Hz, up to 1 MHz for fast-mode plus.
+     * @return The frequency the port runs at, the closest lower one the hardware
+     *         supports, or 0 if it can't go that low.
+     */
+    uint32_t (*set_freq)(uint8_t port_num, uint32_t freq);
+
+    /**
+     * @brief Get the SCL frequency of a port.
+     * @param port_num The I2C master port number.
+     * @return The frequency the port runs at in Hz.
+     */
+    uint32_t (*get_freq)(uint8_t port_num);
+
+    /**
+     * @brief Run several messages as one bus transaction.
+     * Each message after the first starts with a repeated START, the last one
+     * ends with a STOP. The last byte of each read message is NACKed.
+     * Optional, may also return I2C_MASTER_ERR_NOT_SUPPORTED for some ports.
+     * @param port_num The I2C master port number.
+     * @param msgs The messages, read data is stored in their buffers.
+     * @param count The number of messages.
+     * @param timeout_ms Timeout for the whole transaction.
+     * @return The number of messages completed, or a negative error code if the
+     *         first address was not acknowledged or the bus failed.
+     */
+    int32_t (*transfer)(uint8_t port_num, struct i2c_master_msg *msgs,
+                        uint8_t count, uint32_t timeout_ms);
+
+    /**
+     * @brief Check if a device answers, address only (START, address, STOP).
+     * Optional, may also return I2C_MASTER_ERR_NOT_SUPPORTED for some ports.
+     * @param port_num The I2C master port number.
+     * @param addr The I2C slave device address.
+     * @param timeout_ms Timeout, short since most addresses are empty.
+     * @return 0 if the address was acknowledged, or a negative error code.
+     */
+    int32_t (*probe)(uint8_t port_num, uint8_t addr, uint32_t timeout_ms);
+
+    /**
+     * @brief Start a combined transfer that runs in the background, interrupt
+     * or DMA driven, like transfer() otherwise.
+     * The messages and their buffers stay valid until done is called, which
+     * may happen from interrupt context. A timeout is reported through done.
+     * Optional, may also return I2C_MASTER_ERR_NOT_SUPPORTED for some ports.
+     * @param port_num The I2C master port number.
+     * @param msgs The messages, read data is stored in their buffers.
+     * @param count The number of messages.
+     * @param timeout_ms Timeout for the whole transaction.
+     * @param done Called once with the result when the transfer has ended.
+     * @param ctx Passed to done.
+     * @return 0 if the transfer was started, or a negative error code.
+     */
+    int32_t (*submit)(uint8_t port_num, struct i2c_master_msg *msgs,
+                      uint8_t count, uint32_t timeout_ms,
+                      i2c_master_done_t done, void *ctx);
+
+    /**
+     * @brief Start the repeating timer that paces register polling.
+     * Optional, register polling is not available without it.
+     * @param period_us The timer period.
+     * @param callback Called on every expiry.
+     * @return true if the timer runs.
+     */
+    bool (*timer_start_us)(uint32_t period_us, i2c_master_timer_callback_t callback);
+
+    /**
+     * @brief Stop the polling timer.
+     */
+    void (*timer_stop)(void);
 };
@@ -0,0 +1,54 @@
+#ifndef _PWM_DRIVER_H_
+#define _PWM_DRIVER_H_
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Duty cycle full scale, 0.01% units
+#define PWM_DUTY_MAX 10000
+
+struct pwm_port {
+  uint8_t channel_count;
+  uint16_t *pins; ///< DLN pin number of each channel
+};
+
+/*
+ * PWM outputs (ESP32 LEDC, STM32 timer output compare). Channels that share
+ * a hardware timer share their frequency, set_freq() on one of them returns
+ * what the timer ended up with.
+ */
+struct pwm_driver {
+  uint8_t port_count;
+  struct pwm_port *ports;
+
+  bool (*port_enable)(uint8_t port);
+  void (*port_disable)(uint8_t port);
+
+  /*! \brief Start or stop driving the channel's pin */
+  void (*channel_enable)(uint8_t port, uint8_t channel, bool enable);
+
+  /*! \brief Set the channel frequency
+   *
+   * \return the frequency the hardware runs at, closest lower one, or 0 if
+   *         out of range
+   */
+  uint32_t (*set_freq)(uint8_t port, uint8_t channel, uint32_t freq_hz);
+
+  /*! \brief Set the channel duty cycle, 0 - PWM_DUTY_MAX
+   *
+   * \return the duty cycle the hardware resolution allows
+   */
+  uint16_t (*set_duty)(uint8_t port, uint8_t channel, uint16_t duty);
+
+  /*! \brief Hold back set_freq()/set_duty() until update_commit() (optional)
+   *
+   * Used for multi-channel updates, e.g. with STM32 preload registers or the
+   * LEDC update bits, so all channels change on the same period boundary.
+   */
+  void (*update_begin)(uint8_t port);
+  void (*update_commit)(uint8_t port);
+};
+
+#endif
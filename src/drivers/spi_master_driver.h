@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdint.h>
 
 struct spi_master
@@ -17,9 +18,92 @@ struct spi_slave
   uint16_t cs_pin;
 };
 
+// Completion of a submitted transfer, ok as returned by transfer()
+typedef void (*spi_master_done_t)(uint8_t port, bool ok, void *ctx);
+
 struct spi_master_driver
 {
   uint16_t master_count;
   struct spi_master *master;
   void (*init)(struct spi_master master);
+
+  /*! \brief Set up the port's pins and controller from master[port]
+   *
+   * \return true on success
+   */
+  bool (*enable)(uint8_t port);
+  void (*disable)(uint8_t port);
+
+  /*! \brief Set the SCK frequency
+   *
+   * May be called while the port is disabled.
+   *
+   * \return the frequency the port runs at, closest lower one
+   */
+  uint32_t (*set_freq)(uint8_t port, uint32_t freq_hz);
+
+  /*! \brief The SCK frequency range of a port
+   *
+   * Optional, the frequency in master[port] is reported for both without it.
+   */
+  uint32_t (*get_min_freq)(uint8_t port);
+  uint32_t (*get_max_freq)(uint8_t port);
+
+  /*! \brief Set the clock mode (CPHA bit 0, CPOL bit 1) and bits per frame
+   *
+   * Frames wider than 8 bits take two bytes in the buffers, little endian.
+   *
+   * \return false if the port doesn't support the format
+   */
+  bool (*set_format)(uint8_t port, uint8_t mode, uint8_t bpw);
+
+  /*! \brief Full duplex transfer, MSB first
+   *
+   * Either buffer may be NULL, zeros are clocked out when tx is NULL.
+   * Chip select is handled by the caller.
+   *
+   * \return true on success
+   */
+  bool (*transfer)(uint8_t port, const uint8_t *tx, uint8_t *rx,
+                   uint16_t len);
+
+  /*! \brief Drive a chip select, cs indexes master[port].slave
+   *
+   * The caller deasserts each chip select when the host enables it. If the
+   * op is missing or returns false then, the caller drives slave[cs].cs_pin
+   * as an active low GPIO instead.
+   *
+   * \return false if the port can't drive that chip select
+   */
+  bool (*set_cs)(uint8_t port, uint8_t cs, bool active);
+
+  /*! \brief Have the controller time the chip select and frame gaps itself
+   *
+   * setup_ns is the delay from chip select assertion to the first clock
+   * edge, gap_ns the idle time between frames. Applies to the chip selects
+   * driven by set_cs(). Optional, the caller times the gaps in software
+   * without it.
+   *
+   * \return false if the port can't produce these delays
+   */
+  bool (*set_cs_timing)(uint8_t port, uint32_t setup_ns, uint32_t gap_ns);
+
+  /*! \brief Busy wait, timed with the CPU cycle counter
+   *
+   * Optional, the caller falls back to the GPIO driver's delay_us().
+   */
+  void (*delay_ns)(uint32_t ns);
+
+  /*! \brief Start a DMA driven transfer, like transfer() otherwise
+   *
+   * The buffers are 4-byte aligned and stay valid until done is called, which
+   * may happen from interrupt context. tx and rx may be the same buffer, so a
+   * frame must not be stored in rx before the frame at that offset was read
+   * from tx. Optional, the caller falls back to transfer() when it's missing
+   * or returns false.
+   *
+   * \return true if the transfer was started
+   */
+  bool (*submit)(uint8_t port, const uint8_t *tx, uint8_t *rx, uint16_t len,
+                 spi_master_done_t done, void *ctx);
 };
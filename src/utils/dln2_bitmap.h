@@ -0,0 +1,50 @@
+#ifndef _DLN2_BITMAP_H_
+#define _DLN2_BITMAP_H_
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Fixed size bitmaps made of 32-bit words, bit n lives in word n / 32
+
+#define DLN2_BITMAP_WORD_BITS 32
+#define DLN2_BITMAP_WORDS(bits)                                                \
+  (((bits) + DLN2_BITMAP_WORD_BITS - 1) / DLN2_BITMAP_WORD_BITS)
+#define DLN2_DECLARE_BITMAP(name, bits) uint32_t name[DLN2_BITMAP_WORDS(bits)]
+
+// Iterate over the set bits of the first nbits bits, one word at a time
+#define dln2_bitmap_for_each_set(bit, map, nbits)                              \
+  for (uint32_t _w = 0, _word; _w < DLN2_BITMAP_WORDS(nbits); _w++)            \
+    for (_word = (map)[_w] & dln2_bitmap_word_mask(_w, (nbits));               \
+         _word && (((bit) = _w * DLN2_BITMAP_WORD_BITS + __builtin_ctz(_word)), \
+                   1);                                                         \
+         _word &= _word - 1)
+
+// Mask of the valid bits in word w of a bitmap holding nbits bits
+static inline uint32_t dln2_bitmap_word_mask(uint32_t w, uint32_t nbits) {
+  uint32_t rem = nbits - w * DLN2_BITMAP_WORD_BITS;
+  return rem >= DLN2_BITMAP_WORD_BITS ? 0xffffffff : (1U << rem) - 1;
+}
+
+static inline bool dln2_bitmap_test(const uint32_t *map, uint32_t bit) {
+  return (map[bit / DLN2_BITMAP_WORD_BITS] >> (bit % DLN2_BITMAP_WORD_BITS)) &
+         1U;
+}
+
+static inline void dln2_bitmap_set(uint32_t *map, uint32_t bit) {
+  map[bit / DLN2_BITMAP_WORD_BITS] |= 1U << (bit % DLN2_BITMAP_WORD_BITS);
+}
+
+static inline void dln2_bitmap_clear(uint32_t *map, uint32_t bit) {
+  map[bit / DLN2_BITMAP_WORD_BITS] &= ~(1U << (bit % DLN2_BITMAP_WORD_BITS));
+}
+
+static inline void dln2_bitmap_assign(uint32_t *map, uint32_t bit, bool val) {
+  if (val)
+    dln2_bitmap_set(map, bit);
+  else
+    dln2_bitmap_clear(map, bit);
+}
+
+#endif